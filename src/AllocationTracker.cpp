@@ -0,0 +1,222 @@
+#include "AllocationTracker.h"
+
+#if defined ALLOCATION_TRACKING
+
+#include "ofMain.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+    thread_local AllocationTracker::Subsystem   t_subsystem = AllocationTracker::kOther;
+    
+    std::atomic_size_t  s_allocations[ AllocationTracker::kSubsystemCount ];
+    std::atomic_size_t  s_bytes[       AllocationTracker::kSubsystemCount ];
+    
+    size_t              s_frameAllocations[ AllocationTracker::kSubsystemCount ];
+    size_t              s_frameBytes[       AllocationTracker::kSubsystemCount ];
+    std::atomic_size_t  s_framesSinceWarmup( 0 );   // restarted from the workers too
+}
+
+AllocationTracker::Scope::Scope( Subsystem _subsystem ) :
+    m_previous( t_subsystem )
+{
+    t_subsystem = _subsystem;
+}
+
+AllocationTracker::Scope::~Scope( void )
+{
+    t_subsystem = m_previous;
+}
+
+void AllocationTracker::beginFrame( void )
+{
+    for ( size_t i = 0; i < kSubsystemCount; ++i )
+    {
+        s_allocations[ i ] = 0;
+        s_bytes[ i ]       = 0;
+    }
+}
+
+bool AllocationTracker::endFrame( void )
+{
+    // snapshot before doing anything that could allocate
+    for ( size_t i = 0; i < kSubsystemCount; ++i )
+    {
+        s_frameAllocations[ i ] = s_allocations[ i ];
+        s_frameBytes[ i ]       = s_bytes[ i ];
+    }
+    
+    if ( ++s_framesSinceWarmup <= s_warmupFrames )
+    {
+        return true;
+    }
+    
+    bool steady = s_frameAllocations[ kEmitter ] == 0 && s_frameAllocations[ kParticles ] == 0 && s_frameAllocations[ kAudio ] == 0;
+    
+    if ( !steady )
+    {
+        for ( size_t i = 0; i < kSubsystemCount; ++i )
+        {
+            if ( s_frameAllocations[ i ] > 0 )
+            {
+                ofLogError( "AllocationTracker" ) << name( static_cast< Subsystem >( i ) ) << ": "
+                    << s_frameAllocations[ i ] << " allocations, " << s_frameBytes[ i ] << " bytes in frame " << ofGetFrameNum();
+            }
+        }
+#if defined ALLOCATION_TRACKING_STRICT
+        assert( steady && "heap allocation in the steady state frame loop" );
+#endif
+    }
+    
+    return steady;
+}
+
+void AllocationTracker::restartWarmup( void )
+{
+    s_framesSinceWarmup = 0;
+}
+
+size_t AllocationTracker::frameAllocations( Subsystem _subsystem )
+{
+    return s_frameAllocations[ _subsystem ];
+}
+
+size_t AllocationTracker::frameBytes( Subsystem _subsystem )
+{
+    return s_frameBytes[ _subsystem ];
+}
+
+const char* AllocationTracker::name( Subsystem _subsystem )
+{
+    static const char* names[ kSubsystemCount ] = { "Other", "Emitter", "Particles", "Video", "Audio", "Post Processing", "Audio Libraries" };
+    return names[ _subsystem ];
+}
+
+void AllocationTracker::record( size_t _bytes )
+{
+    s_allocations[ t_subsystem ].fetch_add( 1,      std::memory_order_relaxed );
+    s_bytes[ t_subsystem ].fetch_add(       _bytes, std::memory_order_relaxed );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// global allocation hooks
+
+void* operator new( std::size_t _size )
+{
+    AllocationTracker::record( _size );
+    
+    if ( void* p = std::malloc( _size ? _size : 1 ) )
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[]( std::size_t _size )
+{
+    return operator new( _size );
+}
+
+void* operator new( std::size_t _size, const std::nothrow_t& ) noexcept
+{
+    AllocationTracker::record( _size );
+    return std::malloc( _size ? _size : 1 );
+}
+
+void* operator new[]( std::size_t _size, const std::nothrow_t& _nothrow ) noexcept
+{
+    return operator new( _size, _nothrow );
+}
+
+#if defined( __cpp_aligned_new )
+void* operator new( std::size_t _size, std::align_val_t _alignment )
+{
+    AllocationTracker::record( _size );
+    
+    void* p = nullptr;
+    if ( posix_memalign( &p, std::max( static_cast< std::size_t >( _alignment ), sizeof( void* ) ), _size ? _size : 1 ) == 0 )
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[]( std::size_t _size, std::align_val_t _alignment )
+{
+    return operator new( _size, _alignment );
+}
+
+void* operator new( std::size_t _size, std::align_val_t _alignment, const std::nothrow_t& ) noexcept
+{
+    try
+    {
+        return operator new( _size, _alignment );
+    }
+    catch ( const std::bad_alloc& )
+    {
+        return nullptr;
+    }
+}
+
+void* operator new[]( std::size_t _size, std::align_val_t _alignment, const std::nothrow_t& _nothrow ) noexcept
+{
+    return operator new( _size, _alignment, _nothrow );
+}
+
+void operator delete( void* _p, std::align_val_t ) noexcept
+{
+    std::free( _p );
+}
+
+void operator delete[]( void* _p, std::align_val_t ) noexcept
+{
+    std::free( _p );
+}
+
+void operator delete( void* _p, std::size_t, std::align_val_t ) noexcept
+{
+    std::free( _p );
+}
+
+void operator delete[]( void* _p, std::size_t, std::align_val_t ) noexcept
+{
+    std::free( _p );
+}
+#endif
+
+void operator delete( void* _p ) noexcept
+{
+    std::free( _p );
+}
+
+void operator delete[]( void* _p ) noexcept
+{
+    std::free( _p );
+}
+
+void operator delete( void* _p, std::size_t ) noexcept
+{
+    std::free( _p );
+}
+
+void operator delete[]( void* _p, std::size_t ) noexcept
+{
+    std::free( _p );
+}
+
+void operator delete( void* _p, const std::nothrow_t& ) noexcept
+{
+    std::free( _p );
+}
+
+void operator delete[]( void* _p, const std::nothrow_t& ) noexcept
+{
+    std::free( _p );
+}
+
+#endif // ALLOCATION_TRACKING
@@ -0,0 +1,66 @@
+#if !defined __ALLOCATION_TRACKER_H__
+#define __ALLOCATION_TRACKER_H__
+
+#include <cstddef>
+
+// Counts heap allocations per frame and per subsystem by hooking the global
+// operator new. It is only compiled in when ALLOCATION_TRACKING is defined
+// (see config.make); otherwise scopes and frame markers are empty inlines.
+//
+// Once a frame is past the warm up, any allocation made by the emitter, its
+// workers or the audio stages is reported as a steady state regression, and
+// with ALLOCATION_TRACKING_STRICT it also trips an assert. Debug builds have
+// both defined (see config.make and the Xcode project); --allocation-check
+// runs the emitter headless in one and exits non-zero on a regression.
+class AllocationTracker
+{
+public:
+    enum Subsystem {
+        kOther                  = 0,
+        kEmitter,               // ParticleEmitter::update on the main thread
+        kParticles,             // emitter worker threads
+        kVideo,
+        kAudio,
+        kPostProcessing,
+        kAudioLibraries,        // inside the FFT and the analyzer, reported but not held to zero
+        kSubsystemCount
+    };
+    
+    // tags every allocation done by the current thread while alive
+    struct Scope
+    {
+#if defined ALLOCATION_TRACKING
+        Scope( Subsystem _subsystem );
+        ~Scope( void );
+        
+        Subsystem               m_previous;
+#else
+        Scope( Subsystem ) {}
+#endif
+    };
+    
+#if defined ALLOCATION_TRACKING
+    static void         beginFrame( void );
+    static bool         endFrame( void );
+    static void         restartWarmup( void );
+    
+    static size_t       frameAllocations( Subsystem _subsystem );
+    static size_t       frameBytes( Subsystem _subsystem );
+    static const char*  name( Subsystem _subsystem );
+    
+    static void         record( size_t _bytes );
+#else
+    static void         beginFrame( void ) {}
+    static bool         endFrame( void ) { return true; }
+    static void         restartWarmup( void ) {}
+    
+    static size_t       frameAllocations( Subsystem ) { return 0; }
+    static size_t       frameBytes( Subsystem ) { return 0; }
+#endif
+    
+    static const size_t s_warmupFrames = 120;
+};
+
+#define ALLOCATION_SCOPE( _subsystem ) AllocationTracker::Scope t_allocationScope( AllocationTracker::_subsystem )
+
+#endif // __ALLOCATION_TRACKER_H__
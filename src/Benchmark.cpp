@@ -0,0 +1,240 @@
+#include "Benchmark.h"
+#include "AllocationTracker.h"
+#include "WorkerPool.h"
+#include "FrameBarrier.h"
+
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#define BENCHMARK_WIDTH         1920
+#define BENCHMARK_HEIGHT        1080
+#define BENCHMARK_GROUPS        16
+#define BENCHMARK_DELTA         ( 1.0f / 60.0f )
+#define BENCHMARK_WARMUP        30
+#define BENCHMARK_FRAMES        120
+#define BENCHMARK_TARGET_MS     ( 1000.0 / 30.0 )   // interactive means at least 30 updates per second
+#define POOL_ROUNDS             5000
+#define POOL_TASKS_PER_WORKER   4
+#define POOL_TASK_NS            5000    // about one particle block
+#define ALLOCATION_PARTICLES    100000
+#define ALLOCATION_FRAMES       600
+#define ALLOCATION_CHECKPOINT   60      // frames between checkpoints, which are part of the steady loop
+
+Benchmark::Benchmark( Mode _mode ) :
+    m_mode( _mode ),
+    m_surface( &m_pixels ),
+    m_particleEmitter( m_surface ),
+    m_time( 0.0f )
+{
+}
+
+void Benchmark::setup( void )
+{
+    ofSetLogLevel( OF_LOG_NOTICE );
+    
+    ParticleEmitter::init();
+    ParticleEmitter::setHighCapacity( true );
+    ParticleEmitter::s_bulkEmission = true;
+    
+    // long lived particles keep the population at the requested count
+    ParticleEmitter::s_minParticleLife = ParticleEmitter::s_minParticleLife.getMax();
+    ParticleEmitter::s_maxParticleLife = ParticleEmitter::s_maxParticleLife.getMax();
+    
+    // synthetic reference surface, smooth enough that the color guidance has gradients to follow
+    m_pixels.allocate( BENCHMARK_WIDTH, BENCHMARK_HEIGHT, OF_PIXELS_RGB );
+    for ( int y = 0; y < BENCHMARK_HEIGHT; ++y )
+    {
+        for ( int x = 0; x < BENCHMARK_WIDTH; ++x )
+        {
+            unsigned char* px = m_pixels.getData() + ( y * BENCHMARK_WIDTH + x ) * 3;
+            px[ 0 ] = static_cast< unsigned char >( 255 * x / BENCHMARK_WIDTH );
+            px[ 1 ] = static_cast< unsigned char >( 255 * y / BENCHMARK_HEIGHT );
+            px[ 2 ] = static_cast< unsigned char >( 127.5f + 127.5f * sin( x * 0.01f ) * cos( y * 0.01f ) );
+        }
+    }
+    m_particleEmitter.m_sizeFactor = 1.0f;
+    
+    int status = m_mode == kAllocations ? runAllocationCheck() : runThroughput();
+    
+    m_particleEmitter.killAll();
+    ofExit( status );
+}
+
+void Benchmark::update( void )
+{
+}
+
+int Benchmark::runThroughput( void )
+{
+    for ( size_t particles : { 100000, 500000, 1000000 } )
+    {
+        Result result = runCase( particles );
+        m_results.push_back( result );
+        
+        ofLogNotice( "Benchmark" ) << result.m_particles << " particles: "
+                                   << result.m_frameMs << " ms/frame, "
+                                   << static_cast< size_t >( result.m_particles * 1000.0 / result.m_frameMs ) << " particles/s";
+    }
+    
+    // the million particle case is the one that has to stay interactive
+    bool passed = m_results.back().m_frameMs <= BENCHMARK_TARGET_MS;
+    ofLogNotice( "Benchmark" ) << ( passed ? "PASS" : "FAIL" ) << ": target is " << BENCHMARK_TARGET_MS << " ms/frame at 1M particles";
+    
+    return passed ? 0 : 1;
+}
+
+// Frames are marked the way ofApp::update does, around the emitter alone; the
+// audio stages need an input device and are not run.
+int Benchmark::runAllocationCheck( void )
+{
+#if defined ALLOCATION_TRACKING
+    ParticleEmitter::s_particleGroups    = BENCHMARK_GROUPS;
+    ParticleEmitter::s_particlesPerGroup = ALLOCATION_PARTICLES / BENCHMARK_GROUPS;
+    
+    std::vector< unsigned char >    checkpoint;
+    size_t                          failed = 0;
+    size_t                          frames = AllocationTracker::s_warmupFrames + ALLOCATION_FRAMES;
+    
+    for ( size_t frame = 0; frame < frames; ++frame )
+    {
+        AllocationTracker::beginFrame();
+        
+        // taken by the workers like the app's, only not written out
+        m_particleEmitter.isCheckpointTaken();
+        if ( frame % ALLOCATION_CHECKPOINT == 0 )
+        {
+            m_particleEmitter.requestCheckpoint( checkpoint );
+        }
+        
+        m_particleEmitter.update( m_time += BENCHMARK_DELTA, BENCHMARK_DELTA );
+        
+        if ( !AllocationTracker::endFrame() )
+        {
+            ++failed;
+        }
+    }
+    
+    m_particleEmitter.waitThreadedUpdate();
+    
+    ofLogNotice( "Benchmark" ) << ( failed == 0 ? "PASS" : "FAIL" ) << ": " << failed << " of " << ALLOCATION_FRAMES << " steady frames allocated";
+    return failed == 0 ? 0 : 1;
+#else
+    ofLogError( "Benchmark" ) << "the allocation check needs a build with ALLOCATION_TRACKING";
+    return 2;
+#endif
+}
+
+Benchmark::Result Benchmark::runCase( size_t _particles )
+{
+    ParticleEmitter::s_particleGroups    = BENCHMARK_GROUPS;
+    ParticleEmitter::s_particlesPerGroup = static_cast< int >( _particles / BENCHMARK_GROUPS );
+    
+    // first update creates the groups and bulk emission fills them to capacity
+    m_particleEmitter.update( m_time += BENCHMARK_DELTA, BENCHMARK_DELTA );
+    
+    for ( int i = 0; i < BENCHMARK_WARMUP; ++i )
+    {
+        m_particleEmitter.update( m_time += BENCHMARK_DELTA, BENCHMARK_DELTA );
+    }
+    
+    auto start = std::chrono::steady_clock::now();
+    
+    for ( int i = 0; i < BENCHMARK_FRAMES; ++i )
+    {
+        m_particleEmitter.update( m_time += BENCHMARK_DELTA, BENCHMARK_DELTA );
+    }
+    
+    // the last step is still running on the pipeline thread
+    m_particleEmitter.waitThreadedUpdate();
+    
+    std::chrono::duration< double, std::milli > elapsed = std::chrono::steady_clock::now() - start;
+    
+    size_t count = 0;
+    for ( auto& particleGroup : m_particleEmitter.m_particles )
+    {
+        count += particleGroup.size();
+    }
+    
+    ofLogNotice( "Benchmark" ) << m_particleEmitter.effectiveParticles() << " of " << count << " particles integrated in the last frame";
+    
+    return { count, elapsed.count() / BENCHMARK_FRAMES };
+}
+
+static int64_t nowNs( void )
+{
+    return std::chrono::duration_cast< std::chrono::nanoseconds >( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+int Benchmark::runPoolBenchmark( void )
+{
+    WorkerPool& pool = WorkerPool::instance();
+    
+    for ( size_t workers : { 1, 2, 4, 8, 16, 32, 64 } )
+    {
+        pool.configure( workers, false, 0 );
+        
+        FrameBarrier                joined;
+        WorkerPool::Job             job;
+        std::atomic_int             tasksLeft( 0 );     // goes negative once drained
+        std::atomic_size_t          joiners( 0 );
+        std::atomic< int64_t >      firstWake( 0 );
+        std::atomic< int64_t >      doneTime( 0 );
+        
+        // drains short tasks off a shared counter like an emitter phase does,
+        // so the workers that wake in time join and the last one out finishes
+        job.m_work = [ & ]( size_t )
+        {
+            int64_t woke = nowNs();
+            int64_t seen = 0;
+            firstWake.compare_exchange_strong( seen, woke );
+            ++joiners;
+            
+            while ( tasksLeft.fetch_sub( 1 ) > 0 )
+            {
+                for ( int64_t end = nowNs() + POOL_TASK_NS; nowNs() < end; );
+            }
+        };
+        job.m_done = [ & ]()
+        {
+            doneTime = nowNs();
+            joined.arrive();
+        };
+        
+        std::vector< double > dispatchUs;
+        std::vector< double > doneUs;
+        size_t                totalJoiners = 0;
+        dispatchUs.reserve( POOL_ROUNDS );
+        doneUs.reserve( POOL_ROUNDS );
+        
+        for ( int round = 0; round < POOL_ROUNDS; ++round )
+        {
+            tasksLeft = int( workers * POOL_TASKS_PER_WORKER );
+            joiners   = 0;
+            firstWake = 0;
+            joined.release( 1 );
+            
+            int64_t postTime = nowNs();
+            pool.post( job );
+            joined.wait();
+            
+            // dispatch: first worker up, done: the last worker out calling m_done
+            dispatchUs.push_back( ( firstWake - postTime ) / 1000.0 );
+            doneUs.push_back( ( doneTime - postTime ) / 1000.0 );
+            totalJoiners += joiners;
+        }
+        
+        std::sort( dispatchUs.begin(), dispatchUs.end() );
+        std::sort( doneUs.begin(), doneUs.end() );
+        
+        ofLogNotice( "Pool" ) << workers << " workers: dispatch "
+                              << dispatchUs[ POOL_ROUNDS / 2 ] << " us median, " << dispatchUs[ POOL_ROUNDS * 99 / 100 ] << " us p99; post to done "
+                              << doneUs[ POOL_ROUNDS / 2 ] << " us median, " << doneUs[ POOL_ROUNDS * 99 / 100 ] << " us p99; "
+                              << double( totalJoiners ) / POOL_ROUNDS << " workers joined on average";
+    }
+    
+    pool.configure( ParticleEmitter::s_workerThreads, ParticleEmitter::s_pinWorkers, ParticleEmitter::s_reservedCores );
+    
+    return 0;
+}
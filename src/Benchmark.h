@@ -0,0 +1,47 @@
+#pragma once
+
+#include "ofMain.h"
+#include "ParticleEmitter.h"
+
+#include <vector>
+
+// Headless throughput run of the particle simulation, started with --benchmark.
+// Updates the emitter against a synthetic surface at fixed particle counts with
+// a fixed time step and reports the cost per frame; needs no window or GL.
+// With --allocation-check it runs the same emitter past the allocation
+// tracker's warm up instead and fails when a steady frame allocates, which
+// takes a build with ALLOCATION_TRACKING (the debug ones).
+class Benchmark : public ofBaseApp
+{
+public:
+    enum Mode {
+        kThroughput,
+        kAllocations
+    };
+    
+    explicit Benchmark( Mode _mode );
+    
+    void setup( void );
+    void update( void );
+    
+    // WorkerPool post to m_done latency at 1 to 64 workers (--pool-benchmark)
+    static int runPoolBenchmark( void );
+
+private:
+    struct Result {
+        size_t                      m_particles;
+        double                      m_frameMs;
+    };
+    
+    Result runCase( size_t _particles );
+    int    runThroughput( void );
+    int    runAllocationCheck( void );
+    
+    // properties
+    Mode                        m_mode;
+    ofPixels                    m_pixels;
+    ofPixels*                   m_surface;
+    ParticleEmitter             m_particleEmitter;
+    float                       m_time;
+    std::vector< Result >       m_results;
+};
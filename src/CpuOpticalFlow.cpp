@@ -0,0 +1,825 @@
+#include "CpuOpticalFlow.h"
+
+#include <algorithm>
+#include <cmath>
+
+#define FLOW_LEVELS             3       // of the pyramid, each half the size of the one above
+#define FLOW_ITERATIONS         2       // per level
+#define FLOW_WINDOW_RADIUS      2       // of the neighbourhood solved for a pixel
+#define FLOW_WINDOW             ( FLOW_WINDOW_RADIUS * 2 + 1 )
+#define FLOW_BAND_ROWS          4       // taken by a worker at a time
+
+// only the blocks that changed are tracked again, the margin covers the
+// windows and the blur reaching into them from the blocks around
+#define FLOW_BLOCK              16      // pixels per side on the first level
+#define FLOW_BLOCK_MARGIN       1       // blocks
+#define FLOW_CHANGE_THRESHOLD   0.004f  // mean luminance difference, above the compression noise
+
+#if defined( __GNUC__ )
+#define FLOW_RESTRICT           __restrict__
+#else
+#define FLOW_RESTRICT           __restrict
+#endif
+
+static size_t clampIndex( ptrdiff_t _index, size_t _size )
+{
+    return static_cast< size_t >( std::min< ptrdiff_t >( std::max< ptrdiff_t >( _index, 0 ), _size - 1 ) );
+}
+
+static float edgeSum( const float* _in, size_t _x, size_t _width, size_t _radius )
+{
+    float sum = 0.0f;
+    
+    for ( ptrdiff_t k = -static_cast< ptrdiff_t >( _radius ); k <= static_cast< ptrdiff_t >( _radius ); ++k )
+    {
+        sum += _in[ clampIndex( static_cast< ptrdiff_t >( _x ) + k, _width ) ];
+    }
+    return sum;
+}
+
+// _out[ x ] = sum of _in[ x - _radius ... x + _radius ] for x in [ _begin, _end ),
+// the edges of the row repeated
+static void boxSumRow( const float* FLOW_RESTRICT _in, float* FLOW_RESTRICT _out, size_t _width, size_t _radius, size_t _begin, size_t _end )
+{
+    size_t begin = std::max( std::min( _radius, _width ), _begin );
+    size_t end   = std::max( std::min( _width > _radius ? _width - _radius : 0, _end ), begin );
+    
+    std::fill( _out + begin, _out + end, 0.0f );
+    
+    for ( ptrdiff_t k = -static_cast< ptrdiff_t >( _radius ); k <= static_cast< ptrdiff_t >( _radius ); ++k )
+    {
+        const float* FLOW_RESTRICT in = _in + k;
+        
+        for ( size_t x = begin; x < end; ++x )
+        {
+            _out[ x ] += in[ x ];
+        }
+    }
+    
+    for ( size_t x = _begin; x < std::min( begin, _end ); ++x )
+    {
+        _out[ x ] = edgeSum( _in, x, _width, _radius );
+    }
+    for ( size_t x = std::max( end, _begin ); x < _end; ++x )
+    {
+        _out[ x ] = edgeSum( _in, x, _width, _radius );
+    }
+}
+
+// _out = sum of the rows _y - _radius ... _y + _radius of _plane, the edges
+// repeated, over _count columns
+static void boxSumColumn( const float* _plane, float* FLOW_RESTRICT _out, size_t _width, size_t _height, size_t _y, size_t _radius, size_t _count )
+{
+    std::fill( _out, _out + _count, 0.0f );
+    
+    for ( ptrdiff_t k = -static_cast< ptrdiff_t >( _radius ); k <= static_cast< ptrdiff_t >( _radius ); ++k )
+    {
+        const float* FLOW_RESTRICT in = _plane + clampIndex( static_cast< ptrdiff_t >( _y ) + k, _height ) * _width;
+        
+        for ( size_t x = 0; x < _count; ++x )
+        {
+            _out[ x ] += in[ x ];
+        }
+    }
+}
+
+static float sampleBilinear( const float* _image, size_t _width, size_t _height, float _x, float _y )
+{
+    float  x  = std::min( std::max( _x, 0.0f ), _width  - 1.0f );
+    float  y  = std::min( std::max( _y, 0.0f ), _height - 1.0f );
+    size_t x0 = std::min( static_cast< size_t >( x ), _width  - 2 );
+    size_t y0 = std::min( static_cast< size_t >( y ), _height - 2 );
+    float  fx = x - x0;
+    float  fy = y - y0;
+    
+    const float* top    = _image + y0 * _width + x0;
+    const float* bottom = top + _width;
+    
+    return ( top[ 0 ]    + ( top[ 1 ]    - top[ 0 ] )    * fx ) * ( 1.0f - fy ) +
+           ( bottom[ 0 ] + ( bottom[ 1 ] - bottom[ 0 ] ) * fx ) * fy;
+}
+
+// _warped comes in and leaves as its difference to _previous times the x gradient
+static void temporalProducts( const float* FLOW_RESTRICT _previous, const float* FLOW_RESTRICT _gx, const float* FLOW_RESTRICT _gy, float* FLOW_RESTRICT _warped,
+                              float* FLOW_RESTRICT _xx, float* FLOW_RESTRICT _xy, float* FLOW_RESTRICT _yy, float* FLOW_RESTRICT _yt, size_t _count )
+{
+    for ( size_t x = 0; x < _count; ++x )
+    {
+        float t = _warped[ x ] - _previous[ x ];
+        
+        _xx[ x ]     = _gx[ x ] * _gx[ x ];
+        _xy[ x ]     = _gx[ x ] * _gy[ x ];
+        _yy[ x ]     = _gy[ x ] * _gy[ x ];
+        _warped[ x ] = _gx[ x ] * t;
+        _yt[ x ]     = _gy[ x ] * t;
+    }
+}
+
+// the flow update from the window sums, by Cramer's rule
+static void solveWindows( const float* FLOW_RESTRICT _xx, const float* FLOW_RESTRICT _xy, const float* FLOW_RESTRICT _yy, const float* FLOW_RESTRICT _xt, const float* FLOW_RESTRICT _yt,
+                          float _lambda, float* FLOW_RESTRICT _flowX, float* FLOW_RESTRICT _flowY, size_t _count )
+{
+    for ( size_t x = 0; x < _count; ++x )
+    {
+        float a       = _xx[ x ] + _lambda;
+        float b       = _xy[ x ];
+        float c       = _yy[ x ] + _lambda;
+        float inverse = 1.0f / ( a * c - b * b );
+        
+        _flowX[ x ] -= ( c * _xt[ x ] - b * _yt[ x ] ) * inverse;
+        _flowY[ x ] -= ( a * _yt[ x ] - b * _xt[ x ] ) * inverse;
+    }
+}
+
+CpuOpticalFlow::CpuOpticalFlow( void ) :
+    m_settings(),
+    m_reported( 0 ),
+    m_blocksX( 0 ),
+    m_blocksY( 0 ),
+    m_activeBlocks( 0 ),
+    m_keep( 0.0f ),
+    m_frames( 1.0f ),
+    m_tracking( false ),
+    m_running( false ),
+    m_pass( 0 ),
+    m_activePass( 0 ),
+    m_rows( 0 ),
+    m_rowList( nullptr ),
+    m_nextRow( 0 )
+{
+    // the shared workers call back into the flow, from any of them
+    m_job.m_work = [ this ]( size_t ){ processRows(); };
+    m_job.m_done = [ this ](){ runNextPass(); };
+}
+
+CpuOpticalFlow::~CpuOpticalFlow( void )
+{
+    wait();
+}
+
+void CpuOpticalFlow::setup( size_t _width, size_t _height, const Settings& _settings )
+{
+    m_settings = _settings;
+    m_tracking = false;
+    m_levels.clear();
+    m_passes.clear();
+    
+    m_blocksX = ( _width  + FLOW_BLOCK - 1 ) / FLOW_BLOCK;
+    m_blocksY = ( _height + FLOW_BLOCK - 1 ) / FLOW_BLOCK;
+    m_changed.assign( m_blocksX * m_blocksY, 0 );
+    m_active.assign( m_blocksX * m_blocksY, 0 );
+    m_wasActive.assign( m_blocksX * m_blocksY, 0 );
+    m_activeBlocks = 0;
+    
+    // every level is worth a couple of windows at least, and a block still
+    // spans a window
+    for ( size_t level = 0, width = _width, height = _height;
+          level < FLOW_LEVELS && width >= FLOW_WINDOW * 2 && height >= FLOW_WINDOW * 2 && ( FLOW_BLOCK >> level ) >= FLOW_WINDOW_RADIUS * 2;
+          ++level, width /= 2, height /= 2 )
+    {
+        m_levels.push_back( Level() );
+        
+        Level& l      = m_levels.back();
+        l.m_width     = width;
+        l.m_height    = height;
+        l.m_blockSize = FLOW_BLOCK >> level;
+        
+        for ( auto plane : { &l.m_previous, &l.m_current, &l.m_previousGradX, &l.m_previousGradY, &l.m_currentGradX, &l.m_currentGradY, &l.m_flowX, &l.m_flowY } )
+        {
+            plane->assign( width * height, 0.0f );
+        }
+        for ( size_t i = 0; i < kProductCount; ++i )
+        {
+            l.m_products[ i ].assign( width * height, 0.0f );
+            l.m_sums[ i ].assign( width * height, 0.0f );
+        }
+        
+        // planned by a worker, which should not allocate
+        l.m_activeRuns.resize( m_blocksY );
+        l.m_clearRuns.resize( m_blocksY );
+        for ( size_t blockRow = 0; blockRow < m_blocksY; ++blockRow )
+        {
+            l.m_activeRuns[ blockRow ].reserve( m_blocksX );
+            l.m_clearRuns[ blockRow ].reserve( m_blocksX );
+        }
+        l.m_activeRows.reserve( height );
+        l.m_clearRows.reserve( height );
+    }
+    
+    if ( m_levels.empty() )
+    {
+        return;
+    }
+    
+    size_t size = _width * _height;
+    
+    for ( auto plane : { &m_shapedX, &m_shapedY, &m_blurX, &m_blurY, &m_smoothX, &m_smoothY } )
+    {
+        plane->assign( size, 0.0f );
+    }
+    
+    for ( auto& flow : m_flows )
+    {
+        flow.allocate( _width, _height, OF_IMAGE_COLOR_ALPHA );
+        flow.set( 0.0f );
+    }
+    
+    // the pyramid of the new frame, the blocks to track, then coarse to fine
+    // tracking and the shaping of the finest flow
+    m_passes.push_back( { kLuminance, 0, false } );
+    for ( size_t level = 1; level < m_levels.size(); ++level )
+    {
+        m_passes.push_back( { kDownsample, level, false } );
+    }
+    for ( size_t level = 0; level < m_levels.size(); ++level )
+    {
+        m_passes.push_back( { kGradients, level, false } );
+    }
+    
+    m_passes.push_back( { kChanges, 0, false } );
+    for ( size_t level = 0; level < m_levels.size(); ++level )
+    {
+        m_passes.push_back( { kClear, level, false } );
+    }
+    
+    for ( size_t level = m_levels.size(); level-- > 0; )
+    {
+        for ( size_t iteration = 0; iteration < FLOW_ITERATIONS; ++iteration )
+        {
+            m_passes.push_back( { kProducts, level, iteration == 0 } );
+            m_passes.push_back( { kWindow,   level, false } );
+            m_passes.push_back( { kSolve,    level, false } );
+        }
+    }
+    
+    m_passes.push_back( { kShape,       0, false } );
+    m_passes.push_back( { kBlurRows,    0, false } );
+    m_passes.push_back( { kBlurColumns, 0, false } );
+    m_passes.push_back( { kDecay,       0, false } );
+}
+
+bool CpuOpticalFlow::isSetup( void ) const
+{
+    return !m_passes.empty();
+}
+
+void CpuOpticalFlow::start( const std::shared_ptr< const ofPixels >& _frame, float _delta, size_t _frames )
+{
+    if ( !isSetup() || m_running || !_frame || !_frame->isAllocated() )
+    {
+        return;
+    }
+    
+    m_frame   = _frame;
+    m_keep    = m_settings.m_timeBlurActive ? std::exp( -m_settings.m_timeBlurDecay * _delta ) : 0.0f;
+    m_frames  = static_cast< float >( std::max< size_t >( _frames, 1 ) );
+    m_running = true;
+    m_pass    = 0;
+    
+    m_done.release( 1 );
+    runNextPass();
+}
+
+bool CpuOpticalFlow::poll( void )
+{
+    return m_done.isDone() && finish();
+}
+
+bool CpuOpticalFlow::wait( void )
+{
+    m_done.wait();
+    return finish();
+}
+
+bool CpuOpticalFlow::isRunning( void ) const
+{
+    return m_running;
+}
+
+const ofFloatPixels& CpuOpticalFlow::getFlow( void ) const
+{
+    return m_flows[ m_reported ];
+}
+
+// the run joined: the flow it wrote is the one reported from now on
+bool CpuOpticalFlow::finish( void )
+{
+    if ( !m_running )
+    {
+        return false;
+    }
+    
+    bool tracked = m_tracking;
+    
+    m_running  = false;
+    m_tracking = true;
+    
+    if ( tracked )
+    {
+        m_reported = 1 - m_reported;
+    }
+    return tracked;
+}
+
+// Grows the changed blocks by the margin into the ones tracked by this run,
+// and finds the ones tracked last time that are not anymore. Both become
+// runs of pixels per row of blocks and lists of rows, on every level. A
+// still frame after another one only empties the lists of rows.
+void CpuOpticalFlow::planBlocks( void )
+{
+    size_t wasActive = m_activeBlocks;
+    
+    m_wasActive.swap( m_active );
+    m_activeBlocks = 0;
+    
+    for ( size_t blockY = 0; blockY < m_blocksY; ++blockY )
+    {
+        for ( size_t blockX = 0; blockX < m_blocksX; ++blockX )
+        {
+            bool active = false;
+            
+            for ( size_t y = blockY > FLOW_BLOCK_MARGIN ? blockY - FLOW_BLOCK_MARGIN : 0; y <= std::min( blockY + FLOW_BLOCK_MARGIN, m_blocksY - 1 ) && !active; ++y )
+            {
+                for ( size_t x = blockX > FLOW_BLOCK_MARGIN ? blockX - FLOW_BLOCK_MARGIN : 0; x <= std::min( blockX + FLOW_BLOCK_MARGIN, m_blocksX - 1 ) && !active; ++x )
+                {
+                    active = m_changed[ y * m_blocksX + x ] != 0;
+                }
+            }
+            
+            m_active[ blockY * m_blocksX + blockX ] = active;
+            m_activeBlocks                         += active;
+        }
+    }
+    
+    // the rows the last frame cleared must not be cleared again on a still one
+    for ( auto& level : m_levels )
+    {
+        level.m_activeRows.clear();
+        level.m_clearRows.clear();
+    }
+    
+    if ( m_activeBlocks == 0 && wasActive == 0 )
+    {
+        return;
+    }
+    
+    for ( auto& level : m_levels )
+    {
+        for ( size_t blockY = 0; blockY < m_blocksY; ++blockY )
+        {
+            auto& activeRuns = level.m_activeRuns[ blockY ];
+            auto& clearRuns  = level.m_clearRuns[ blockY ];
+            
+            activeRuns.clear();
+            clearRuns.clear();
+            
+            for ( size_t blockX = 0; blockX < m_blocksX; ++blockX )
+            {
+                size_t block = blockY * m_blocksX + blockX;
+                size_t begin = std::min( blockX * level.m_blockSize, level.m_width );
+                size_t end   = std::min( begin + level.m_blockSize, level.m_width );
+                
+                // neighbouring blocks join the run before them
+                auto extend = [ & ]( std::vector< Run >& _runs )
+                {
+                    if ( !_runs.empty() && _runs.back().m_end == begin )
+                    {
+                        _runs.back().m_end = end;
+                    }
+                    else if ( begin < end )
+                    {
+                        _runs.push_back( { begin, end } );
+                    }
+                };
+                
+                if ( m_active[ block ] )
+                {
+                    extend( activeRuns );
+                }
+                else if ( m_wasActive[ block ] )
+                {
+                    extend( clearRuns );
+                }
+            }
+            
+            size_t top    = std::min( blockY * level.m_blockSize, level.m_height );
+            size_t bottom = std::min( top + level.m_blockSize, level.m_height );
+            
+            for ( size_t y = top; y < bottom; ++y )
+            {
+                if ( !activeRuns.empty() ) level.m_activeRows.push_back( y );
+                if ( !clearRuns.empty()  ) level.m_clearRows.push_back( y );
+            }
+        }
+    }
+}
+
+// Posts the next pass to the shared workers. Called by start for the first
+// one and by the worker finishing a pass for the rest.
+void CpuOpticalFlow::runNextPass( void )
+{
+    if ( m_pass > 0 && m_passes[ m_activePass ].m_type == kChanges )
+    {
+        planBlocks();
+    }
+    
+    while ( m_pass < m_passes.size() )
+    {
+        const Pass& pass = m_passes[ m_pass ];
+        
+        m_activePass = m_pass++;
+        
+        // the first frame only builds the pyramid the next one is tracked from
+        if ( !m_tracking && pass.m_type > kGradients )
+        {
+            continue;
+        }
+        
+        // the frame was read, its slot can go back to the video ring
+        if ( pass.m_type != kLuminance )
+        {
+            m_frame.reset();
+        }
+        
+        const Level& level = m_levels[ pass.m_level ];
+        
+        switch ( pass.m_type )
+        {
+            case kChanges:  m_rowList = nullptr;              m_rows = m_blocksY;           break;
+            case kClear:    m_rowList = &level.m_clearRows;   m_rows = m_rowList->size();   break;
+            case kDecay:
+            case kLuminance:
+            case kDownsample:
+            case kGradients:m_rowList = nullptr;              m_rows = level.m_height;      break;
+            default:        m_rowList = &level.m_activeRows;  m_rows = m_rowList->size();   break;
+        }
+        
+        // nothing changed, or nothing to clear
+        if ( m_rows == 0 )
+        {
+            continue;
+        }
+        
+        m_nextRow = 0;
+        WorkerPool::instance().post( m_job );
+        return;
+    }
+    
+    // the new frame is the old one of the next run
+    for ( auto& level : m_levels )
+    {
+        level.m_previous.swap( level.m_current );
+        level.m_previousGradX.swap( level.m_currentGradX );
+        level.m_previousGradY.swap( level.m_currentGradY );
+    }
+    
+    m_frame.reset();
+    m_done.arrive();
+}
+
+void CpuOpticalFlow::processRows( void )
+{
+    const Pass& pass = m_passes[ m_activePass ];
+    
+    for ( size_t band = m_nextRow.fetch_add( FLOW_BAND_ROWS ); band < m_rows; band = m_nextRow.fetch_add( FLOW_BAND_ROWS ) )
+    {
+        for ( size_t i = band; i < std::min< size_t >( band + FLOW_BAND_ROWS, m_rows ); ++i )
+        {
+            runRow( pass, m_rowList != nullptr ? ( *m_rowList )[ i ] : i );
+        }
+    }
+}
+
+void CpuOpticalFlow::runRow( const Pass& _pass, size_t _y )
+{
+    // whole rows
+    switch ( _pass.m_type )
+    {
+        case kLuminance:    luminanceRow( _y );                 return;
+        case kDownsample:   downsampleRow( _pass.m_level, _y ); return;
+        case kGradients:    gradientsRow( _pass.m_level, _y );  return;
+        case kChanges:      changesRow( _y );                   return;
+        case kDecay:        decayRow( _y );                     return;
+        default:                                                break;
+    }
+    
+    // the runs of blocks in the row
+    const Level& level = m_levels[ _pass.m_level ];
+    const auto&  runs  = ( _pass.m_type == kClear ? level.m_clearRuns : level.m_activeRuns )[ _y / level.m_blockSize ];
+    
+    for ( const Run& run : runs )
+    {
+        switch ( _pass.m_type )
+        {
+            case kClear:        clearSpan( _pass.m_level, _y, run.m_begin, run.m_end );                 break;
+            case kProducts:     productsSpan( _pass.m_level, _y, run.m_begin, run.m_end, _pass.m_seed ); break;
+            case kWindow:       windowSpan( _pass.m_level, _y, run.m_begin, run.m_end );                break;
+            case kSolve:        solveSpan( _pass.m_level, _y, run.m_begin, run.m_end );                 break;
+            case kShape:        shapeSpan( _y, run.m_begin, run.m_end );                                break;
+            case kBlurRows:     blurRowSpan( _y, run.m_begin, run.m_end );                              break;
+            case kBlurColumns:  blurColumnSpan( _y, run.m_begin, run.m_end );                           break;
+            default:                                                                                    break;
+        }
+    }
+}
+
+// mean luminance of the frame pixels falling into each pixel of the row
+void CpuOpticalFlow::luminanceRow( size_t _y )
+{
+    Level&  level       = m_levels[ 0 ];
+    size_t  frameWidth  = static_cast< size_t >( m_frame->getWidth() );
+    size_t  frameHeight = static_cast< size_t >( m_frame->getHeight() );
+    size_t  channels    = m_frame->getNumChannels();
+    size_t  top         = _y * frameHeight / level.m_height;
+    size_t  bottom      = std::max( ( _y + 1 ) * frameHeight / level.m_height, top + 1 );
+    float*  out         = level.m_current.data() + _y * level.m_width;
+    
+    const unsigned char* data = m_frame->getData();
+    
+    for ( size_t x = 0; x < level.m_width; ++x )
+    {
+        size_t left  = x * frameWidth / level.m_width;
+        size_t right = std::max( ( x + 1 ) * frameWidth / level.m_width, left + 1 );
+        float  sum   = 0.0f;
+        
+        for ( size_t sy = top; sy < bottom; ++sy )
+        {
+            const unsigned char* px = data + ( sy * frameWidth + left ) * channels;
+            
+            for ( size_t sx = left; sx < right; ++sx, px += channels )
+            {
+                sum += channels >= 3 ? px[ 0 ] * 0.299f + px[ 1 ] * 0.587f + px[ 2 ] * 0.114f : px[ 0 ];
+            }
+        }
+        
+        out[ x ] = sum / ( ( bottom - top ) * ( right - left ) * 255.0f );
+    }
+}
+
+void CpuOpticalFlow::downsampleRow( size_t _level, size_t _y )
+{
+    const Level& above = m_levels[ _level - 1 ];
+    Level&       level = m_levels[ _level ];
+    
+    const float* FLOW_RESTRICT top    = above.m_current.data() + ( _y * 2 ) * above.m_width;
+    const float* FLOW_RESTRICT bottom = top + above.m_width;
+    float* FLOW_RESTRICT       out    = level.m_current.data() + _y * level.m_width;
+    
+    for ( size_t x = 0; x < level.m_width; ++x )
+    {
+        out[ x ] = ( top[ x * 2 ] + top[ x * 2 + 1 ] + bottom[ x * 2 ] + bottom[ x * 2 + 1 ] ) * 0.25f;
+    }
+}
+
+// central differences _offset pixels apart, one sided at the edges
+void CpuOpticalFlow::gradientsRow( size_t _level, size_t _y )
+{
+    Level&  level  = m_levels[ _level ];
+    size_t  width  = level.m_width;
+    size_t  offset = std::min< size_t >( std::max( static_cast< int >( m_settings.m_offset + 0.5f ), 1 ), ( width - 1 ) / 2 );
+    float   scale  = 0.5f / offset;
+    size_t  up     = clampIndex( static_cast< ptrdiff_t >( _y ) - offset, level.m_height );
+    size_t  down   = clampIndex( static_cast< ptrdiff_t >( _y ) + offset, level.m_height );
+    
+    const float* FLOW_RESTRICT row   = level.m_current.data() + _y * width;
+    const float* FLOW_RESTRICT above = level.m_current.data() + up   * width;
+    const float* FLOW_RESTRICT below = level.m_current.data() + down * width;
+    float* FLOW_RESTRICT       gx    = level.m_currentGradX.data() + _y * width;
+    float* FLOW_RESTRICT       gy    = level.m_currentGradY.data() + _y * width;
+    
+    for ( size_t x = offset; x < width - offset; ++x )
+    {
+        gx[ x ] = ( row[ x + offset ] - row[ x - offset ] ) * scale;
+    }
+    for ( size_t x = 0; x < offset; ++x )
+    {
+        gx[ x ]             = ( row[ x + offset ] - row[ 0 ] ) / ( x + offset );
+        gx[ width - 1 - x ] = ( row[ width - 1 ] - row[ width - 1 - x - offset ] ) / ( x + offset );
+    }
+    
+    float verticalScale = 1.0f / std::max< size_t >( down - up, 1 );
+    
+    for ( size_t x = 0; x < width; ++x )
+    {
+        gy[ x ] = ( below[ x ] - above[ x ] ) * verticalScale;
+    }
+}
+
+// mean absolute difference of every block in the row to the old frame
+void CpuOpticalFlow::changesRow( size_t _blockRow )
+{
+    const Level& level  = m_levels[ 0 ];
+    size_t       top    = _blockRow * FLOW_BLOCK;
+    size_t       bottom = std::min( top + FLOW_BLOCK, level.m_height );
+    
+    for ( size_t blockX = 0; blockX < m_blocksX; ++blockX )
+    {
+        size_t left  = blockX * FLOW_BLOCK;
+        size_t right = std::min( left + FLOW_BLOCK, level.m_width );
+        float  sum   = 0.0f;
+        
+        for ( size_t y = top; y < bottom; ++y )
+        {
+            const float* current  = level.m_current.data()  + y * level.m_width;
+            const float* previous = level.m_previous.data() + y * level.m_width;
+            
+            for ( size_t x = left; x < right; ++x )
+            {
+                sum += std::fabs( current[ x ] - previous[ x ] );
+            }
+        }
+        
+        m_changed[ _blockRow * m_blocksX + blockX ] = sum > FLOW_CHANGE_THRESHOLD * ( bottom - top ) * ( right - left );
+    }
+}
+
+// back to no flow, which is what the windows and the blur of the tracked
+// blocks read around them
+void CpuOpticalFlow::clearSpan( size_t _level, size_t _y, size_t _begin, size_t _end )
+{
+    Level&  level = m_levels[ _level ];
+    size_t  row   = _y * level.m_width;
+    
+    std::fill( level.m_flowX.begin() + row + _begin, level.m_flowX.begin() + row + _end, 0.0f );
+    std::fill( level.m_flowY.begin() + row + _begin, level.m_flowY.begin() + row + _end, 0.0f );
+    
+    for ( size_t i = 0; i < kProductCount; ++i )
+    {
+        std::fill( level.m_products[ i ].begin() + row + _begin, level.m_products[ i ].begin() + row + _end, 0.0f );
+        std::fill( level.m_sums[ i ].begin()     + row + _begin, level.m_sums[ i ].begin()     + row + _end, 0.0f );
+    }
+    
+    if ( _level == 0 )
+    {
+        for ( auto plane : { &m_shapedX, &m_shapedY, &m_blurX, &m_blurY, &m_smoothX, &m_smoothY } )
+        {
+            std::fill( plane->begin() + row + _begin, plane->begin() + row + _end, 0.0f );
+        }
+    }
+}
+
+// Temporal difference of the new frame, warped along the flow so far, to the
+// old one, and its products with the old gradients. The first iteration of a
+// level starts from the coarser flow, doubled, or from none at the coarsest.
+void CpuOpticalFlow::productsSpan( size_t _level, size_t _y, size_t _begin, size_t _end, bool _seed )
+{
+    Level&  level = m_levels[ _level ];
+    size_t  width = level.m_width;
+    size_t  row   = _y * width;
+    
+    float* FLOW_RESTRICT flowX = level.m_flowX.data() + row;
+    float* FLOW_RESTRICT flowY = level.m_flowY.data() + row;
+    
+    if ( _seed )
+    {
+        if ( _level + 1 < m_levels.size() )
+        {
+            const Level& coarser = m_levels[ _level + 1 ];
+            size_t       above   = std::min( _y / 2, coarser.m_height - 1 ) * coarser.m_width;
+            
+            for ( size_t x = _begin; x < _end; ++x )
+            {
+                size_t index = above + std::min( x / 2, coarser.m_width - 1 );
+                
+                flowX[ x ] = coarser.m_flowX[ index ] * 2.0f;
+                flowY[ x ] = coarser.m_flowY[ index ] * 2.0f;
+            }
+        }
+        else
+        {
+            std::fill( flowX + _begin, flowX + _end, 0.0f );
+            std::fill( flowY + _begin, flowY + _end, 0.0f );
+        }
+    }
+    
+    // the warp gathers, the rest of the span is vectorized
+    float* it = level.m_products[ kXT ].data() + row;
+    
+    for ( size_t x = _begin; x < _end; ++x )
+    {
+        it[ x ] = sampleBilinear( level.m_current.data(), width, level.m_height, x + flowX[ x ], _y + flowY[ x ] );
+    }
+    
+    row += _begin;
+    temporalProducts( level.m_previous.data() + row, level.m_previousGradX.data() + row, level.m_previousGradY.data() + row, it + _begin,
+                      level.m_products[ kXX ].data() + row, level.m_products[ kXY ].data() + row, level.m_products[ kYY ].data() + row, level.m_products[ kYT ].data() + row, _end - _begin );
+}
+
+void CpuOpticalFlow::windowSpan( size_t _level, size_t _y, size_t _begin, size_t _end )
+{
+    Level&  level = m_levels[ _level ];
+    size_t  row   = _y * level.m_width;
+    
+    for ( size_t i = 0; i < kProductCount; ++i )
+    {
+        boxSumRow( level.m_products[ i ].data() + row, level.m_sums[ i ].data() + row, level.m_width, FLOW_WINDOW_RADIUS, _begin, _end );
+    }
+}
+
+// The window sums of the products make the 2x2 system of the flow update,
+// the lambda keeps it solvable where the window has no texture.
+void CpuOpticalFlow::solveSpan( size_t _level, size_t _y, size_t _begin, size_t _end )
+{
+    Level&  level  = m_levels[ _level ];
+    size_t  width  = level.m_width;
+    size_t  row    = _y * width + _begin;
+    size_t  count  = _end - _begin;
+    float   lambda = m_settings.m_lambda * FLOW_WINDOW * FLOW_WINDOW;
+    
+    // the products were summed along the rows already, their own span takes
+    // the column sums
+    float* sums[ kProductCount ];
+    
+    for ( size_t i = 0; i < kProductCount; ++i )
+    {
+        sums[ i ] = level.m_products[ i ].data() + row;
+        boxSumColumn( level.m_sums[ i ].data() + _begin, sums[ i ], width, level.m_height, _y, FLOW_WINDOW_RADIUS, count );
+    }
+    
+    solveWindows( sums[ kXX ], sums[ kXY ], sums[ kYY ], sums[ kXT ], sums[ kYT ], lambda,
+                  level.m_flowX.data() + row, level.m_flowY.data() + row, count );
+}
+
+// Pixels per video frame to the strength scaled velocity, the magnitude cut
+// below the threshold and capped to one.
+void CpuOpticalFlow::shapeSpan( size_t _y, size_t _begin, size_t _end )
+{
+    const Level& level     = m_levels[ 0 ];
+    size_t       row       = _y * level.m_width;
+    float        scale     = m_settings.m_strength / ( level.m_width * m_frames );
+    float        threshold = std::min( m_settings.m_threshold, 0.99f );
+    
+    const float* FLOW_RESTRICT flowX   = level.m_flowX.data() + row;
+    const float* FLOW_RESTRICT flowY   = level.m_flowY.data() + row;
+    float* FLOW_RESTRICT       shapedX = m_shapedX.data() + row;
+    float* FLOW_RESTRICT       shapedY = m_shapedY.data() + row;
+    
+    for ( size_t x = _begin; x < _end; ++x )
+    {
+        float vx        = flowX[ x ] * scale;
+        float vy        = flowY[ x ] * scale;
+        float magnitude = std::sqrt( vx * vx + vy * vy );
+        float shaped    = std::min( std::max( magnitude - threshold, 0.0f ) / ( 1.0f - threshold ), 1.0f );
+        float factor    = shaped / std::max( magnitude, 1e-6f );
+        
+        shapedX[ x ] = vx * factor;
+        shapedY[ x ] = vy * factor;
+    }
+}
+
+// whole pixels, none without the time blur
+size_t CpuOpticalFlow::blurRadius( void ) const
+{
+    return m_settings.m_timeBlurActive ? static_cast< size_t >( std::max( m_settings.m_timeBlurRadius + 0.5f, 0.0f ) ) : 0;
+}
+
+void CpuOpticalFlow::blurRowSpan( size_t _y, size_t _begin, size_t _end )
+{
+    size_t width = m_levels[ 0 ].m_width;
+    size_t row   = _y * width;
+    
+    boxSumRow( m_shapedX.data() + row, m_blurX.data() + row, width, blurRadius(), _begin, _end );
+    boxSumRow( m_shapedY.data() + row, m_blurY.data() + row, width, blurRadius(), _begin, _end );
+}
+
+void CpuOpticalFlow::blurColumnSpan( size_t _y, size_t _begin, size_t _end )
+{
+    const Level& level  = m_levels[ 0 ];
+    size_t       width  = level.m_width;
+    size_t       count  = _end - _begin;
+    size_t       radius = blurRadius();
+    float        scale  = 1.0f / ( ( radius * 2 + 1 ) * ( radius * 2 + 1 ) );
+    
+    float* FLOW_RESTRICT smoothX = m_smoothX.data() + _y * width + _begin;
+    float* FLOW_RESTRICT smoothY = m_smoothY.data() + _y * width + _begin;
+    
+    boxSumColumn( m_blurX.data() + _begin, smoothX, width, level.m_height, _y, radius, count );
+    boxSumColumn( m_blurY.data() + _begin, smoothY, width, level.m_height, _y, radius, count );
+    
+    for ( size_t x = 0; x < count; ++x )
+    {
+        smoothX[ x ] *= scale;
+        smoothY[ x ] *= scale;
+    }
+}
+
+// Over the flow reported last, which is only read meanwhile. The whole
+// frame: the blocks not tracked have no flow and just decay.
+void CpuOpticalFlow::decayRow( size_t _y )
+{
+    size_t width = m_levels[ 0 ].m_width;
+    float  keep  = m_keep;
+    
+    const float* FLOW_RESTRICT smoothX  = m_smoothX.data() + _y * width;
+    const float* FLOW_RESTRICT smoothY  = m_smoothY.data() + _y * width;
+    const float* FLOW_RESTRICT previous = m_flows[ m_reported ].getData() + _y * width * 4;
+    float* FLOW_RESTRICT       out      = m_flows[ 1 - m_reported ].getData() + _y * width * 4;
+    
+    for ( size_t x = 0; x < width; ++x )
+    {
+        out[ x * 4 + 0 ] = smoothX[ x ] + ( previous[ x * 4 + 0 ] - smoothX[ x ] ) * keep;
+        out[ x * 4 + 1 ] = smoothY[ x ] + ( previous[ x * 4 + 1 ] - smoothY[ x ] ) * keep;
+        out[ x * 4 + 2 ] = 0.0f;
+        out[ x * 4 + 3 ] = 1.0f;
+    }
+}
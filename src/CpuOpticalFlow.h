@@ -0,0 +1,181 @@
+//
+//  CpuOpticalFlow.h
+//  ofxFlockDraw
+//
+
+#if !defined __CPU_OPTICAL_FLOW_H__
+#define __CPU_OPTICAL_FLOW_H__
+
+#include "ofMain.h"
+#include "WorkerPool.h"
+#include "FrameBarrier.h"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// Optical flow of the video frames on the shared workers, for the nodes
+// without a GPU to spare or to read back from. The frames go gray into a
+// small pyramid and dense Lucas-Kanade tracks every pixel from the coarsest
+// level down, then the flow is shaped, blurred and decayed over time the
+// way ftOpticalFlow does it, into the same RGBA layout its readback has.
+// Every pass runs row bands on the workers, one pass after the other, and
+// start() returns right away; the rows themselves are plain float loops the
+// compiler vectorizes. Only the blocks that changed since the last frame,
+// and a margin around them, are tracked again; everything else is kept at
+// zero and the old flow there just decays.
+class CpuOpticalFlow
+{
+public:
+    // as for ftOpticalFlow
+    struct Settings
+    {
+        float   m_strength;
+        float   m_offset;           // of the gradients, in pixels
+        float   m_lambda;
+        float   m_threshold;
+        bool    m_timeBlurActive;
+        float   m_timeBlurRadius;
+        float   m_timeBlurDecay;
+    };
+    
+    CpuOpticalFlow( void );
+    ~CpuOpticalFlow( void );
+    
+    // main thread, with no run in flight
+    void    setup( size_t _width, size_t _height, const Settings& _settings );
+    bool    isSetup( void ) const;
+    
+    // starts the flow from the frame of the last start to this one, which is
+    // held until it was read; _delta is the time in between and _frames the
+    // video frames it spans, the flow is per frame. Ignored while a run is in
+    // flight, see isRunning()
+    void    start( const std::shared_ptr< const ofPixels >& _frame, float _delta, size_t _frames );
+    
+    // true once a run is done that was not reported yet; poll() never blocks,
+    // wait() joins the run in flight first
+    bool    poll( void );
+    bool    wait( void );
+    
+    // started and not joined by poll() or wait() yet
+    bool    isRunning( void ) const;
+    
+    // the flow of the last run reported, velocity in r and g and a full
+    // alpha; it stays put until the run after the next one is started
+    const ofFloatPixels& getFlow( void ) const;
+
+private:
+    enum PassType
+    {
+        kLuminance,         // the frame, gray and shrunk to the first level
+        kDownsample,        // every other level, from the one above
+        kGradients,         // of the new frame, used as the old one next time
+        kChanges,           // blocks that differ from the old frame
+        kClear,             // blocks no longer tracked
+        kProducts,          // warps the new frame along the flow so far
+        kWindow,            // the products summed along the rows
+        kSolve,             // and the columns, then the flow update
+        kShape,
+        kBlurRows,
+        kBlurColumns,
+        kDecay
+    };
+    
+    struct Pass
+    {
+        PassType    m_type;
+        size_t      m_level;
+        bool        m_seed;         // first iteration of the level, starts from the coarser one
+    };
+    
+    enum Product
+    {
+        kXX, kXY, kYY, kXT, kYT, kProductCount
+    };
+    
+    // of active or cleared blocks in a row, in pixels of the level
+    struct Run
+    {
+        size_t      m_begin;
+        size_t      m_end;
+    };
+    
+    struct Level
+    {
+        size_t                  m_width;
+        size_t                  m_height;
+        size_t                  m_blockSize;
+        std::vector< float >    m_previous;
+        std::vector< float >    m_current;
+        std::vector< float >    m_previousGradX;
+        std::vector< float >    m_previousGradY;
+        std::vector< float >    m_currentGradX;
+        std::vector< float >    m_currentGradY;
+        std::vector< float >    m_flowX;            // in pixels of the level
+        std::vector< float >    m_flowY;
+        std::vector< float >    m_products[ kProductCount ];
+        std::vector< float >    m_sums[ kProductCount ];    // of the products along the rows
+        
+        // the blocks of this run, per row of blocks
+        std::vector< std::vector< Run > > m_activeRuns;
+        std::vector< std::vector< Run > > m_clearRuns;
+        std::vector< size_t >   m_activeRows;
+        std::vector< size_t >   m_clearRows;
+    };
+    
+    bool    finish( void );
+    void    planBlocks( void );
+    void    runNextPass( void );
+    void    processRows( void );
+    void    runRow( const Pass& _pass, size_t _y );
+    size_t  blurRadius( void ) const;
+    
+    void    luminanceRow(   size_t _y );
+    void    downsampleRow(  size_t _level, size_t _y );
+    void    gradientsRow(   size_t _level, size_t _y );
+    void    changesRow(     size_t _blockRow );
+    void    clearSpan(      size_t _level, size_t _y, size_t _begin, size_t _end );
+    void    productsSpan(   size_t _level, size_t _y, size_t _begin, size_t _end, bool _seed );
+    void    windowSpan(     size_t _level, size_t _y, size_t _begin, size_t _end );
+    void    solveSpan(      size_t _level, size_t _y, size_t _begin, size_t _end );
+    void    shapeSpan(      size_t _y, size_t _begin, size_t _end );
+    void    blurRowSpan(    size_t _y, size_t _begin, size_t _end );
+    void    blurColumnSpan( size_t _y, size_t _begin, size_t _end );
+    void    decayRow(       size_t _y );
+    
+    Settings                    m_settings;
+    std::vector< Level >        m_levels;
+    std::vector< Pass >         m_passes;
+    std::vector< float >        m_shapedX;
+    std::vector< float >        m_shapedY;
+    std::vector< float >        m_blurX;                    // along the rows
+    std::vector< float >        m_blurY;
+    std::vector< float >        m_smoothX;                  // along both
+    std::vector< float >        m_smoothY;
+    ofFloatPixels               m_flows[ 2 ];               // reported and being written
+    size_t                      m_reported;
+    
+    // blocks of the first level, row by row
+    size_t                      m_blocksX;
+    size_t                      m_blocksY;
+    std::vector< unsigned char > m_changed;
+    std::vector< unsigned char > m_active;                  // changed or next to a changed one
+    std::vector< unsigned char > m_wasActive;               // in the last run
+    size_t                      m_activeBlocks;             // in the last plan
+    
+    // the run in flight
+    std::shared_ptr< const ofPixels > m_frame;              // until the luminance pass is done
+    float                       m_keep;                     // of the last flow, after the decay
+    float                       m_frames;                   // of video spanned
+    bool                        m_tracking;                 // false on the first frame, nothing to track from
+    bool                        m_running;
+    size_t                      m_pass;                     // next one to post
+    size_t                      m_activePass;
+    size_t                      m_rows;
+    const std::vector< size_t >* m_rowList;                 // the rows of the pass, null for all of them
+    std::atomic_size_t          m_nextRow;
+    WorkerPool::Job             m_job;                      // Posted to the pool once per pass
+    FrameBarrier                m_done;                     // Started by start and joined by wait
+};
+
+#endif // __CPU_OPTICAL_FLOW_H__
@@ -0,0 +1,143 @@
+#include "EmissionMap.h"
+
+#include <algorithm>
+#include <cmath>
+
+#define EMISSION_CELL           4       // pixels per side of a cell
+#define EMISSION_FLOOR          0.05f   // weight of a black flat cell, so every part still gets some
+#define EMISSION_EDGE_WEIGHT    2.0f    // of the luminance gradient against the luminance itself
+
+static float luminance( const ofPixels& _surface, size_t _x, size_t _y )
+{
+    size_t               channels = _surface.getNumChannels();
+    const unsigned char* px       = _surface.getData() + ( _y * static_cast< size_t >( _surface.getWidth() ) + _x ) * channels;
+    
+    return channels >= 3 ? ( px[ 0 ] * 0.299f + px[ 1 ] * 0.587f + px[ 2 ] * 0.114f ) / 255.0f : px[ 0 ] / 255.0f;
+}
+
+EmissionMap::EmissionMap( void ) :
+    m_cellsX( 0 ),
+    m_cellsY( 0 ),
+    m_width( 0.0f ),
+    m_height( 0.0f )
+{
+}
+
+void EmissionMap::build( const ofPixels& _surface )
+{
+    size_t width  = static_cast< size_t >( _surface.getWidth() );
+    size_t height = static_cast< size_t >( _surface.getHeight() );
+    
+    m_probability.clear();
+    m_alias.clear();
+    
+    if ( !_surface.isAllocated() || width == 0 || height == 0 )
+    {
+        return;
+    }
+    
+    m_cellsX = ( width  + EMISSION_CELL - 1 ) / EMISSION_CELL;
+    m_cellsY = ( height + EMISSION_CELL - 1 ) / EMISSION_CELL;
+    m_width  = static_cast< float >( width );
+    m_height = static_cast< float >( height );
+    
+    size_t                  cells = m_cellsX * m_cellsY;
+    std::vector< float >    weights( cells );
+    double                  total = 0.0;
+    
+    // mean luminance plus mean gradient over the cell
+    for ( size_t cellY = 0; cellY < m_cellsY; ++cellY )
+    {
+        for ( size_t cellX = 0; cellX < m_cellsX; ++cellX )
+        {
+            float  light = 0.0f;
+            float  edge  = 0.0f;
+            size_t count = 0;
+            
+            for ( size_t y = cellY * EMISSION_CELL; y < std::min( ( cellY + 1 ) * EMISSION_CELL, height ); ++y )
+            {
+                for ( size_t x = cellX * EMISSION_CELL; x < std::min( ( cellX + 1 ) * EMISSION_CELL, width ); ++x )
+                {
+                    float l = luminance( _surface, x, y );
+                    
+                    light += l;
+                    edge  += std::fabs( luminance( _surface, std::min( x + 1, width  - 1 ), y ) - l ) +
+                             std::fabs( luminance( _surface, x, std::min( y + 1, height - 1 ) ) - l );
+                    ++count;
+                }
+            }
+            
+            float weight = EMISSION_FLOOR + ( light + edge * EMISSION_EDGE_WEIGHT ) / count;
+            
+            weights[ cellY * m_cellsX + cellX ] = weight;
+            total                              += weight;
+        }
+    }
+    
+    // Vose: scaled to a mean of one, each cell under one is topped up by an
+    // alias over one until both sides run out
+    m_probability.resize( cells );
+    m_alias.resize( cells );
+    
+    std::vector< uint32_t > small;
+    std::vector< uint32_t > large;
+    float                   scale = static_cast< float >( cells / total );
+    
+    for ( size_t i = 0; i < cells; ++i )
+    {
+        weights[ i ] *= scale;
+        ( weights[ i ] < 1.0f ? small : large ).push_back( static_cast< uint32_t >( i ) );
+    }
+    
+    while ( !small.empty() && !large.empty() )
+    {
+        uint32_t less = small.back();
+        uint32_t more = large.back();
+        small.pop_back();
+        
+        m_probability[ less ] = weights[ less ];
+        m_alias[ less ]       = more;
+        weights[ more ]      -= 1.0f - weights[ less ];
+        
+        if ( weights[ more ] < 1.0f )
+        {
+            large.pop_back();
+            small.push_back( more );
+        }
+    }
+    
+    // what is left is one up to rounding
+    for ( uint32_t i : large )
+    {
+        m_probability[ i ] = 1.0f;
+        m_alias[ i ]       = i;
+    }
+    for ( uint32_t i : small )
+    {
+        m_probability[ i ] = 1.0f;
+        m_alias[ i ]       = i;
+    }
+}
+
+bool EmissionMap::empty( void ) const
+{
+    return m_probability.empty();
+}
+
+ofVec2f EmissionMap::sample( std::mt19937& _generator ) const
+{
+    std::uniform_real_distribution< float > unit( 0.0f, 1.0f );
+    
+    size_t cell = std::min( static_cast< size_t >( unit( _generator ) * m_probability.size() ), m_probability.size() - 1 );
+    
+    if ( unit( _generator ) >= m_probability[ cell ] )
+    {
+        cell = m_alias[ cell ];
+    }
+    
+    // anywhere within the cell
+    float x = ( cell % m_cellsX + unit( _generator ) ) * EMISSION_CELL;
+    float y = ( cell / m_cellsX + unit( _generator ) ) * EMISSION_CELL;
+    
+    return ofVec2f( std::min( x, m_width ), std::min( y, m_height ) );
+}
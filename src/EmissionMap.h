@@ -0,0 +1,39 @@
+//
+//  EmissionMap.h
+//  ofxFlockDraw
+//
+
+#if !defined __EMISSION_MAP_H__
+#define __EMISSION_MAP_H__
+
+#include "ofMain.h"
+
+#include <random>
+#include <vector>
+
+// Where new particles are worth spawning on a reference surface: bright
+// and edgy cells weigh more than flat dark ones, none weighs nothing. The
+// weights go into an alias table (Vose), so drawing a position costs the
+// same four random numbers whatever the image. Built once per image, off
+// the main thread; sample() only reads and is safe from the workers.
+class EmissionMap
+{
+public:
+    EmissionMap( void );
+    
+    void    build( const ofPixels& _surface );
+    bool    empty( void ) const;
+    
+    // in surface pixels
+    ofVec2f sample( std::mt19937& _generator ) const;
+
+private:
+    std::vector< float >        m_probability;      // of keeping the drawn cell over its alias
+    std::vector< uint32_t >     m_alias;
+    size_t                      m_cellsX;
+    size_t                      m_cellsY;
+    float                       m_width;
+    float                       m_height;
+};
+
+#endif // __EMISSION_MAP_H__
@@ -0,0 +1,145 @@
+#include "FlowField.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined( __GNUC__ )
+#define FIELD_RESTRICT          __restrict__
+#else
+#define FIELD_RESTRICT          __restrict
+#endif
+
+// the gathers need AVX2, which the default x86-64 target lacks; GCC builds an
+// AVX2 clone of the sampling loop next to the baseline one and picks at load
+// time (ifunc, ELF only). Elsewhere the loop is what the build flags make it.
+// The resolver runs before ThreadSanitizer is up, which crashes its builds.
+#if defined( __GNUC__ ) && !defined( __clang__ ) && defined( __x86_64__ ) && defined( __linux__ ) && !defined( __SANITIZE_THREAD__ )
+#define FIELD_TARGET_CLONES     __attribute__(( target_clones( "avx2", "default" ) ))
+#else
+#define FIELD_TARGET_CLONES
+#endif
+
+// Texel centers at the half pixels, clamped to the edge texels. Both frames
+// are read at the same four texels and blended once they are filtered; the
+// loop gathers and is vectorized, the pointers never alias.
+FIELD_TARGET_CLONES
+static void sampleFrames( const float* FIELD_RESTRICT _positions, size_t _count, float _scaleX, float _scaleY, const float* FIELD_RESTRICT _older, const float* FIELD_RESTRICT _newest,
+                          int _width, int _height, float _blend, float* FIELD_RESTRICT _forces )
+{
+    float maxX   = static_cast< float >( _width  - 1 );
+    float maxY   = static_cast< float >( _height - 1 );
+    int   stride = _width * 2;
+    
+    for ( size_t i = 0; i < _count; ++i )
+    {
+        float x  = std::min( std::max( _positions[ i * 2 ]     * _scaleX - 0.5f, 0.0f ), maxX );
+        float y  = std::min( std::max( _positions[ i * 2 + 1 ] * _scaleY - 0.5f, 0.0f ), maxY );
+        int   x0 = static_cast< int >( x );
+        int   y0 = static_cast< int >( y );
+        float fx = x - x0;
+        float fy = y - y0;
+        
+        // the right and bottom texels fold back onto the edge ones
+        int   right = x0 < _width  - 1 ? 2 : 0;
+        int   down  = y0 < _height - 1 ? stride : 0;
+        int   a     = y0 * stride + x0 * 2;
+        int   b     = a + right;
+        int   c     = a + down;
+        int   d     = c + right;
+        
+        float w00 = ( 1.0f - fx ) * ( 1.0f - fy );
+        float w10 = fx * ( 1.0f - fy );
+        float w01 = ( 1.0f - fx ) * fy;
+        float w11 = fx * fy;
+        
+        float oldX = _older[ a ]      * w00 + _older[ b ]      * w10 + _older[ c ]      * w01 + _older[ d ]      * w11;
+        float oldY = _older[ a + 1 ]  * w00 + _older[ b + 1 ]  * w10 + _older[ c + 1 ]  * w01 + _older[ d + 1 ]  * w11;
+        float newX = _newest[ a ]     * w00 + _newest[ b ]     * w10 + _newest[ c ]     * w01 + _newest[ d ]     * w11;
+        float newY = _newest[ a + 1 ] * w00 + _newest[ b + 1 ] * w10 + _newest[ c + 1 ] * w01 + _newest[ d + 1 ] * w11;
+        
+        _forces[ i * 2 ]     = oldX + ( newX - oldX ) * _blend;
+        _forces[ i * 2 + 1 ] = oldY + ( newY - oldY ) * _blend;
+    }
+}
+
+FlowField::FlowField( void ) :
+    m_newest( 0 ),
+    m_width( 0 ),
+    m_height( 0 )
+{
+    m_times[ 0 ] = 0.0f;
+    m_times[ 1 ] = 0.0f;
+}
+
+void FlowField::allocate( size_t _width, size_t _height )
+{
+    m_width  = _width;
+    m_height = _height;
+    m_newest = 0;
+    
+    for ( size_t i = 0; i < 2; ++i )
+    {
+        m_frames[ i ].assign( _width * _height * 2, 0.0f );
+        m_times[ i ] = 0.0f;
+    }
+}
+
+bool FlowField::isAllocated( void ) const
+{
+    return m_width > 0 && m_height > 0;
+}
+
+void FlowField::push( const ofFloatPixels& _flow, float _scale, float _time )
+{
+    size_t width    = static_cast< size_t >( _flow.getWidth() );
+    size_t height   = static_cast< size_t >( _flow.getHeight() );
+    size_t channels = _flow.getNumChannels();
+    
+    if ( width == 0 || height == 0 || channels < 2 )
+    {
+        return;
+    }
+    
+    // a flow of another size starts over from no flow
+    if ( width != m_width || height != m_height )
+    {
+        allocate( width, height );
+    }
+    
+    m_newest = 1 - m_newest;
+    
+    float*       out = m_frames[ m_newest ].data();
+    const float* in  = _flow.getData();
+    
+    for ( size_t i = 0; i < width * height; ++i, in += channels )
+    {
+        float weight = ( channels >= 4 ? in[ 3 ] : 1.0f ) * _scale;
+        
+        out[ i * 2 ]     = in[ 0 ] * weight;
+        out[ i * 2 + 1 ] = in[ 1 ] * weight;
+    }
+    
+    m_times[ m_newest ] = _time;
+}
+
+// Texel centers at the half pixels, clamped to the edge texels. Both frames
+// are read at the same four texels and blended once they are filtered.
+void FlowField::sample( const ofVec2f* _positions, size_t _count, const ofVec2f& _scale, float _time, ofVec2f* _forces ) const
+{
+    float interval = m_times[ m_newest ] - m_times[ 1 - m_newest ];
+    float blend    = interval > 0.0f ? std::min( std::max( ( _time - m_times[ m_newest ] ) / interval, 0.0f ), 1.0f ) : 1.0f;
+    
+    // an ofVec2f is its two floats
+    sampleFrames( reinterpret_cast< const float* >( _positions ), _count, _scale.x, _scale.y, m_frames[ 1 - m_newest ].data(), m_frames[ m_newest ].data(),
+                  static_cast< int >( m_width ), static_cast< int >( m_height ), blend, reinterpret_cast< float* >( _forces ) );
+}
+
+size_t FlowField::getWidth( void ) const
+{
+    return m_width;
+}
+
+size_t FlowField::getHeight( void ) const
+{
+    return m_height;
+}
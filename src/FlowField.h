@@ -0,0 +1,48 @@
+//
+//  FlowField.h
+//  ofxFlockDraw
+//
+
+#if !defined __FLOW_FIELD_H__
+#define __FLOW_FIELD_H__
+
+#include "ofMain.h"
+
+#include <vector>
+
+// The optical flow as the particles read it: the velocity of the last two
+// flow frames, weighted by the confidence and packed two floats a texel,
+// half of the RGBA the flow comes in. Particles sample it in batches,
+// bilinear in space and blended in time from the older frame to the newer
+// one over the interval they came apart, so steps running faster than the
+// video do not jump from one frame to the next. That costs one flow frame
+// of latency. Pushed on the main thread between runs; sample() only reads
+// and is safe from the workers.
+class FlowField
+{
+public:
+    FlowField( void );
+    
+    // both frames without any flow
+    void    allocate( size_t _width, size_t _height );
+    bool    isAllocated( void ) const;
+    
+    // the new frame, velocity in r and g and the confidence in alpha, all of
+    // them scaled by _scale; _time is the one the steps sample at
+    void    push( const ofFloatPixels& _flow, float _scale, float _time );
+    
+    // the forces at the positions, scaled into field pixels by _scale
+    void    sample( const ofVec2f* _positions, size_t _count, const ofVec2f& _scale, float _time, ofVec2f* _forces ) const;
+    
+    size_t  getWidth( void ) const;
+    size_t  getHeight( void ) const;
+
+private:
+    std::vector< float >        m_frames[ 2 ];      // x and y interleaved
+    float                       m_times[ 2 ];       // when each was pushed
+    size_t                      m_newest;
+    size_t                      m_width;
+    size_t                      m_height;
+};
+
+#endif // __FLOW_FIELD_H__
@@ -0,0 +1,97 @@
+//
+//  FrameBarrier.h
+//  ofxFlockDraw
+//
+
+#if !defined __FRAME_BARRIER_H__
+#define __FRAME_BARRIER_H__
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <algorithm>
+
+#if defined( __x86_64__ ) || defined( __i386__ ) || defined( _M_X64 )
+#include <immintrin.h>
+#define FRAME_BARRIER_RELAX() _mm_pause()
+#elif defined( __aarch64__ ) || defined( __arm__ )
+#define FRAME_BARRIER_RELAX() __asm__ __volatile__( "yield" )
+#else
+#define FRAME_BARRIER_RELAX() std::this_thread::yield()
+#endif
+
+// Join point for work handed to the WorkerPool: release() announces N
+// arrivals before the work is posted and wait() returns once all of them
+// called arrive(). The waiting side spins for a while before parking on a
+// condition variable, since the work is often done within microseconds; the
+// mutex is only taken when it actually parked. Spinning is skipped when the
+// arrivals and the main thread outnumber the cores, where it would only steal
+// their time.
+class FrameBarrier
+{
+public:
+    explicit FrameBarrier( size_t _spinCount = 4000 ) :
+        m_spinCount( _spinCount ),
+        m_cores( std::max< size_t >( std::thread::hardware_concurrency(), 1 ) ),
+        m_spin( 0 ),
+        m_remaining( 0 ),
+        m_mainParked( false )
+    {
+    }
+
+    // main thread >>>
+    // whether wait() would return right away
+    bool isDone( void ) const
+    {
+        return m_remaining == 0;
+    }
+
+    void release( size_t _arrivals )
+    {
+        m_spin      = _arrivals < m_cores ? m_spinCount : 0;
+        m_remaining = _arrivals;
+    }
+
+    void wait( void )
+    {
+        for ( size_t i = 0, spin = m_spin; i < spin; ++i )
+        {
+            if ( m_remaining == 0 )
+            {
+                return;
+            }
+            FRAME_BARRIER_RELAX();
+        }
+
+        std::unique_lock< std::mutex > lock( m_lock );
+        m_mainParked = true;
+        m_mainVar.wait( lock, [ this ](){ return m_remaining == 0; } );
+        m_mainParked = false;
+    }
+    // main thread <<<
+
+    // workers >>>
+    void arrive( void )
+    {
+        // the last one in wakes the main thread if it already parked
+        if ( --m_remaining == 0 && m_mainParked )
+        {
+            std::lock_guard< std::mutex > lock( m_lock );
+            m_mainVar.notify_one();
+        }
+    }
+    // workers <<<
+
+private:
+    const size_t                m_spinCount;
+    const size_t                m_cores;
+    std::atomic_size_t          m_spin;             // spin count of the current wait
+    std::atomic_size_t          m_remaining;        // arrivals still due
+    std::atomic_bool            m_mainParked;
+
+    std::mutex                  m_lock;
+    std::condition_variable     m_mainVar;
+};
+
+#endif // __FRAME_BARRIER_H__
@@ -0,0 +1,186 @@
+#include "FrameGraph.h"
+#include "ofMain.h"
+
+#include <algorithm>
+#include <chrono>
+
+#define TIMING_SMOOTHING 0.05   // weight of the last frame in the running average
+
+static int64_t nowNs( void )
+{
+    return std::chrono::duration_cast< std::chrono::nanoseconds >( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+FrameGraph::FrameGraph( void ) :
+    m_remaining( 0 ),
+    m_frameStart( 0 ),
+    m_frameMs( 0.0 )
+{
+}
+
+FrameGraph::~FrameGraph( void )
+{
+}
+
+void FrameGraph::addNode( const std::string& _name, Affinity _affinity, uint32_t _reads, uint32_t _writes, std::function< void ( void ) > _work )
+{
+    size_t index = m_nodes.size();
+    
+    m_nodes.push_back( std::unique_ptr< Node >( new Node() ) );
+    Node& node = *m_nodes.back();
+    
+    node.m_name         = _name;
+    node.m_affinity     = _affinity;
+    node.m_reads        = _reads;
+    node.m_writes       = _writes;
+    node.m_work         = _work;
+    node.m_dependencies = 0;
+    node.m_pending      = 0;
+    node.m_claimed      = false;
+    node.m_startMs      = 0.0;
+    node.m_lastMs       = 0.0;
+    node.m_averageMs    = 0.0;
+    
+    // the last one of the workers that joined marks the node done
+    node.m_job.m_work = [ this, index ]( size_t )
+    {
+        Node& n = *m_nodes[ index ];
+        if ( !n.m_claimed.exchange( true ) )
+        {
+            execute( n );
+        }
+    };
+    node.m_job.m_done = [ this, index ]()
+    {
+        std::lock_guard< std::mutex > lock( m_lock );
+        finish( index );
+    };
+    
+    // read after write, write after read and write after write
+    for ( size_t i = 0; i < index; ++i )
+    {
+        Node& earlier = *m_nodes[ i ];
+        
+        if ( ( earlier.m_writes & ( _reads | _writes ) ) || ( earlier.m_reads & _writes ) )
+        {
+            earlier.m_dependents.push_back( index );
+            ++node.m_dependencies;
+        }
+    }
+    
+    m_readyMain.reserve( m_nodes.size() );
+}
+
+void FrameGraph::run( void )
+{
+    std::unique_lock< std::mutex > lock( m_lock );
+    
+    m_frameStart = nowNs();
+    m_remaining  = m_nodes.size();
+    m_readyMain.clear();
+    
+    for ( auto& node : m_nodes )
+    {
+        node->m_pending = node->m_dependencies;
+        node->m_claimed = false;
+    }
+    
+    for ( size_t i = 0; i < m_nodes.size(); ++i )
+    {
+        if ( m_nodes[ i ]->m_dependencies == 0 )
+        {
+            schedule( i );
+        }
+    }
+    
+    // the main thread runs its own nodes, in the order they were added, while
+    // the workers run the others
+    while ( m_remaining > 0 )
+    {
+        if ( m_readyMain.empty() )
+        {
+            m_mainVar.wait( lock );
+            continue;
+        }
+        
+        auto   first = std::min_element( m_readyMain.begin(), m_readyMain.end() );
+        size_t index = *first;
+        m_readyMain.erase( first );
+        
+        lock.unlock();
+        execute( *m_nodes[ index ] );
+        lock.lock();
+        
+        finish( index );
+    }
+    
+    m_frameMs = ( nowNs() - m_frameStart ) / 1000000.0;
+}
+
+double FrameGraph::frameMs( void ) const
+{
+    return m_frameMs;
+}
+
+void FrameGraph::timings( std::vector< Timing >& _timings ) const
+{
+    _timings.clear();
+    for ( auto& node : m_nodes )
+    {
+        _timings.push_back( { node->m_name, node->m_affinity == kMainThread, node->m_startMs, node->m_lastMs, node->m_averageMs } );
+    }
+}
+
+void FrameGraph::logTimings( void ) const
+{
+    ofLogNotice( "FrameGraph" ) << "update: " << m_frameMs << " ms";
+    for ( auto& node : m_nodes )
+    {
+        ofLogNotice( "FrameGraph" ) << "  " << node->m_name << ( node->m_affinity == kMainThread ? " (main)" : " (pool)" )
+                                    << ": starts at " << node->m_startMs << " ms, takes " << node->m_lastMs
+                                    << " ms, " << node->m_averageMs << " ms on average";
+    }
+}
+
+void FrameGraph::execute( Node& _node )
+{
+    int64_t start = nowNs();
+    _node.m_work();
+    int64_t end   = nowNs();
+    
+    // published to the main thread by finish(), under the lock
+    _node.m_startMs   = ( start - m_frameStart ) / 1000000.0;
+    _node.m_lastMs    = ( end - start ) / 1000000.0;
+    _node.m_averageMs = _node.m_averageMs + ( _node.m_lastMs - _node.m_averageMs ) * TIMING_SMOOTHING;
+}
+
+// m_lock held >>>
+void FrameGraph::schedule( size_t _node )
+{
+    Node& node = *m_nodes[ _node ];
+    
+    if ( node.m_affinity == kAnyThread )
+    {
+        WorkerPool::instance().post( node.m_job );
+    }
+    else
+    {
+        m_readyMain.push_back( _node );
+        m_mainVar.notify_one();
+    }
+}
+
+void FrameGraph::finish( size_t _node )
+{
+    for ( size_t dependent : m_nodes[ _node ]->m_dependents )
+    {
+        if ( --m_nodes[ dependent ]->m_pending == 0 )
+        {
+            schedule( dependent );
+        }
+    }
+    
+    --m_remaining;
+    m_mainVar.notify_one();
+}
+// m_lock held <<<
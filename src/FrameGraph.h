@@ -0,0 +1,92 @@
+//
+//  FrameGraph.h
+//  ofxFlockDraw
+//
+
+#if !defined __FRAME_GRAPH_H__
+#define __FRAME_GRAPH_H__
+
+#include "WorkerPool.h"
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+
+// The stages of one app update as a dependency graph. Every node declares
+// the resources it reads and writes as bit masks; a node waits for every
+// earlier node that writes what it touches, or reads what it writes, so the
+// result is the same as running the nodes in the order they were added.
+// Nodes that need the GL context or the GUI run on the main thread, the rest
+// are posted to the shared WorkerPool as soon as their inputs are ready and
+// overlap with the main thread ones. run() returns when every node is done.
+class FrameGraph
+{
+public:
+    enum Affinity
+    {
+        kMainThread,
+        kAnyThread
+    };
+    
+    struct Timing
+    {
+        std::string             m_name;
+        bool                    m_onMainThread;
+        double                  m_startMs;          // since the start of the frame
+        double                  m_lastMs;
+        double                  m_averageMs;
+    };
+    
+    FrameGraph( void );
+    ~FrameGraph( void );
+    
+    // only between frames; the dependencies on the earlier nodes are derived here
+    void    addNode( const std::string& _name, Affinity _affinity, uint32_t _reads, uint32_t _writes, std::function< void ( void ) > _work );
+    void    run( void );
+    
+    // of the last frame, with a running average per node
+    double  frameMs( void ) const;
+    void    timings( std::vector< Timing >& _timings ) const;
+    void    logTimings( void ) const;
+
+private:
+    struct Node
+    {
+        std::string                     m_name;
+        Affinity                        m_affinity;
+        uint32_t                        m_reads;
+        uint32_t                        m_writes;
+        std::function< void ( void ) >  m_work;
+        std::vector< size_t >           m_dependents;
+        size_t                          m_dependencies;
+        
+        // per frame
+        size_t                          m_pending;      // dependencies not done yet, guarded by m_lock
+        std::atomic_bool                m_claimed;      // the pool calls m_work on every worker joining
+        WorkerPool::Job                 m_job;
+        
+        double                          m_startMs;
+        double                          m_lastMs;
+        double                          m_averageMs;
+    };
+    
+    void    execute( Node& _node );
+    void    schedule( size_t _node );
+    void    finish( size_t _node );
+    
+    std::vector< std::unique_ptr< Node > >  m_nodes;
+    std::vector< size_t >                   m_readyMain;    // main thread nodes with their inputs done
+    size_t                                  m_remaining;
+    int64_t                                 m_frameStart;
+    double                                  m_frameMs;
+    
+    std::mutex                              m_lock;
+    std::condition_variable                 m_mainVar;      // a node finished
+};
+
+#endif // __FRAME_GRAPH_H__
@@ -0,0 +1,200 @@
+#include "ImageLoader.h"
+
+#include <algorithm>
+
+#define TILED_MIN_SCALE 2   // sources this many times the target in a dimension keep their full resolution
+#define TILES_EXTENSION "tiles"
+
+ImageLoader::ImageLoader( size_t _capacity ) :
+    m_capacity( std::max< size_t >( _capacity, 1 ) ),
+    m_width( 0 ),
+    m_height( 0 ),
+    m_stop( false )
+{
+    m_thread = std::thread( &ImageLoader::threadDecode, this );
+}
+
+ImageLoader::~ImageLoader( void )
+{
+    {
+        std::lock_guard< std::mutex > lock( m_lock );
+        m_stop = true;
+        m_queueVar.notify_all();
+    }
+    
+    m_thread.join();
+}
+
+void ImageLoader::setCacheDirectory( const std::string& _directory )
+{
+    // the loader thread only touches the cache for a queued file
+    std::lock_guard< std::mutex > lock( m_lock );
+    m_cache.setup( _directory );
+}
+
+void ImageLoader::setTarget( size_t _width, size_t _height )
+{
+    std::lock_guard< std::mutex > lock( m_lock );
+    
+    m_width  = _width;
+    m_height = _height;
+}
+
+void ImageLoader::request( const std::string& _path )
+{
+    std::lock_guard< std::mutex > lock( m_lock );
+    
+    if ( find( _path ) != m_entries.end() )
+    {
+        return;
+    }
+    
+    // make room by dropping the oldest decoded file, the ones still queued or
+    // decoding were asked for more recently than it
+    if ( m_entries.size() >= m_capacity )
+    {
+        auto oldest = std::find_if( m_entries.begin(), m_entries.end(), []( const Entry& _entry ){ return _entry.m_state == kDone; } );
+        
+        if ( oldest != m_entries.end() )
+        {
+            m_entries.erase( oldest );
+        }
+    }
+    
+    m_entries.push_back( { _path, ofToDataPath( _path, true ), kQueued, ReferenceSurface() } );
+    m_queueVar.notify_one();
+}
+
+ImageLoader::Status ImageLoader::take( const std::string& _path, ReferenceSurface& _surface )
+{
+    {
+        std::lock_guard< std::mutex > lock( m_lock );
+        auto entry = find( _path );
+        
+        if ( entry != m_entries.end() )
+        {
+            if ( entry->m_state != kDone )
+            {
+                return kPending;
+            }
+            
+            _surface = entry->m_surface;
+            m_entries.erase( entry );
+            return _surface.m_pixels ? kReady : kFailed;
+        }
+    }
+    
+    request( _path );
+    return kPending;
+}
+
+// m_lock held
+std::list< ImageLoader::Entry >::iterator ImageLoader::find( const std::string& _path )
+{
+    return std::find_if( m_entries.begin(), m_entries.end(), [ & ]( const Entry& _entry ){ return _entry.m_path == _path; } );
+}
+
+void ImageLoader::threadDecode( void )
+{
+    std::unique_lock< std::mutex > lock( m_lock );
+    
+    while ( !m_stop )
+    {
+        auto entry = std::find_if( m_entries.begin(), m_entries.end(), []( const Entry& _entry ){ return _entry.m_state == kQueued; } );
+        
+        if ( entry == m_entries.end() )
+        {
+            m_queueVar.wait( lock );
+            continue;
+        }
+        
+        // the entry is never dropped while decoding, so the iterator stays valid
+        entry->m_state   = kDecoding;
+        std::string path = entry->m_file;
+        size_t      width  = m_width;
+        size_t      height = m_height;
+        lock.unlock();
+        
+        // a surface fitted before is only mapped, the rest is decoded,
+        // fitted and stored for the next visit; a tile file handed in is its
+        // own full resolution
+        bool                        pretiled = ofToLower( ofFilePath::getFileExt( path ) ) == TILES_EXTENSION;
+        std::shared_ptr< ofPixels > pixels   = m_cache.load( path, width, height );
+        std::string                 tiles    = pretiled ? path : m_cache.tilesFileName( path );
+        
+        if ( !pixels && pretiled )
+        {
+            pixels = std::make_shared< ofPixels >();
+            
+            size_t sourceWidth  = 0;
+            size_t sourceHeight = 0;
+            
+            if ( TiledSurface::readOverview( *pixels, path, width, height, sourceWidth, sourceHeight ) )
+            {
+                m_cache.store( path, width, height, *pixels, sourceWidth, sourceHeight );
+            }
+            else
+            {
+                pixels.reset();
+            }
+        }
+        else if ( !pixels )
+        {
+            // the whole image is in memory until it was tiled and fitted
+            pixels = std::make_shared< ofPixels >();
+            
+            if ( ofLoadImage( *pixels, path ) )
+            {
+                size_t sourceWidth  = pixels->getWidth();
+                size_t sourceHeight = pixels->getHeight();
+                
+                // tiled once, before the full resolution is shrunk away
+                if ( !tiles.empty() && ( sourceWidth >= width * TILED_MIN_SCALE || sourceHeight >= height * TILED_MIN_SCALE ) &&
+                     !ofFile::doesFileExist( tiles, false ) )
+                {
+                    TiledSurface::write( tiles, *pixels );
+                }
+                
+                SurfaceCache::fit( *pixels, width, height );
+                m_cache.store( path, width, height, *pixels, sourceWidth, sourceHeight );
+            }
+            else
+            {
+                pixels.reset();
+            }
+        }
+        
+        // only worth it while the target is small enough next to the source
+        std::shared_ptr< TiledSurface > tiledSurface;
+        
+        if ( pixels && !tiles.empty() && ofFile::doesFileExist( tiles, false ) )
+        {
+            tiledSurface = std::make_shared< TiledSurface >();
+            
+            if ( !tiledSurface->open( tiles, pixels ) ||
+                 ( tiledSurface->getWidth()  < pixels->getWidth()  * TILED_MIN_SCALE &&
+                   tiledSurface->getHeight() < pixels->getHeight() * TILED_MIN_SCALE ) )
+            {
+                tiledSurface.reset();
+            }
+        }
+        
+        // where particles are worth spawning, weighed once per image
+        std::shared_ptr< EmissionMap > emission;
+        
+        if ( pixels )
+        {
+            emission = std::make_shared< EmissionMap >();
+            emission->build( *pixels );
+            
+            if ( emission->empty() )
+            {
+                emission.reset();
+            }
+        }
+        
+        lock.lock();
+        entry->m_surface = { pixels, tiledSurface, emission };
+        entry->m_state  = kDone;
+    }
+}
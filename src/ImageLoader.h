@@ -0,0 +1,98 @@
+//
+//  ImageLoader.h
+//  ofxFlockDraw
+//
+
+#if !defined __IMAGE_LOADER_H__
+#define __IMAGE_LOADER_H__
+
+#include "ofMain.h"
+#include "SurfaceCache.h"
+#include "TiledSurface.h"
+#include "EmissionMap.h"
+
+#include <list>
+#include <string>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Everything the simulation samples of one image
+struct ReferenceSurface
+{
+    std::shared_ptr< ofPixels >     m_pixels;       // null when the decode failed
+    std::shared_ptr< TiledSurface > m_tiles;        // only for images much larger than the target
+    std::shared_ptr< EmissionMap >  m_emission;
+};
+
+// Decodes image files into pixels on a thread of its own, so the main
+// thread never blocks on a decode. Files are requested ahead of time and
+// handed over with take() once decoded. ofxThreadedImageLoader is not used
+// since it uploads a texture nobody draws and has no way to tell when an
+// image is done. Up to _capacity decoded or queued files are kept, the
+// oldest decoded one is dropped for a new request. The surfaces are shrunk
+// to the target size, which is all the simulation samples, and go through
+// the SurfaceCache, so a file seen before is mapped instead of decoded.
+// Images much larger than the target also keep their full resolution as a
+// TiledSurface next to the cached one. Their first decode still needs the
+// whole image in memory, there is no region decode; an image too large for
+// that can be handed in as a tile file (.tiles, see TiledSurface), which is
+// only ever read a tile at a time.
+class ImageLoader
+{
+public:
+    enum Status
+    {
+        kPending,
+        kReady,
+        kFailed             // not an image, it may still be a video
+    };
+    
+    explicit ImageLoader( size_t _capacity );
+    ~ImageLoader( void );
+    
+    // where fitted surfaces are cached, set before the first request
+    void    setCacheDirectory( const std::string& _directory );
+    
+    // size the surfaces are fitted to, 0 to keep them as decoded; only
+    // affects the files decoded from now on
+    void    setTarget( size_t _width, size_t _height );
+    
+    // queues the file unless it is queued, decoding or decoded already
+    void    request( const std::string& _path );
+    
+    // kReady hands the surface over and forgets the file, kPending requests it
+    Status  take( const std::string& _path, ReferenceSurface& _surface );
+
+private:
+    enum State
+    {
+        kQueued,
+        kDecoding,
+        kDone
+    };
+    
+    struct Entry
+    {
+        std::string                     m_path;
+        std::string                     m_file;     // absolute, resolved on the main thread
+        State                           m_state;
+        ReferenceSurface                m_surface;
+    };
+    
+    std::list< Entry >::iterator find( const std::string& _path );
+    void threadDecode( void );
+    
+    const size_t                m_capacity;
+    size_t                      m_width;
+    size_t                      m_height;
+    SurfaceCache                m_cache;
+    std::list< Entry >          m_entries;          // oldest first
+    std::thread                 m_thread;
+    std::mutex                  m_lock;
+    std::condition_variable     m_queueVar;         // a file was queued or stopping
+    bool                        m_stop;
+};
+
+#endif // __IMAGE_LOADER_H__
@@ -1,5 +1,6 @@
 #include "Particle.h"
 #include "ParticleEmitter.h"
+#include "TiledSurface.h"
 
 #include <cmath>
 
@@ -36,6 +37,25 @@ bool WRAP( ofVec2f& p, ofVec2f& w )
     return r;
 }
 
+// reads the reference surface directly, skipping the per call format dispatch of ofPixels::getColor
+inline ofColor SAMPLE( const ofPixels& _surface, int _x, int _y )
+{
+    size_t width    = static_cast< size_t >( _surface.getWidth() );
+    size_t height   = static_cast< size_t >( _surface.getHeight() );
+    size_t channels = _surface.getNumChannels();
+    size_t x        = std::min< size_t >( std::max< int >( _x, 0 ), width  - 1 );
+    size_t y        = std::min< size_t >( std::max< int >( _y, 0 ), height - 1 );
+    
+    const unsigned char* px = _surface.getData() + ( y * width + x ) * channels;
+    return channels >= 3 ? ofColor( px[ 0 ], px[ 1 ], px[ 2 ] ) : ofColor( px[ 0 ], px[ 0 ], px[ 0 ] );
+}
+
+// the full resolution tiles when the surface has them, _x and _y in surface pixels
+inline ofColor SAMPLE( const ofPixels& _surface, const TiledSurface* _tiles, float _x, float _y )
+{
+    return _tiles ? _tiles->sample( _x, _y ) : SAMPLE( _surface, static_cast< int >( _x ), static_cast< int >( _y ) );
+}
+
 ofParameter< float >    Particle::s_maxRadius{           "Max Radius",        0.25f, 0.001f,   1.0f };
 ofParameter< float >    Particle::s_particleSizeRatio{   "Size Ratio",        1.0f,  0.001f,   1.0f };
 ofParameter< float >    Particle::s_particleSpeedRatio{  "Speed Ratio",       1.0f,    0.0f,  10.0f };
@@ -43,28 +63,48 @@ ofParameter< float >    Particle::s_friction{            "Friction",          0.
 ofParameter< float >    Particle::s_dampness{            "Dampness",          0.9f,    0.0f,   1.0f };
 ofParameter< float >    Particle::s_colorRedirection{    "Color Guidance",   90.0f,    0.0f, 360.0f };
 ofParameterGroup        Particle::s_particleParameters;
-size_t                  Particle::s_idGenerator        = 0;
-
-Particle::Particle( ParticleEmitter* _owner, ofVec2f& _position, ofVec2f& _direction ) :
-    m_position( _position ),
-    m_stablePosition( _position ),
-    m_direction( _direction ),
-    m_color( 255, 255, 255 ),
-    m_alpha( 0 ),
-    m_velocity( 0.0f, 0.0f ),
-    m_maxSpeedSquared( 0.0f ),
-    m_minSpeedSquared( 0.0f ),
-    m_lifeTime( 0.0f ),
-    m_lifeTimeLeft( 0.0f ),
-    m_flockLeader( false ),
-    m_flocked( false ),
-    m_owner( _owner ),
-    m_group( -1 ),
-    m_id( s_idGenerator++ ),
-    m_referenceSurface( _owner->m_referenceSurface )
+std::atomic_size_t      Particle::s_idGenerator( 0 );
+
+Particle::Particle( ParticleEmitter* _owner, const ofVec2f& _position, const ofVec2f& _direction ) :
+    m_owner( _owner )
 {
-    
+    spawn( _position, _direction );
+}
+
+void Particle::spawn( const ofVec2f& _position, const ofVec2f& _direction )
+{
+    m_position              = _position;
+    m_oldPosition           = _position;
+    m_stablePosition        = _position;
+    m_direction             = _direction;
+    m_velocity.set( 0.0f, 0.0f );
+    m_acceleration.set( 0.0f, 0.0f );
+    m_instantAcceleration.set( 0.0f, 0.0f );
+    m_color                 = ofColor( 255, 255, 255 );
+    m_sourceColor           = ofColor( 0, 0, 0 );
+    m_alpha                 = 0;
+    m_maxSpeedSquared       = 0.0f;
+    m_minSpeedSquared       = 0.0f;
+    m_lifeTime              = 0.0f;
+    m_lifeTimeLeft          = 0.0f;
+    m_flockLeader           = false;
+    m_flocked               = false;
+    m_contrast              = 0.0f;
+    m_lodDelta              = 0.0f;
+    m_group                 = -1;
+    m_id                    = s_idGenerator.fetch_add( 1, std::memory_order_relaxed );
+}
+
+size_t Particle::nextId( void )
+{
+    return s_idGenerator.load( std::memory_order_relaxed );
 }
+
+void Particle::setNextId( size_t _id )
+{
+    s_idGenerator.store( _id, std::memory_order_relaxed );
+}
+
 void Particle::init( void )
 {
     if ( 0 == s_particleParameters.size() )
@@ -74,10 +114,6 @@ void Particle::init( void )
     }
 }
 
-Particle::~Particle( void )
-{
-}
-
 void Particle::applyInstantForce( ofVec2f _force )
 {
     m_instantAcceleration  += _force;
@@ -90,10 +126,16 @@ void Particle::applyForce( ofVec2f _force )
     m_direction     = ( m_velocity + m_acceleration + m_instantAcceleration ).getNormalized();
 }
 
-void Particle::update( float _currentTime, float _delta, float _sizeFactor )
+// _delta can span several steps for particles updated at a lower level of detail
+void Particle::update( const SimParams& _params, float _delta )
 {
-    if ( m_referenceSurface )
+    if ( _params.m_referenceSurface )
     {
+        const ofPixels&     surface    = *_params.m_referenceSurface;
+        const TiledSurface* tiles      = _params.m_tiledSurface;
+        const float         delta      = _delta;
+        const float         sizeFactor = _params.m_sizeFactor;
+        
         m_oldPosition = m_position;
         
         // capping to avoid errors
@@ -115,65 +157,70 @@ void Particle::update( float _currentTime, float _delta, float _sizeFactor )
         if ( std::isnan( m_position.y ) ) m_position.y = 0.0f;
         
         // wrap the particle
-        ofVec2f wrapSize( m_referenceSurface->getWidth() * _sizeFactor, m_referenceSurface->getHeight() * _sizeFactor );
+        ofVec2f wrapSize( surface.getWidth() * sizeFactor, surface.getHeight() * sizeFactor );
         
         if ( WRAP( m_position, wrapSize ) )
         {
             m_oldPosition = m_position;
         }
         
-        t_tempDir = m_direction * 2.0f;
-        t_angle   = 45;
+        ofVec2f tempDir = m_direction * 2.0f;
+        float   angle   = 45;
         
-        t_currentColor = m_referenceSurface->getColor( static_cast< int >( m_position.x / _sizeFactor ), static_cast< int >( m_position.y / _sizeFactor ) );
-        t_color        = t_currentColor;
-        m_color        = m_color / 2 + t_color / 2;
+        ofColor currentColor = SAMPLE( surface, tiles, m_position.x / sizeFactor, m_position.y / sizeFactor );
+        m_sourceColor        = currentColor;
+        m_color              = m_color / 2 + currentColor / 2;
         
-        t_nextPos[ 0 ] = m_position + t_tempDir;
-        t_tempDir.rotate( t_angle );
-        t_nextPos[ 1 ] = m_position + t_tempDir;
-        t_tempDir.rotate( t_angle * -2.0f );
-        t_nextPos[ 2 ] = m_position + t_tempDir;
+        ofVec2f nextPos[ 3 ];
+        float   l[ 3 ];
+        
+        nextPos[ 0 ] = m_position + tempDir;
+        tempDir.rotate( angle );
+        nextPos[ 1 ] = m_position + tempDir;
+        tempDir.rotate( angle * -2.0f );
+        nextPos[ 2 ] = m_position + tempDir;
         
         // image guidance
+        ofVec2f wrapSizeScaled( surface.getWidth(), surface.getHeight() );
+        
         for ( int i = 0; i < 3; ++i )
         {
-            ofVec2f& pointRef = t_nextPos[ i ];
-            ofVec2f colorSource( static_cast< int >( pointRef.x / _sizeFactor ), static_cast< int >( pointRef.y / _sizeFactor ) );
-            ofVec2f wrapSizeScaled( m_referenceSurface->getWidth(), m_referenceSurface->getHeight() );
+            ofVec2f& pointRef = nextPos[ i ];
+            ofVec2f colorSource( static_cast< int >( pointRef.x / sizeFactor ), static_cast< int >( pointRef.y / sizeFactor ) );
             
             WRAP( colorSource, wrapSizeScaled );
             
             // to guide thru color
-            t_c      = t_currentColor - m_referenceSurface->getColor( colorSource.x, colorSource.y );
-            t_l[ i ] = t_c.r * 2.0f + t_c.g * 2.0f + t_c.b * 2.0f;
+            ofColor c = currentColor - SAMPLE( surface, tiles, colorSource.x, colorSource.y );
+            l[ i ]    = c.r * 2.0f + c.g * 2.0f + c.b * 2.0f;
             
             // to guide thru luminance
             // ci::ColorA c  = m_referenceSurface->getPixel( nextPos[ i ] );
             // l[ i ] = LUMINANCE( c.r, c.g, c.b );
         }
         
-        t_angle = Particle::s_colorRedirection;
+        m_contrast = std::max( l[ 0 ], std::max( l[ 1 ], l[ 2 ] ) );
+        angle      = _params.m_colorRedirection;
 
-        if ( t_l[ 1 ] < t_l[ 0 ] )
+        if ( l[ 1 ] < l[ 0 ] )
         {
-            m_velocity.rotate( t_angle * _delta );
+            m_velocity.rotate( angle * delta );
         }
-        else if ( t_l[ 2 ] < t_l[ 0 ] )
+        else if ( l[ 2 ] < l[ 0 ] )
         {
-            m_velocity.rotate( t_angle * -2.0f * _delta );
+            m_velocity.rotate( angle * -2.0f * delta );
         }
         
         limitSpeed();
         // update the position
-        m_position     += m_velocity * _delta * Particle::s_particleSpeedRatio;
+        m_position     += m_velocity * delta * _params.m_particleSpeedRatio;
         if ( WRAP( m_position, wrapSize ) )
         {
             m_oldPosition = m_position;
         }
         
-        m_velocity     -= m_velocity     * ( 1.0f - Particle::s_friction ) * _delta;
-        m_acceleration -= m_acceleration * ( 1.0f - Particle::s_dampness ) * _delta;
+        m_velocity     -= m_velocity     * ( 1.0f - _params.m_friction ) * delta;
+        m_acceleration -= m_acceleration * ( 1.0f - _params.m_dampness ) * delta;
     }
     
 }
@@ -194,15 +241,24 @@ void Particle::updateTimer( float _delta )
     }
 }
 
-void Particle::draw( void )
+void Particle::writeGeometry( const SimParams& _params, ofVec2f* _vertices, ofFloatColor* _colors ) const
 {
-    float radius = ( 1.0f + Particle::s_maxRadius * LUMINANCE( t_color.r, t_color.g, t_color.b ) ) * Particle::s_particleSizeRatio;
+    // the trail from the old to the current position as a quad as wide as
+    // the line the particle used to draw, so all particles go in one batch.
+    // Between two fixed steps the trail is moved back along the last step.
+    float   radius = ( 1.0f + _params.m_maxRadius * LUMINANCE( m_sourceColor.r, m_sourceColor.g, m_sourceColor.b ) ) * _params.m_particleSizeRatio;
+    ofVec2f step   = m_position - m_oldPosition;
+    ofVec2f offset = step * ( _params.m_interpolation - 1.0f );
+    float   length = step.length();
+    ofVec2f side   = length > 0.0f ? ofVec2f( -step.y, step.x ) * ( radius * 0.5f / length ) : ofVec2f( radius * 0.5f, 0.0f );
+    
+    _vertices[ 0 ] = m_oldPosition + offset + side;
+    _vertices[ 1 ] = m_position    + offset + side;
+    _vertices[ 2 ] = m_position    + offset - side;
+    _vertices[ 3 ] = m_oldPosition + offset - side;
     
-    ofSetColor( m_color.r, m_color.g, m_color.b, m_alpha );
-    //ofFill();
-    //ofDrawCircle( m_position + m_owner->m_position, radius );
-    ofSetLineWidth( radius );
-    ofDrawLine( m_position + m_owner->m_position, m_oldPosition + m_owner->m_position );
+    ofFloatColor color( m_color.r / 255.0f, m_color.g / 255.0f, m_color.b / 255.0f, m_alpha / 255.0f );
+    _colors[ 0 ] = _colors[ 1 ] = _colors[ 2 ] = _colors[ 3 ] = color;
 }
 
 void Particle::debugDraw( void )
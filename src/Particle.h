@@ -2,6 +2,9 @@
 #define __PARTICLE_H__
 
 #include "ofMain.h"
+#include "SimParams.h"
+
+#include <atomic>
 
 class ParticleEmitter;
 
@@ -22,26 +25,34 @@ public:
     };
     
 public:
-    Particle( ParticleEmitter* _owner, ofVec2f& _position, ofVec2f& _direction );
+    Particle( ParticleEmitter* _owner, const ofVec2f& _position, const ofVec2f& _direction );
     
     static void init( void );
     
-    virtual ~Particle( void );
+    // ids handed out so far, carried over by a checkpoint
+    static size_t nextId( void );
+    static void   setNextId( size_t _id );
+    
+    // resets the particle so its slot can be emitted again
+    void spawn( const ofVec2f& _position, const ofVec2f& _direction );
     
     void applyInstantForce( ofVec2f _force );
     void applyForce( ofVec2f _force );
-    virtual void update( float _currentTime, float _delta, float _sizeFactor );
+    void update( const SimParams& _params, float _delta );
     void updateTimer( float _delta );
-    virtual void draw( void );
-    virtual void debugDraw( void );
+    void writeGeometry( const SimParams& _params, ofVec2f* _vertices, ofFloatColor* _colors ) const;
+    void debugDraw( void );
     
     ofVec2f&    position() { return m_position; }
+    size_t      id() const { return m_id; }
     
 protected:
     void         limitSpeed();
     
     
 public:
+    // particles live by value in contiguous per-group arrays, so keep this
+    // free of per-instance scratch space and virtuals
     ofVec2f             m_position;
     ofVec2f             m_oldPosition;
     ofVec2f             m_stablePosition;
@@ -51,6 +62,7 @@ public:
     ofVec2f             m_instantAcceleration;
     
     ofColor             m_color;
+    ofColor             m_sourceColor;      // reference color under the particle, drives the size
     unsigned char       m_alpha;
     
     float               m_maxSpeedSquared;
@@ -62,7 +74,8 @@ public:
     bool                m_flockLeader;
     bool                m_flocked;
     
-    ofPixels*&          m_referenceSurface;
+    float               m_contrast;         // of the reference surface around the particle
+    float               m_lodDelta;         // time since the last integration
     
     ParticleEmitter*    m_owner;
     
@@ -78,18 +91,8 @@ public:
     static ofParameterGroup         s_particleParameters;
     
 private:
-    // temporary variables to avoid construction every update
-    // ofRectangle         t_sourceArea;
-    ofColor             t_color;
-    ofVec2f             t_tempDir;
-    float               t_angle;
-    ofVec2f             t_nextPos[ 3 ];
-    float               t_l[ 3 ];
-    ofColor             t_currentColor;
-    ofColor             t_c;
-    
-    size_t              m_id;
-    static size_t       s_idGenerator;
+    size_t                      m_id;
+    static std::atomic_size_t   s_idGenerator;      // groups emit on the workers at once
     
     
 };
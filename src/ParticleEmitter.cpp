@@ -1,23 +1,72 @@
 #include "ParticleEmitter.h"
 #include "Particle.h"
+#include "EmissionMap.h"
+#include "StartupTimeline.h"
 
 #include <cmath>
 #include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <chrono>
+#include <type_traits>
 
 #define PI2             6.28318530718f
-#define THREADS         4
+#define PARTICLE_CHUNK  1024
+#define TASKS_PER_QUEUE 256
+
+// regular and high capacity limits for the particle counts
+#define MAX_PARTICLES_PER_GROUP                 5000
+#define MAX_PARTICLE_GROUPS                     20
+#define HIGH_CAPACITY_PARTICLES_PER_GROUP       250000
+#define HIGH_CAPACITY_PARTICLE_GROUPS           64
+#define HIGH_CAPACITY_MAX_NEIGHBOURS            16
+
+// prewarm steps run with a fixed delta, as many as fit in the frame budget
+#define PREWARM_DELTA                           ( 1.0f / 60.0f )
+#define PREWARM_BUDGET                          0.012f
+
+// shortest step the flocking ratios are worked out for
+#define FLOCK_MIN_DELTA                         ( 1.0f / 1000.0f )
+
+// a budget shrinks the interval back once the steps are this far below it
+#define LOD_MAX_INTERVAL                        16
+#define LOD_BUDGET_SLACK                        0.8f
+
+// checkpoints are raw copies of the particles and generators, for the build
+// that wrote them; any change to their layout bumps the version
+#define CHECKPOINT_MAGIC                        "FDCK"
+#define CHECKPOINT_VERSION                      1
+#define CHECKPOINT_ALIGNMENT                    16      // of every section, the particles are read in place
+
+// of the optical flow, on the GPU and on the workers alike
+#define FLOW_STRENGTH                           40.0f
+#define FLOW_OFFSET                             1.0f
+#define FLOW_LAMBDA                             0.015f
+#define FLOW_THRESHOLD                          0.01f
+#define FLOW_TIME_BLUR_RADIUS                   3.2f
+#define FLOW_TIME_BLUR_DECAY                    10.0f
+#define FLOW_FORCE                              10.0f   // on the particles, of the velocity times its confidence
+#define FLOW_SAMPLE_BATCH                       64      // particles sampled at once
 
 ofParameter< float >    ParticleEmitter::s_minSpeed{            "Min Part. Speed",     1.0f,   1.0f,  500.0f };
 ofParameter< float >    ParticleEmitter::s_midSpeed{            "Max Part. Speed",    16.0f,   1.0f,  500.0f };
 ofParameter< float >    ParticleEmitter::s_maxSpeed{            "Max Part. Speed",   100.0f,   1.0f,  500.0f };
 ofParameter< float >    ParticleEmitter::s_functionStrength{    "Fn. Strentgth",       5.0f,   0.1f,   10.0f };
+ofParameter< float >    ParticleEmitter::s_emissionImportance{  "Emission Importance", 0.8f,   0.0f,    1.0f };
 ofParameter< float >    ParticleEmitter::s_minParticleLife{     "Mix Part. Life",      1.0f,   0.5f,   60.0f };
 ofParameter< float >    ParticleEmitter::s_maxParticleLife{     "Max Part. Life",     10.0f,   0.5f,   60.0f };
-ofParameter< int   >    ParticleEmitter::s_particlesPerGroup{   "Particles/Group",     1000,    50,     5000 };
-ofParameter< int   >    ParticleEmitter::s_particleGroups{      "Particle Groups",        1,     1,       20 };
+ofParameter< int   >    ParticleEmitter::s_particlesPerGroup{   "Particles/Group",     1000,    50,     MAX_PARTICLES_PER_GROUP };
+ofParameter< int   >    ParticleEmitter::s_particleGroups{      "Particle Groups",        1,     1,       MAX_PARTICLE_GROUPS };
+ofParameter< bool  >    ParticleEmitter::s_bulkEmission{        "Bulk Emission",       true, false,     true };
+ofParameter< int   >    ParticleEmitter::s_prewarmSteps{        "Prewarm Steps",        120,     0,      600 };
+ofParameter< bool  >    ParticleEmitter::s_fixedTimestep{       "Fixed Timestep",     false, false,     true };
+ofParameter< int   >    ParticleEmitter::s_simulationRate{      "Sim. Rate",             60,    10,      240 };
+ofParameter< int   >    ParticleEmitter::s_maxCatchUpSteps{     "Max Catch Up",           4,     1,       16 };
+ofParameter< int   >    ParticleEmitter::s_workerThreads{       "Worker Threads",   std::max< int >( std::thread::hardware_concurrency(), 2 ) - 1, 1, 256 };
+ofParameter< bool  >    ParticleEmitter::s_pinWorkers{          "Pin Workers",        false, false,     true };
+ofParameter< int   >    ParticleEmitter::s_reservedCores{       "Reserved Cores",         0,     0,       16 };
 ofParameter< bool  >    ParticleEmitter::s_debugDraw{           "Debug Draw",         false, false,     true };
+ofParameter< bool  >    ParticleEmitter::s_cpuOpticalFlow{      "CPU Optical Flow",   false, false,     true };
 ofParameterGroup        ParticleEmitter::s_emitterParams;
 
 ofParameter< float >    ParticleEmitter::FuncCtl::s_minChangeTime{ "Min change time",  3.0f, 1.0f, 60.0f };
@@ -30,8 +79,17 @@ ofParameter< float >    ParticleEmitter::s_attractStrength{    "Att. Str.",
 ofParameter< float >    ParticleEmitter::s_zoneRadius{         "Area Size",   150.0f,   25.0f,    750.0f };
 ofParameter< float >    ParticleEmitter::s_lowThresh{          "Repel Area",   0.45f,    0.0f,      1.0f };
 ofParameter< float >    ParticleEmitter::s_highThresh{         "Align Area",   0.85f,    0.0f,      1.0f };
+ofParameter< int   >    ParticleEmitter::s_maxNeighbours{      "Max Neighbours",   0,       0,       256 };
+ofParameter< int   >    ParticleEmitter::s_flockSlices{        "Flock Slices",     6,       1,        32 };
 ofParameterGroup        ParticleEmitter::s_flockingParams;
 
+ofParameter< int   >    ParticleEmitter::s_lodInterval{        "LOD Interval",     1,       1,        LOD_MAX_INTERVAL };
+ofParameter< int   >    ParticleEmitter::s_lodBudget{          "LOD Budget",       0,       0,   4000000 };
+ofParameter< int   >    ParticleEmitter::s_lodAlpha{           "LOD Alpha",       32,       0,       255 };
+ofParameter< float >    ParticleEmitter::s_lodSpeed{           "LOD Speed",      2.0f,    0.0f,    100.0f };
+ofParameter< float >    ParticleEmitter::s_lodFlatness{        "LOD Flatness",  24.0f,    0.0f,    255.0f };
+ofParameterGroup        ParticleEmitter::s_lodParams;
+
 void ParticleEmitter::init( void )
 {
     Particle::init();
@@ -45,22 +103,41 @@ void ParticleEmitter::init( void )
     if ( 0 == s_flockingParams.size() )
     {
         s_flockingParams.setName( "Flocking" );
-        s_flockingParams.add( s_zoneRadius, s_repelStrength, s_alignStrength, s_attractStrength, s_lowThresh, s_highThresh );
+        s_flockingParams.add( s_zoneRadius, s_repelStrength, s_alignStrength, s_attractStrength, s_lowThresh, s_highThresh, s_maxNeighbours, s_flockSlices );
     }
     
+    if ( 0 == s_lodParams.size() )
+    {
+        s_lodParams.setName( "Level of Detail" );
+        s_lodParams.add( s_lodInterval, s_lodBudget, s_lodAlpha, s_lodSpeed, s_lodFlatness );
+    }
+
     if ( 0 == s_emitterParams.size() )
     {
         s_emitterParams.setName( "Emitter" );
-        s_emitterParams.add( s_functionStrength, s_minParticleLife, s_maxParticleLife, s_particlesPerGroup, s_particleGroups, s_debugDraw );
+        s_emitterParams.add( s_functionStrength, s_emissionImportance, s_minParticleLife, s_maxParticleLife, s_particlesPerGroup, s_particleGroups, s_bulkEmission, s_prewarmSteps, s_fixedTimestep, s_simulationRate, s_maxCatchUpSteps, s_workerThreads, s_pinWorkers, s_reservedCores, s_debugDraw, s_cpuOpticalFlow );
         
     }
     
 }
 
+void ParticleEmitter::setHighCapacity( bool _enabled )
+{
+    // lifts the particle caps to about 16M and bounds the flocking neighbourhood,
+    // which is what keeps dense groups from going quadratic
+    s_particlesPerGroup.setMax( _enabled ? HIGH_CAPACITY_PARTICLES_PER_GROUP : MAX_PARTICLES_PER_GROUP );
+    s_particleGroups.setMax(    _enabled ? HIGH_CAPACITY_PARTICLE_GROUPS     : MAX_PARTICLE_GROUPS     );
+    s_maxNeighbours = _enabled ? HIGH_CAPACITY_MAX_NEIGHBOURS : 0;
+    
+    s_particlesPerGroup = std::min< int >( s_particlesPerGroup, s_particlesPerGroup.getMax() );
+    s_particleGroups    = std::min< int >( s_particleGroups,    s_particleGroups.getMax()    );
+}
+
 ParticleEmitter::FuncCtl::FuncCtl( std::vector< ParticleEmitter::PosFunc >& _fn ) :
     m_fnList( _fn ),
     m_funcTimer( 0.0f ),
-    m_funcTimeout( 0.0f )
+    m_funcTimeout( 0.0f ),
+    m_random( static_cast< unsigned int >( rand() ) )
 {
 }
 
@@ -77,8 +154,8 @@ float ParticleEmitter::FuncCtl::operator()( float _v )
 
 void ParticleEmitter::FuncCtl::randomize( void )
 {
-    m_fn[ 0 ] = rand() % m_fnList.size();
-    m_fn[ 1 ] = rand() % m_fnList.size();
+    m_fn[ 0 ] = m_random() % m_fnList.size();
+    m_fn[ 1 ] = m_random() % m_fnList.size();
 }
 
 void ParticleEmitter::FuncCtl::update( float _delta )
@@ -90,9 +167,9 @@ void ParticleEmitter::FuncCtl::update( float _delta )
     if ( m_funcTimer >= m_funcTimeout )
     {
         m_funcTimer     = 0.0;
-        m_funcTimeout   = ofRandom( ParticleEmitter::FuncCtl::s_minChangeTime + _delta, ParticleEmitter::FuncCtl::s_maxChangeTime - _delta );
+        m_funcTimeout   = ofLerp( ParticleEmitter::FuncCtl::s_minChangeTime + _delta, ParticleEmitter::FuncCtl::s_maxChangeTime - _delta, std::uniform_real_distribution< float >()( m_random ) );
         m_fn[ 0 ]       = m_fn[ 1 ];
-        m_fn[ 1 ]       = rand() % m_fnList.size();
+        m_fn[ 1 ]       = m_random() % m_fnList.size();
     }
 }
 
@@ -104,28 +181,53 @@ ParticleEmitter::ParticleEmitter( ofPixels*& _surface ) :
     m_soundMid( 0.0f ),
     m_soundHigh( 0.0f ),
     m_updateType( kFunctionAndFlocking ),
+    m_updateFlocking( false ),
     m_referenceSurface( _surface ),
-    m_stop( false ),
+    m_tiledSurface( nullptr ),
+    m_emissionMap( nullptr ),
     m_pause( false ),
-    m_processing( 0 ),
+    m_phase( kIdle ),
+    m_stepIndex( 0 ),
     m_currentTime( 0.0f ),
-    m_delta( 0.0f ),
     m_currentDrawTime( 0.0f ),
     m_drawDelta( 0.0f ),
     m_updateFlockEvery( 0.1f ),
     m_updateFlockTimer( 0.0f ),
-    m_lastFlockUpdateTime( 0.0f ),
+    m_flockSlice( 0 ),
+    m_flockSliceTimes( s_flockSlices.getMax(), -1.0f ),
+    m_flockSliceRatios( s_flockSlices.getMax(), 0.0f ),
+    m_stepCount( 0 ),
+    m_stepTime( 0.0f ),
+    m_stepDelta( 0.0f ),
+    m_simulationDebt( 0.0f ),
+    m_simFrame( &m_particleFrames[ 0 ] ),
+    m_drawFrame( &m_particleFrames[ 1 ] ),
+    m_frameReady( false ),
+    m_particleIndicesDirty( false ),
+    m_lodInterval( 1 ),
+    m_lodStep( 0 ),
+    m_stepEffective( 0 ),
+    m_lastStepEffective( 0 ),
+    m_runEffective( 0 ),
+    m_effectiveParticles( 0 ),
+    m_prewarmSteps( 0 ),
+    m_checkpointBuffer( nullptr ),
+    m_checkpointTaken( false ),
+    m_params(),
     m_particlesPerGroup( 0 ),
     m_particleGroups( 0 ),
     m_xMathFunc( m_mathFn ),
     m_velocityAudioFunc( m_audioFn ),
     m_yMathFunc( m_mathFn ),
-    m_sizeFactor( 1.0f )
+    m_sizeFactor( 1.0f ),
+    m_cpuFlowDelta( 0.0f ),
+    m_cpuFlowFrames( 0 ),
+    m_cpuFlowFresh( false ),
+    m_gpuFlowFresh( false )
 {
-    for ( int i = 0; i < THREADS; ++i )
-    {
-        m_threads.push_back( std::thread( &ParticleEmitter::threadProcessParticles, this, i ) );
-    }
+    // the shared workers call back into the emitter, from any of them
+    m_job.m_work = [ this ]( size_t _worker ){ processTasks( _worker ); };
+    m_job.m_done = [ this ](){ runNextPhase(); };
 
     // Math related positioning functions
     /* 00 */ m_mathFn.push_back( &sinf );
@@ -162,9 +264,10 @@ ParticleEmitter::ParticleEmitter( ofPixels*& _surface ) :
     
     // Audio Related Positioning Functions
     // m_audioFn
-    /* 00 */ m_audioFn.push_back( [ this ]( float x ) { return  m_soundLow;   } );
-    /* 02 */ m_audioFn.push_back( [ this ]( float x ) { return  m_soundMid;   } );
-    /* 04 */ m_audioFn.push_back( [ this ]( float x ) { return  m_soundHigh;  } );
+    // called from the workers, so they read the per frame snapshot of the levels
+    /* 00 */ m_audioFn.push_back( [ this ]( float x ) { return  m_params.m_soundLow;   } );
+    /* 02 */ m_audioFn.push_back( [ this ]( float x ) { return  m_params.m_soundMid;   } );
+    /* 04 */ m_audioFn.push_back( [ this ]( float x ) { return  m_params.m_soundHigh;  } );
     
     m_velocityAudioFunc.randomize();
     
@@ -174,27 +277,62 @@ ParticleEmitter::ParticleEmitter( ofPixels*& _surface ) :
     m_flowWidth         = displaySz.x / 4;
     m_flowHeight        = displaySz.y / 4;
     
-    // simulation setup
-    m_opticalFlow.setup( m_flowWidth, m_flowHeight );
-    m_opticalFlow.setStrength( 40.0f );
-    m_opticalFlow.setOffset( 1.0f );
-    m_opticalFlow.setLambda( 0.015f );
-    m_opticalFlow.setThreshold( 0.01f );
+    // the flow itself is only set up once the mode is used, setupOpticalFlow()
+    m_opticalFlow.setStrength( FLOW_STRENGTH );
+    m_opticalFlow.setOffset( FLOW_OFFSET );
+    m_opticalFlow.setLambda( FLOW_LAMBDA );
+    m_opticalFlow.setThreshold( FLOW_THRESHOLD );
     m_opticalFlow.setTimeBlurActive( true );
-    m_opticalFlow.setTimeBlurRadius( 3.2f );
-    m_opticalFlow.setTimeBlurDecay( 10.0f );
+    m_opticalFlow.setTimeBlurRadius( FLOW_TIME_BLUR_RADIUS );
+    m_opticalFlow.setTimeBlurDecay( FLOW_TIME_BLUR_DECAY );
     
-    // visualization setup
-    m_scalarDisplay.setup( m_flowWidth, m_flowHeight );
-    //m_scalarDisplay.allocate( m_flowWidth, m_flowHeight );
-    m_velocityField.setup( m_flowWidth / 4, m_flowHeight / 4 );
-    
-    m_opticalFlowPixels.allocate( m_flowWidth, m_flowHeight, OF_IMAGE_COLOR_ALPHA );
-    m_ftBo.allocate( 640, 480, GL_RGB32F );
-    m_ftBo.black();
-    
-    m_scalarDisplay.setScale( 1.0f );
+    std::fill( std::begin( m_flockForceLut ), std::end( m_flockForceLut ), 0.0f );
+}
+
+// the shaders, buffers and displays of the flow, on the first video frame
+// it is used for; main thread, with the GL context. The CPU flow needs no
+// GL, only its buffers.
+void ParticleEmitter::setupOpticalFlow( void )
+{
+    if ( s_cpuOpticalFlow )
+    {
+        if ( !m_cpuFlow.isSetup() )
+        {
+            StartupTimeline::Stage stage( "CPU optical flow" );
+            
+            CpuOpticalFlow::Settings settings = { FLOW_STRENGTH, FLOW_OFFSET, FLOW_LAMBDA, FLOW_THRESHOLD, true, FLOW_TIME_BLUR_RADIUS, FLOW_TIME_BLUR_DECAY };
+            m_cpuFlow.setup( m_flowWidth, m_flowHeight, settings );
+        }
+    }
+    else if ( !m_ftBo.isAllocated() )
+    {
+        StartupTimeline::Stage stage( "Optical flow" );
+        
+        // simulation setup
+        m_opticalFlow.setup( m_flowWidth, m_flowHeight );
+        
+        // visualization setup
+        m_scalarDisplay.setup( m_flowWidth, m_flowHeight );
+        //m_scalarDisplay.allocate( m_flowWidth, m_flowHeight );
+        m_velocityField.setup( m_flowWidth / 4, m_flowHeight / 4 );
+        
+        m_ftBo.allocate( 640, 480, GL_RGB32F );
+        m_ftBo.black();
+        
+        m_scalarDisplay.setScale( 1.0f );
+    }
     
+    // the workers read the flow field while stepping, not mid run
+    if ( !isOpticalFlowReady() )
+    {
+        waitThreadedUpdate();
+        m_flowField.allocate( m_flowWidth, m_flowHeight );
+    }
+}
+
+bool ParticleEmitter::isOpticalFlowReady( void ) const
+{
+    return m_flowField.isAllocated();
 }
 
 ParticleEmitter::~ParticleEmitter(void)
@@ -203,64 +341,157 @@ ParticleEmitter::~ParticleEmitter(void)
 }
 
 #define EMISSION_AREA_PERCENTAGE 1.0f
-void ParticleEmitter::addParticles( int _group )
+void ParticleEmitter::addParticles( int _group, int _maxParticles )
 {
-    ofVec2f      refSize( m_referenceSurface->getWidth() * m_sizeFactor, m_referenceSurface->getHeight() * m_sizeFactor );
-    ofRectangle  emissionArea( m_position, m_position );
-    
-    // create groups as needed
-    while ( m_particles.size() <= _group )
+    addGroups( _group + 1 );
+    reserveParticles( _group );
+    emitParticles( m_params, _group, _maxParticles );
+}
+
+// creates groups up to _groups, with everything kept per group
+void ParticleEmitter::addGroups( size_t _groups )
+{
+    while ( m_particles.size() < _groups )
     {
-        m_particles.push_back( std::vector< Particle* >() );
-        m_particleMatrix.push_back( spatial_matrix< Particle >( 100, ofGetWidth(), ofGetHeight() ) );
+        m_particles.push_back( std::vector< Particle >() );
+        m_particleSpans.push_back( std::vector< ParticleSpan >() );
+        m_flockForces.push_back( std::vector< ofVec2f >() );
+        m_particleMatrix.push_back( spatial_matrix< Particle >( m_params.m_zoneRadius, ofGetWidth(), ofGetHeight() ) );
+        m_groupRandom.push_back( std::mt19937( static_cast< unsigned int >( rand() ) ) );
     }
     
-    auto& particleGroup = m_particles[ _group ];
+    for ( auto& frame : m_particleFrames )
+    {
+        frame.m_vertices.resize( m_particles.size() );
+        frame.m_colors.resize( m_particles.size() );
+        frame.m_counts.resize( m_particles.size(), 0 );
+    }
+}
+
+void ParticleEmitter::emitParticles( const SimParams& _params, size_t _group, int _maxParticles )
+{
+    // only touches the group and its own generator, so groups can emit from
+    // the workers in parallel; the group must already be reserved to capacity
+    auto& particleGroup  = m_particles[ _group ];
     auto& particleMatrix = m_particleMatrix[ _group ];
-    int particlesToEmit = std::min< int >( 10, s_particlesPerGroup - particleGroup.size() );
+    auto& generator      = m_groupRandom[ _group ];
+    int particlesToEmit  = std::min< int >( _maxParticles, _params.m_particlesPerGroup - particleGroup.size() );
     
-    if ( m_referenceSurface )
+    if ( particlesToEmit <= 0 )
     {
-        emissionArea.x      = ofRandom( refSize.x - refSize.x * EMISSION_AREA_PERCENTAGE );
-        emissionArea.y      = ofRandom( refSize.y - refSize.y * EMISSION_AREA_PERCENTAGE );
+        return;
+    }
+    
+    auto random = [ &generator ]( float _min, float _max )
+    {
+        return std::uniform_real_distribution< float >( _min, std::max( _min, _max ) )( generator );
+    };
+    
+    ofRectangle  emissionArea( _params.m_position, _params.m_position );
+    
+    if ( _params.m_referenceSurface )
+    {
+        ofVec2f refSize( _params.m_referenceSurface->getWidth() * _params.m_sizeFactor, _params.m_referenceSurface->getHeight() * _params.m_sizeFactor );
+        
+        emissionArea.x      = random( 0.0f, refSize.x - refSize.x * EMISSION_AREA_PERCENTAGE );
+        emissionArea.y      = random( 0.0f, refSize.y - refSize.y * EMISSION_AREA_PERCENTAGE );
         emissionArea.width  = refSize.x * EMISSION_AREA_PERCENTAGE;
         emissionArea.height = refSize.y * EMISSION_AREA_PERCENTAGE;
     }
     
-    float angle = ofRandom( 0.0f, 2 * PI );
+    float angle = random( 0.0f, 2 * PI );
     
     for ( int i = 0; i < particlesToEmit; ++i )
     {
         
-        float   angleVar  = ofRandom( 0.0f, 0.8f * PI );
+        float   angleVar  = random( 0.0f, 0.8f * PI );
         ofVec2f angleVector( sin( angle + angleVar ), cos( angle + angleVar ) );
         
-        Particle* p = 0;
-        if ( m_referenceSurface )
+        // the group was reserved to capacity, so this never reallocates
+        if ( _params.m_referenceSurface )
         {
             ofVec2f pos;
-            pos.x = ofRandom( emissionArea.x, emissionArea.x + emissionArea.width  );
-            pos.y = ofRandom( emissionArea.y, emissionArea.y + emissionArea.height );
             
-            p = new Particle( this, pos, angleVector );
-            p->m_referenceSurface = m_referenceSurface;
+            // mostly where the image has something to show, the rest anywhere
+            if ( _params.m_emissionMap && random( 0.0f, 1.0f ) < _params.m_emissionImportance )
+            {
+                pos = _params.m_emissionMap->sample( generator ) * _params.m_sizeFactor;
+            }
+            else
+            {
+                pos.x = random( emissionArea.x, emissionArea.x + emissionArea.width  );
+                pos.y = random( emissionArea.y, emissionArea.y + emissionArea.height );
+            }
+            
+            particleGroup.emplace_back( this, pos, angleVector );
         }
         else
         {
-            p = new Particle( this, m_position, angleVector );
+            particleGroup.emplace_back( this, _params.m_position, angleVector );
         }
         
-        p->m_maxSpeedSquared = ofRandom( s_midSpeed, s_maxSpeed  );
-        p->m_minSpeedSquared = ofRandom( s_minSpeed, s_midSpeed );
+        Particle& p = particleGroup.back();
+        
+        p.m_maxSpeedSquared = random( _params.m_midSpeed, _params.m_maxSpeed );
+        p.m_minSpeedSquared = random( _params.m_minSpeed, _params.m_midSpeed );
+        
+        p.m_acceleration         = p.m_direction;
+        p.m_acceleration.normalize();
+        p.m_acceleration        *= 2.5f;
+        p.m_group                = _group;
+        p.m_lifeTimeLeft         = random( _params.m_minParticleLife, _params.m_maxParticleLife );
+        particleMatrix.insert( p, p.m_position );
+    }
+}
+
+void ParticleEmitter::reserveParticles( int _group )
+{
+    auto&  particleGroup = m_particles[ _group ];
+    size_t capacity      = static_cast< size_t >( m_params.m_particlesPerGroup );
+    
+    if ( particleGroup.capacity() >= capacity )
+    {
+        return;
+    }
+    
+    // grow everything the group touches per frame to the new capacity at once
+    particleGroup.reserve( capacity );
+    m_particleSpans[ _group ].reserve( capacity / PARTICLE_CHUNK + 1 );
+    m_flockForces[ _group ].resize( capacity );
+
+    // both frames, the one drawn now is written after the next flip
+    for ( auto& frame : m_particleFrames )
+    {
+        frame.m_vertices[ _group ].resize( capacity * 4 );
+        frame.m_colors[ _group ].resize( capacity * 4 );
+    }
+    
+    // the particles moved, so the matrix has to point at the new storage
+    auto& matrix = m_particleMatrix[ _group ];
+    matrix.reserve( capacity );
+    matrix.clear();
+    for ( auto& particle : particleGroup )
+    {
+        matrix.insert( particle, particle.m_position );
+    }
+    
+    // two triangles per particle, shared by all groups
+    if ( m_particleIndices.size() < capacity * 6 )
+    {
+        size_t quads = m_particleIndices.size() / 6;
+        m_particleIndices.resize( capacity * 6 );
         
-        p->m_acceleration         = p->m_direction;
-        p->m_acceleration.normalize();
-        p->m_acceleration        *= 2.5f;
-        p->m_group                = _group;
-        p->m_lifeTimeLeft         = ofRandom( ParticleEmitter::s_minParticleLife, ParticleEmitter::s_maxParticleLife );
-        particleGroup.push_back( p );
-        particleMatrix.insert( *p, p->m_position );
+        for ( size_t q = quads; q < capacity; ++q )
+        {
+            ofIndexType* index = &m_particleIndices[ q * 6 ];
+            ofIndexType  first = static_cast< ofIndexType >( q * 4 );
+            index[ 0 ] = first;     index[ 1 ] = first + 1; index[ 2 ] = first + 2;
+            index[ 3 ] = first;     index[ 4 ] = first + 2; index[ 5 ] = first + 3;
+        }
+        m_particleIndicesDirty = true;
     }
+    
+    AllocationTracker::restartWarmup();
 }
 
 void ParticleEmitter::draw( void )
@@ -268,17 +499,44 @@ void ParticleEmitter::draw( void )
     m_drawDelta = ofGetElapsedTimef() - m_currentDrawTime;
     m_currentDrawTime += m_drawDelta;
     
-    for ( auto& particleGroup : m_particles )
+    if ( m_particleIndicesDirty )
+    {
+        m_particleVbo.setIndexData( m_particleIndices.data(), m_particleIndices.size(), GL_STATIC_DRAW );
+        m_particleIndicesDirty = false;
+    }
+    
+    // one batch per group with the geometry of the last finished step; the
+    // workers are writing the next one to the other frame meanwhile
+    const ParticleFrame& frame = *m_drawFrame;
+    
+    ofPushMatrix();
+    ofTranslate( m_position.x, m_position.y );
+    
+    for ( size_t groupIdx = 0; groupIdx < frame.m_counts.size(); ++groupIdx )
     {
-        for ( auto particle : particleGroup )
+        size_t count = frame.m_counts[ groupIdx ];
+        
+        if ( count == 0 )
         {
-            particle->draw();
+            continue;
         }
+        
+        m_particleVbo.setVertexData( &frame.m_vertices[ groupIdx ][ 0 ].x, 2, count * 4, GL_STREAM_DRAW, sizeof( ofVec2f ) );
+        m_particleVbo.setColorData( &frame.m_colors[ groupIdx ][ 0 ], count * 4, GL_STREAM_DRAW );
+        m_particleVbo.drawElements( GL_TRIANGLES, count * 6 );
     }
+    
+    ofPopMatrix();
 }
 
 void ParticleEmitter::drawOpticalFlow( void )
 {
+    // the displays are GPU flow only
+    if ( !isOpticalFlowReady() || s_cpuOpticalFlow || !m_ftBo.isAllocated() )
+    {
+        return;
+    }
+    
     ofPoint displaySz   = ofGetWindowSize();
     ofPushStyle();
     ofEnableBlendMode( OF_BLENDMODE_ALPHA );
@@ -298,11 +556,15 @@ void ParticleEmitter::debugDraw( void )
 {
     if ( ParticleEmitter::s_debugDraw )
     {
+        // the particles themselves are not double buffered, so debug drawing
+        // gives up the overlap with the simulation
+        waitThreadedUpdate();
+        
         for ( auto& particleGroup : m_particles )
         {
-            for ( auto particle : particleGroup )
+            for ( auto& particle : particleGroup )
             {
-                particle->debugDraw();
+                particle.debugDraw();
             }
         }
     }
@@ -310,101 +572,489 @@ void ParticleEmitter::debugDraw( void )
 
 void ParticleEmitter::update( float _currentTime, float _delta )
 {
+    ALLOCATION_SCOPE( kEmitter );
+    
+    // frame boundary: join the step started last frame and flip its geometry
+    // to draw; the frame draw was reading is written by the next step
+    waitThreadedUpdate();
+    
+    if ( m_frameReady )
+    {
+        std::swap( m_simFrame, m_drawFrame );
+        m_frameReady = false;
+    }
+    
+    // the flow of the last video frame, between the runs sampling it
+    if ( m_cpuFlow.poll() || m_cpuFlowFresh )
+    {
+        m_flowField.push( m_cpuFlow.getFlow(), FLOW_FORCE, _currentTime );
+        m_cpuFlowFresh = false;
+    }
+    else if ( m_gpuFlowFresh )
+    {
+        m_flowField.push( m_opticalFlowPixels, FLOW_FORCE, _currentTime );
+        m_gpuFlowFresh = false;
+    }
+    
+    // settle the simulation without drawing it; the steps are spread over as
+    // many frames as needed so the app stays responsive meanwhile
+    if ( m_prewarmSteps > 0 )
+    {
+        float budgetEnd = ofGetElapsedTimef() + PREWARM_BUDGET;
+        
+        while ( m_prewarmSteps > 0 && ofGetElapsedTimef() < budgetEnd )
+        {
+            simulate( _currentTime - m_prewarmSteps * PREWARM_DELTA, PREWARM_DELTA );
+            --m_prewarmSteps;
+        }
+        return;
+    }
+    
+    // frame N+1 is simulated by the workers while the app draws frame N
+    if ( prepareSimulation( _currentTime, _delta ) )
+    {
+        scheduleSteps( _currentTime, _delta, s_fixedTimestep );
+        runSteps();
+    }
+}
+
+void ParticleEmitter::prewarm( int _steps )
+{
+    m_prewarmSteps = std::max( _steps, 0 );
+}
+
+bool ParticleEmitter::isPrewarming( void ) const
+{
+    return m_prewarmSteps > 0;
+}
+
+// summed over the steps of the frame, for comparing against the particle count
+size_t ParticleEmitter::effectiveParticles( void ) const
+{
+    return m_effectiveParticles;
+}
+
+void ParticleEmitter::simulate( float _currentTime, float _delta )
+{
+    if ( prepareSimulation( _currentTime, _delta ) )
+    {
+        scheduleSteps( _currentTime, _delta, false );
+        runSteps();
+        waitThreadedUpdate();
+    }
+}
+
+// one step of the frame's length, or as many fixed steps as the frame time
+// adds up to; a long frame is caught up to s_maxCatchUpSteps and the rest of
+// it is dropped, so a hitch never snowballs into longer and longer frames
+void ParticleEmitter::scheduleSteps( float _currentTime, float _delta, bool _fixed )
+{
+    if ( !_fixed )
+    {
+        m_stepCount                 = 1;
+        m_stepTime                  = _currentTime;
+        m_stepDelta                 = _delta;
+        m_simulationDebt            = 0.0f;
+        m_params.m_writeGeometry    = true;
+        m_params.m_interpolation    = 1.0f;
+        return;
+    }
+    
+    int   maxSteps = std::max< int >( s_maxCatchUpSteps, 1 );
+    float step     = 1.0f / std::max< int >( s_simulationRate, 1 );
+    
+    m_simulationDebt += _delta;
+    m_stepCount       = std::min< int >( static_cast< int >( m_simulationDebt / step ), maxSteps );
+    m_simulationDebt  = m_stepCount < maxSteps ? m_simulationDebt - m_stepCount * step : fmodf( m_simulationDebt, step );
+    m_stepDelta       = step;
+    m_stepTime        = _currentTime - m_simulationDebt - ( m_stepCount - 1 ) * step;
+    
+    // the workers skip the quads of the steps, the frame is drawn from one
+    // pass placed between the last two of them
+    m_params.m_writeGeometry    = false;
+    m_params.m_interpolation    = m_simulationDebt / step;
+}
+
+// everything of a step that has to happen on the main thread, false when
+// there is nothing to simulate
+bool ParticleEmitter::prepareSimulation( float _currentTime, float _delta )
+{
+    // snapshot the parameters for this frame, rebuilding what depends on them
+    updateParams( _currentTime, _delta );
+    
     m_velocityAudioFunc.update( _delta );
     m_xMathFunc.update(  _delta );
     m_yMathFunc.update(  _delta );
     
     // add groups
-    if ( m_particleGroups < s_particleGroups )
+    if ( m_particleGroups < m_params.m_particleGroups )
     {
-        int groupsToCreate = s_particleGroups - m_particleGroups;
+        int groupsToCreate = m_params.m_particleGroups - m_particleGroups;
         for ( int i = 0; i < groupsToCreate; ++i ) {
             addParticles( m_particleGroups + i );
         }
         m_particleGroups += groupsToCreate;
     }
     // remove groups
-    else if ( m_particleGroups > s_particleGroups )
+    else if ( m_particleGroups > m_params.m_particleGroups )
     {
-        int groupsToRemove = m_particleGroups - s_particleGroups;
+        int groupsToRemove = m_particleGroups - m_params.m_particleGroups;
         for ( int i = 0; i < groupsToRemove; ++i )
         {
-            auto  particleGroupItr  = m_particles.rbegin();
-            auto& particleGroup     = *particleGroupItr;
-            
-            for ( auto particle : particleGroup ) {
-                delete particle;
-            }
-            
             m_particles.pop_back();
+            m_particleSpans.pop_back();
+            m_flockForces.pop_back();
             m_particleMatrix.pop_back();
+            m_groupRandom.pop_back();
+            
+            for ( auto& frame : m_particleFrames )
+            {
+                frame.m_vertices.pop_back();
+                frame.m_colors.pop_back();
+                frame.m_counts.pop_back();
+            }
         }
         
-        m_particleGroups = s_particleGroups;
+        m_particleGroups = m_params.m_particleGroups;
+        AllocationTracker::restartWarmup();
     }
     
-    // add particles
-    if ( s_particlesPerGroup > m_particlesPerGroup )
+    // add particles, either topping every group up in one go from the
+    // workers or trickling a few per frame from here
+    if ( m_params.m_particlesPerGroup > m_particlesPerGroup )
     {
-        size_t idx = 0;
-        for ( auto& particleGroup : m_particles )
+        for ( size_t idx = 0; idx < m_particles.size(); ++idx )
         {
-            addParticles( idx++ );
+            if ( m_params.m_emitPerGroup > 0 )
+            {
+                reserveParticles( idx );
+            }
+            else
+            {
+                addParticles( idx );
+            }
         }
     }
     // remove particles
-    else if ( m_particlesPerGroup > s_particlesPerGroup )
+    else if ( m_particlesPerGroup > m_params.m_particlesPerGroup )
     {
-        int particlesToRemove = m_particlesPerGroup - s_particlesPerGroup;
+        int particlesToRemove = m_particlesPerGroup - m_params.m_particlesPerGroup;
         
         for ( auto& particleGroup : m_particles )
         {
-            for ( int i = 0; i < particlesToRemove; ++i )
+            size_t toRemove = std::min< size_t >( particlesToRemove, particleGroup.size() );
+            
+            for ( size_t i = 0; i < toRemove; ++i )
             {
-                particleGroup.back()->m_lifeTimeLeft = -1.0f;
+                particleGroup[ particleGroup.size() - 1 - i ].m_lifeTimeLeft = -1.0f;
             }
         }
         
-        m_particlesPerGroup = s_particlesPerGroup;
+        m_particlesPerGroup = m_params.m_particlesPerGroup;
+    }
+    
+    // short circuit in case we don't have any particle group
+    if ( m_particles.size() == 0 )
+    {
+        return false;
     }
     
+    // resize or re-pin the shared workers between frames when the settings changed
+    WorkerPool::instance().configure( s_workerThreads, s_pinWorkers, s_reservedCores );
+    
+    return true;
+}
+
+// what changes with every step; the steps of a frame run back to back on
+// the pipeline thread, in between their phases
+void ParticleEmitter::advanceStep( float _currentTime, float _delta )
+{
+    m_params.m_currentTime = _currentTime;
+    m_params.m_delta       = _delta;
+    
     // update timers
     m_updateFlockTimer += _delta;
     m_currentTime       = _currentTime;
-    m_delta             = _delta;
- 
-    // update the flocking update timers
-    if ( m_lastFlockUpdateTime == 0.0 )
+    
+    // Every particle is flocked once per m_updateFlockEvery, but one slice of
+    // them at a time, evenly spread over that period, so the cost is spread
+    // over the frames instead of landing on one. Every slice due is run; past
+    // a whole round the backlog only shows in the ratios.
+    int   slices     = m_params.m_flockSlices;
+    float sliceEvery = m_updateFlockEvery / slices;
+    int   due        = std::min( static_cast< int >( m_updateFlockTimer / sliceEvery ), slices );
+    
+    m_updateFlockTimer = due < slices ? m_updateFlockTimer - due * sliceEvery : std::fmod( m_updateFlockTimer, sliceEvery );
+    m_updateFlocking   = due > 0;
+    
+    // Before the slices every particle flocked on every step, with a ratio
+    // ramping from 0 to 1 over m_updateFlockEvery: half the force per step
+    // on average, bar the 0 of the step it restarted on. A slice gets that
+    // for every step it sat out, so the strengths keep their tuning.
+    float stepShare = 0.5f * std::max( 1.0f - _delta / m_updateFlockEvery, 0.0f ) / std::max( _delta, FLOCK_MIN_DELTA );
+    
+    for ( int i = 0; i < due; ++i )
     {
-        m_lastFlockUpdateTime = m_currentTime - m_updateFlockEvery;
-        m_updateFlockTimer    = m_updateFlockEvery;
+        m_flockSlice = ( m_flockSlice + 1 ) % slices;
+        
+        float& sliceTime                   = m_flockSliceTimes[ m_flockSlice ];
+        float  elapsed                     = sliceTime < 0.0f ? m_updateFlockEvery : _currentTime - sliceTime;
+        m_flockSliceRatios[ m_flockSlice ] = elapsed * stepShare;
+        sliceTime                          = _currentTime;
     }
+    
+    m_params.m_updateFlocking   = m_updateFlocking;
+    m_params.m_flockSlice       = ( m_flockSlice - std::max( due, 1 ) + 1 + slices ) % slices;
+    m_params.m_flockSliceCount  = due;
+    
+    // level of detail, adapted to how the last step did against the budget
+    int budget = m_params.m_lodBudget;
+    
+    if ( budget > 0 && m_lastStepEffective > static_cast< size_t >( budget ) )
+    {
+        m_lodInterval = std::min( m_lodInterval + 1, LOD_MAX_INTERVAL );
+    }
+    else if ( budget == 0 || m_lastStepEffective < budget * LOD_BUDGET_SLACK )
+    {
+        m_lodInterval = std::max( m_lodInterval - 1, 1 );
+    }
+    
+    m_lodInterval           = std::max( m_lodInterval, m_params.m_lodMinInterval );
+    m_params.m_lodInterval  = m_lodInterval;
+    m_params.m_lodStep      = m_lodStep++;
+}
 
-    // short circuit in case we don't have any particle group
-    if ( m_particles.size() == 0 )
+// starts the scheduled steps on the shared workers, waitThreadedUpdate joins them
+void ParticleEmitter::runSteps( void )
+{
+    m_pipeline.release( 1 );
+    
+    m_stepIndex = 0;
+    m_phase     = kIdle;
+    runNextPhase();
+}
+
+// picks the phase after m_phase, false once the run is over
+bool ParticleEmitter::advancePhase( void )
+{
+    if ( m_pause )
     {
-        return;
+        return false;
     }
     
-    if ( m_updateFlockTimer >= m_updateFlockEvery )
+    // threaded update: whole groups, chunks of particles, whole groups again
+    switch ( m_phase )
     {
-        m_updateFlockTimer    = 0.0;
-        m_lastFlockUpdateTime = _currentTime;
-        m_updateFlocking      = true;
+        case kIdle:
+        case kFinalizeGroups:
+            if ( m_phase == kFinalizeGroups )
+            {
+                m_lastStepEffective = m_stepEffective.exchange( 0 );
+                m_runEffective     += m_lastStepEffective;
+            }
+            
+            if ( m_stepIndex < m_stepCount )
+            {
+                advanceStep( m_stepTime + m_stepIndex * m_stepDelta, m_stepDelta );
+                ++m_stepIndex;
+                m_phase = kGroupForces;
+                return true;
+            }
+            
+            // also when the frame was too short for a fixed step, the quads
+            // still have to follow the interpolation
+            if ( !m_params.m_writeGeometry )
+            {
+                for ( size_t groupIdx = 0; groupIdx < m_particles.size(); ++groupIdx )
+                {
+                    m_simFrame->m_counts[ groupIdx ] = m_particles[ groupIdx ].size();
+                }
+                m_phase = kWriteGeometry;
+                return true;
+            }
+            return beginCheckpoint();
+        
+        case kGroupForces:      m_phase = isFlocking( m_params ) ? kFlockForces : kParticleChunks;  return true;
+        case kFlockForces:      m_phase = kParticleChunks;                                          return true;
+        case kParticleChunks:   m_phase = kFinalizeGroups;                                          return true;
+        case kWriteGeometry:    return beginCheckpoint();
+        case kCheckpoint:
+            m_checkpointBuffer = nullptr;
+            m_checkpointTaken  = true;
+            return false;
     }
     
-    // start threaded update
-    startThreadedUpdate();
-    // wait threaded update if it still pending
-    waitThreadedUpdate();
+    return false;
 }
 
-void ParticleEmitter::updateVideo( bool _isNewFrame, ofVideoPlayer& _source, float _delta )
+// Posts the next phase that has tasks to the shared workers. Called by
+// runSteps for the first one and by the worker finishing a phase for the
+// rest, so no thread waits in between.
+void ParticleEmitter::runNextPhase( void )
 {
+    while ( advancePhase() )
+    {
+        if ( pushTasks( m_phase ) > 0 )
+        {
+            WorkerPool::instance().post( m_job );
+            return;
+        }
+    }
+    
+    // a pause ends the run early, and a half written frame is never shown
+    m_frameReady         = !m_pause;
+    m_phase              = kIdle;
+    m_effectiveParticles = m_runEffective;
+    m_runEffective       = 0;
+    m_pipeline.arrive();
+}
+
+void ParticleEmitter::updateParams( float _currentTime, float _delta )
+{
+    SimParams previous = m_params;
+    
+    m_params.m_currentTime          = _currentTime;
+    m_params.m_delta                = _delta;
+    m_params.m_updateType           = m_updateType;
+    m_params.m_sizeFactor           = m_sizeFactor;
+    m_params.m_position             = m_position;
+    m_params.m_referenceSurface     = m_referenceSurface;
+    m_params.m_tiledSurface         = m_tiledSurface;
+    m_params.m_emissionMap          = m_emissionMap;
+
+    m_params.m_updateFlocking       = m_updateFlocking;
+    m_params.m_zoneRadius           = s_zoneRadius;
+    m_params.m_zoneRadiusSqrd       = m_params.m_zoneRadius * m_params.m_zoneRadius;
+    m_params.m_repelStrength        = s_repelStrength;
+    m_params.m_alignStrength        = s_alignStrength;
+    m_params.m_attractStrength      = s_attractStrength;
+    m_params.m_lowThresh            = s_lowThresh;
+    m_params.m_highThresh           = s_highThresh;
+    m_params.m_maxNeighbours        = s_maxNeighbours;
+    m_params.m_flockSlices          = s_flockSlices;
+    
+    m_params.m_lodMinInterval       = s_lodInterval;
+    m_params.m_lodBudget            = s_lodBudget;
+    m_params.m_lodAlpha             = s_lodAlpha;
+    m_params.m_lodSpeedSqrd         = s_lodSpeed * s_lodSpeed;
+    m_params.m_lodFlatness          = s_lodFlatness;
+
+    m_params.m_maxRadius            = Particle::s_maxRadius;
+    m_params.m_particleSizeRatio    = Particle::s_particleSizeRatio;
+    m_params.m_particleSpeedRatio   = Particle::s_particleSpeedRatio;
+    m_params.m_friction             = Particle::s_friction;
+    m_params.m_dampness             = Particle::s_dampness;
+    m_params.m_colorRedirection     = Particle::s_colorRedirection;
+    
+    m_params.m_minSpeed             = s_minSpeed;
+    m_params.m_midSpeed             = s_midSpeed;
+    m_params.m_maxSpeed             = s_maxSpeed;
+    m_params.m_functionStrength     = s_functionStrength;
+    m_params.m_minParticleLife      = s_minParticleLife;
+    m_params.m_maxParticleLife      = s_maxParticleLife;
+    m_params.m_emissionImportance   = s_emissionImportance;
+    m_params.m_particlesPerGroup    = s_particlesPerGroup;
+    m_params.m_particleGroups       = s_particleGroups;
+    m_params.m_emitPerGroup         = s_bulkEmission ? m_params.m_particlesPerGroup : 0;
+    
+    m_params.m_soundLow             = m_soundLow;
+    m_params.m_soundMid             = m_soundMid;
+    m_params.m_soundHigh            = m_soundHigh;
+
+    // the slices are made of other particles now, start them over
+    if ( m_params.m_flockSlices != previous.m_flockSlices )
+    {
+        std::fill( m_flockSliceTimes.begin(), m_flockSliceTimes.end(), -1.0f );
+        m_flockSlice = 0;
+    }
+    
+    // the matrix cells follow the flocking zone, so queries always touch 3x3 cells
+    if ( m_params.m_zoneRadius != previous.m_zoneRadius )
+    {
+        rebuildParticleMatrices();
+    }
+    
+    if ( m_params.m_lowThresh       != previous.m_lowThresh     ||
+         m_params.m_highThresh      != previous.m_highThresh    ||
+         m_params.m_repelStrength   != previous.m_repelStrength ||
+         m_params.m_alignStrength   != previous.m_alignStrength ||
+         m_params.m_attractStrength != previous.m_attractStrength )
+    {
+        rebuildFlockForceLut();
+    }
+}
+
+void ParticleEmitter::rebuildParticleMatrices( void )
+{
+    for ( size_t groupIdx = 0; groupIdx < m_particles.size(); ++groupIdx )
+    {
+        auto& matrix = m_particleMatrix[ groupIdx ];
+        matrix.resize( m_params.m_zoneRadius, ofGetWidth(), ofGetHeight() );
+        
+        for ( auto& particle : m_particles[ groupIdx ] )
+        {
+            matrix.insert( particle, particle.m_position );
+        }
+    }
+}
+
+void ParticleEmitter::rebuildFlockForceLut( void )
+{
+    // force magnitude of every flocking zone, indexed by the squared distance
+    // percentage inside the zone radius
+    for ( int i = 0; i <= FLOCK_LUT_SIZE; ++i )
+    {
+        float percent = static_cast< float >( i ) / FLOCK_LUT_SIZE;
+        float F       = 0.0f;
+        
+        if ( percent < m_params.m_lowThresh )            // Separation
+        {
+            F = m_params.m_lowThresh * m_params.m_repelStrength;
+        }
+        else if ( percent < m_params.m_highThresh )      // Alignment
+        {
+            float threshDelta     = m_params.m_highThresh - m_params.m_lowThresh;
+            float adjustedPercent = ( percent - m_params.m_lowThresh ) / threshDelta;
+            F                     = ( 1.0f - ( cos( adjustedPercent * PI2 ) * -0.5f + 0.5f ) ) * m_params.m_alignStrength;
+        }
+        else if ( m_params.m_highThresh < 1.0f )         // Cohesion
+        {
+            float threshDelta     = 1.0f - m_params.m_highThresh;
+            float adjustedPercent = ( percent - m_params.m_highThresh ) / threshDelta;
+            F                     = ( 1.0f - ( cos( adjustedPercent * PI2 ) * -0.5f + 0.5f ) ) * m_params.m_attractStrength;
+        }
+        
+        m_flockForceLut[ i ] = F;
+    }
+}
+
+void ParticleEmitter::updateVideo( bool _isNewFrame, ofTexture& _source, const std::shared_ptr< ofPixels >& _frame, float _delta )
+{
+    m_cpuFlowDelta += _delta;
+    
     if ( _isNewFrame && ( m_updateType & kOpticalFlow ) )
     {
+        setupOpticalFlow();
+        
+        // the run of the last frame is not waited for: while it is still in
+        // flight this frame is skipped and its time goes to the next one.
+        // update() pushes the flow to the field once a run is done
+        if ( s_cpuOpticalFlow )
         {
-            m_ftBo.stretchIntoMe( _source.getTexture() );
+            m_cpuFlowFresh = m_cpuFlow.poll() || m_cpuFlowFresh;
+            ++m_cpuFlowFrames;
+            
+            if ( !m_cpuFlow.isRunning() )
+            {
+                m_cpuFlow.start( _frame, m_cpuFlowDelta, m_cpuFlowFrames );
+                m_cpuFlowDelta  = 0.0f;
+                m_cpuFlowFrames = 0;
+            }
+            return;
+        }
+        
+        {
+            m_ftBo.stretchIntoMe( _source );
             /*
             ofPushStyle();
             m_ftBo.begin();
@@ -417,7 +1067,7 @@ void ParticleEmitter::updateVideo( bool _isNewFrame, ofVideoPlayer& _source, flo
             */
         }
         
-        //m_opticalFlow.setSource( _source.getTexture() );
+        //m_opticalFlow.setSource( _source );
         m_opticalFlow.setSource( m_ftBo.getTexture() );
         m_opticalFlow.update( _delta );
         updateOpticalFlow( _delta );
@@ -430,20 +1080,63 @@ void ParticleEmitter::updateOpticalFlow( float _delta )
     m_scalarDisplay.setSource( m_opticalFlow.getOpticalFlowDecay() );
     m_scalarDisplay.update();
     m_opticalFlow.getOpticalFlowDecay().readToPixels( m_opticalFlowPixels );
+    m_gpuFlowFresh = true;
 }
 
 
-void ParticleEmitter::startThreadedUpdate( void )
+size_t ParticleEmitter::pushTasks( UpdatePhase _phase )
 {
-    // initialize the number of threads that are currently active
-    size_t t_processing = std::min< size_t >( THREADS, m_particles.size() );
-    m_processing = std::min< size_t >( THREADS, m_particles.size() );
+    size_t queues = WorkerPool::instance().size();
+    size_t tasks  = 0;
     
-    // notify all trheads to do their job
-    for ( size_t i( 0 ); i < t_processing; ++i)
+    // one queue per worker of the shared pool, rebuilt when it was resized;
+    // nothing of this emitter runs in between two phases
+    if ( m_taskQueues.size() != queues )
     {
-        m_conditionVar.notify_one();
+        m_taskQueues.clear();
+        for ( size_t i = 0; i < queues; ++i )
+        {
+            m_taskQueues.push_back( std::unique_ptr< WorkStealingQueue< ParticleTask > >( new WorkStealingQueue< ParticleTask >() ) );
+            m_taskQueues.back()->reserve( TASKS_PER_QUEUE );
+        }
+        AllocationTracker::restartWarmup();
     }
+
+    // hand the tasks out, whole groups round robin or a contiguous run of
+    // chunks per worker; whatever turns out uneven gets stolen
+    if ( _phase == kFlockForces || _phase == kParticleChunks || _phase == kWriteGeometry || _phase == kCheckpoint )
+    {
+        size_t totalChunks = 0;
+        for ( auto& particleGroup : m_particles )
+        {
+            totalChunks += ( particleGroup.size() + PARTICLE_CHUNK - 1 ) / PARTICLE_CHUNK;
+        }
+        
+        size_t chunkIdx = 0;
+        for ( size_t groupIdx = 0; groupIdx < m_particles.size(); ++groupIdx )
+        {
+            size_t size = m_particles[ groupIdx ].size();
+            m_particleSpans[ groupIdx ].resize( ( size + PARTICLE_CHUNK - 1 ) / PARTICLE_CHUNK );
+            
+            for ( size_t begin = 0; begin < size; begin += PARTICLE_CHUNK, ++chunkIdx )
+            {
+                ParticleTask task = { groupIdx, begin, std::min< size_t >( begin + PARTICLE_CHUNK, size ) };
+                m_taskQueues[ chunkIdx * queues / totalChunks ]->push( task );
+                ++tasks;
+            }
+        }
+    }
+    else
+    {
+        for ( size_t groupIdx = 0; groupIdx < m_particles.size(); ++groupIdx )
+        {
+            ParticleTask task = { groupIdx, 0, m_particles[ groupIdx ].size() };
+            m_taskQueues[ groupIdx % queues ]->push( task );
+            ++tasks;
+        }
+    }
+    
+    return tasks;
 }
 
 void ParticleEmitter::setInputArea( ofVec2f& _imageSize )
@@ -458,208 +1151,348 @@ void ParticleEmitter::setInputArea( ofVec2f& _imageSize )
 
 void ParticleEmitter::waitThreadedUpdate( void )
 {
-    std::unique_lock< std::mutex > ul( m_updateLock );
-    
-    // and wait until all threadsdo their job
-    while ( !m_conditionVar.wait_for( ul, std::chrono::milliseconds( 10 ), [ this ](){ return m_processing == 0; } ) );
+    // and wait until the step in flight, if any, is done
+    m_pipeline.wait();
 }
 
-void ParticleEmitter::threadProcessParticles( size_t _threadNumber )
+void ParticleEmitter::processTasks( size_t _worker )
 {
-    while ( !m_stop )
+    ParticleTask task;
+    size_t       queues = m_taskQueues.size();
+    size_t       own    = _worker % queues;
+    
+    // own tasks first, then steal from the others; nothing is pushed during
+    // a phase, so one pass over the victims is enough
+    while ( m_taskQueues[ own ]->pop( task ) )
+    {
+        runTask( task );
+    }
+    
+    for ( size_t i = 1; i < queues; ++i )
     {
-        std::unique_lock< std::mutex > cl( m_updateLock );
-        // wait until we have something to process or we need to stop
-        m_conditionVar.wait( cl, [ this ](){ return m_processing > 0 || m_stop; } );
+        auto& victim = *m_taskQueues[ ( own + i ) % queues ];
         
-        if ( m_pause || m_stop )
+        while ( victim.steal( task ) )
         {
-            continue;
+            runTask( task );
         }
+    }
+}
+
+void ParticleEmitter::runTask( const ParticleTask& _task )
+{
+    switch ( m_phase )
+    {
+        case kGroupForces:      updateGroupForces( m_params, _task.m_group );                           break;
+        case kFlockForces:      updateParticlesFlocking( m_params, m_particles[ _task.m_group ], m_particleMatrix[ _task.m_group ], m_flockForces[ _task.m_group ], _task.m_begin, _task.m_end ); break;
+        case kParticleChunks:   updateParticleChunk( m_params, _task.m_group, _task.m_begin, _task.m_end ); break;
+        case kFinalizeGroups:   finalizeGroup( _task.m_group );                                         break;
+        case kWriteGeometry:    writeGeometry( m_params, _task.m_group, _task.m_begin, _task.m_end );   break;
+        case kCheckpoint:       copyCheckpoint( *m_checkpointBuffer, _task.m_group, _task.m_begin, _task.m_end ); break;
+        case kIdle:                                                                                     break;
+    }
+}
+
+bool ParticleEmitter::isFlocking( const SimParams& _params )
+{
+    return _params.m_updateFlocking && ( _params.m_updateType & ( kFlocking | kFollowTheLead ) ) != 0;
+}
+
+// by id, which survives the compaction that moves particles around the group
+bool ParticleEmitter::inFlockSlice( const SimParams& _params, const Particle& _particle )
+{
+    int slice = static_cast< int >( _particle.id() % _params.m_flockSlices );
+    
+    return ( slice - _params.m_flockSlice + _params.m_flockSlices ) % _params.m_flockSlices < _params.m_flockSliceCount;
+}
+
+// fading in or out, barely moving or on a flat patch of the surface
+bool ParticleEmitter::isLowDetail( const SimParams& _params, const Particle& _particle )
+{
+    return _particle.m_alpha                    < _params.m_lodAlpha        ||
+           _particle.m_velocity.lengthSquared() < _params.m_lodSpeedSqrd    ||
+           _particle.m_contrast                 < _params.m_lodFlatness;
+}
+
+void ParticleEmitter::updateGroupForces( const SimParams& _params, size_t _group )
+{
+    // bulk emission, the new particles are integrated along with the rest
+    if ( _params.m_emitPerGroup > 0 )
+    {
+        emitParticles( _params, _group, _params.m_emitPerGroup );
+    }
+    
+    // the leader is steered before the flock follows it
+    if ( ( _params.m_updateType & kFollowTheLead ) != 0 ) updateParticlesFollowTheLead( _params, m_particles[ _group ] );
+}
+
+void ParticleEmitter::updateParticleChunk( const SimParams& _params, size_t _group, size_t _begin, size_t _end )
+{
+    auto& particles = m_particles[ _group ];
+    
+    // the gathered flocking forces; the leader takes none and is picked again next step
+    if ( isFlocking( _params ) )
+    {
+        auto& forces = m_flockForces[ _group ];
         
-        size_t groupIdx  = _threadNumber;
-        size_t numGroups = m_particles.size();
-        
-        // process all particles that are pertinent to this tread
-        while ( groupIdx < numGroups )
+        for ( size_t i = _begin; i < _end; ++i )
         {
-            auto& particles = m_particles[ groupIdx ];
-            auto& matrix    = m_particleMatrix[ groupIdx ];
-            updateParticles( m_currentTime, m_delta, particles, matrix );
-            
-            groupIdx      += THREADS;
+            if ( particles[ i ].m_flockLeader )
+            {
+                particles[ i ].m_flockLeader = false;
+            }
+            else if ( inFlockSlice( _params, particles[ i ] ) )
+            {
+                particles[ i ].applyForce( forces[ i ] );
+            }
         }
-        
-        // Thread done - lock to update the processing count
-        --m_processing;
-        m_conditionVar.notify_one();
     }
+    
+    // per particle forces, then timers, integration, geometry and compaction
+    // of the dead particles to the front of the chunk
+    if ( ( _params.m_updateType & kFunction      ) != 0 ) updateParticlesFunctions(     _params, particles, _begin, _end );
+    if ( ( _params.m_updateType & kOpticalFlow   ) != 0 ) updateParticlesOpticalFlow(   _params, particles, _begin, _end );
+    
+    size_t count = integrateParticles( _params, _group, _begin, _end, _begin );
+    m_particleSpans[ _group ][ _begin / PARTICLE_CHUNK ] = { _begin, count };
 }
 
-void ParticleEmitter::updateParticles( float _currentTime, float _delta, std::vector< Particle* >& _particles, spatial_matrix< Particle >& _part_mtx )
+void ParticleEmitter::finalizeGroup( size_t _group )
 {
-    updateParticleTiming( _currentTime, _delta, _particles );
+    // close the gaps between the chunks, then point the matrix at the final slots
+    compactParticles( _group );
+    m_simFrame->m_counts[ _group ] = m_particles[ _group ].size();
     
-    if ( ( m_updateType & kFunction      ) != 0 ) updateParticlesFunctions(     _currentTime, _delta, _particles );
-    if ( ( m_updateType & kFlocking      ) != 0 ) updateParticlesFlocking(      _currentTime, _delta, _particles, _part_mtx );
-    if ( ( m_updateType & kFollowTheLead ) != 0 ) updateParticlesFollowTheLead( _currentTime, _delta, _particles, _part_mtx );
-    if ( ( m_updateType & kOpticalFlow   ) != 0 ) updateParticlesOpticalFlow(   _currentTime, _delta, _particles );
+    auto& matrix = m_particleMatrix[ _group ];
+    matrix.clear();
     
-    
-    // TODO: to use this strategy a clear/insertion needs to be done on mode switch
-    //if ( ( m_updateType & ( kFlocking | kFollowTheLead ) ) != 0 )
+    for ( auto& particle : m_particles[ _group ] )
     {
-        // if we're flocking we need to update the matrix
-        _part_mtx.clear_apply( [&]( spatial_matrix< Particle >& mtx, Particle& p ){
-            p.update( _currentTime, _delta, m_sizeFactor );
-            if ( p.m_lifeTimeLeft > 0.0f ) {
-                mtx.insert( p, p.m_position );
-            }
-        } );
+        matrix.insert( particle, particle.m_position );
     }
-    /*
-    else
+}
+
+size_t ParticleEmitter::integrateParticles( const SimParams& _params, size_t _group, size_t _begin, size_t _end, size_t _destination )
+{
+    auto& particles = m_particles[ _group ];
+    auto& vertices  = m_simFrame->m_vertices[ _group ];
+    auto& colors    = m_simFrame->m_colors[ _group ];
+    
+    // survivors are written back in order starting at _destination, which
+    // is never past _begin
+    size_t alive     = _destination;
+    size_t effective = 0;
+    
+    for ( size_t i = _begin; i < _end; ++i )
     {
-        // for non flocking, the matrix is not updated
-        for ( auto p : _particles )
+        Particle& p = particles[ i ];
+        p.updateTimer( _params.m_delta );
+        
+        if ( p.m_lifeTimeLeft < 0.0f )
         {
-            p->update( _currentTime, _delta, m_sizeFactor );
+            continue;
         }
+        
+        // low detail particles catch up with the time they skipped, staggered
+        // by id so each step takes its share of them
+        p.m_lodDelta += _params.m_delta;
+        
+        if ( _params.m_lodInterval <= 1 || ( p.id() + _params.m_lodStep ) % _params.m_lodInterval == 0 || !isLowDetail( _params, p ) )
+        {
+            p.update( _params, p.m_lodDelta );
+            p.m_lodDelta = 0.0f;
+            ++effective;
+        }
+
+        if ( alive != i )
+        {
+            particles[ alive ] = p;
+        }
+        
+        if ( _params.m_writeGeometry )
+        {
+            particles[ alive ].writeGeometry( _params, &vertices[ alive * 4 ], &colors[ alive * 4 ] );
+        }
+        ++alive;
     }
-    */
     
-    for ( int i = 0; i < _particles.size(); ++i )
+    m_stepEffective += effective;
+    return alive - _destination;
+}
+
+void ParticleEmitter::writeGeometry( const SimParams& _params, size_t _group, size_t _begin, size_t _end )
+{
+    auto& particles = m_particles[ _group ];
+    auto& vertices  = m_simFrame->m_vertices[ _group ];
+    auto& colors    = m_simFrame->m_colors[ _group ];
+    
+    for ( size_t i = _begin; i < _end; ++i )
     {
-        Particle* p = _particles[ i ];
-        if ( p->m_lifeTimeLeft < 0.0f )
-        {
-            delete p;
-            _particles[ i ] = _particles[ _particles.size() - 1 ];
-            _particles.pop_back();
-            --i;
-        }
+        particles[ i ].writeGeometry( _params, &vertices[ i * 4 ], &colors[ i * 4 ] );
     }
 }
 
-void ParticleEmitter::updateParticleTiming( float _currentTime, float _delta, std::vector< Particle* >& _particles )
+void ParticleEmitter::compactParticles( size_t _group )
 {
-    for ( int i = 0; i < _particles.size(); ++i )
+    // concatenate the compacted chunks, preserving their order; the destination
+    // never passes the source, so a forward copy is safe. Spans that already
+    // sit back to back are left untouched.
+    auto&  particles = m_particles[ _group ];
+    auto&  vertices  = m_simFrame->m_vertices[ _group ];
+    auto&  colors    = m_simFrame->m_colors[ _group ];
+    size_t alive     = 0;
+    
+    for ( auto& span : m_particleSpans[ _group ] )
     {
-        Particle* p = _particles[ i ];
-        p->updateTimer( _delta );
+        if ( span.m_begin != alive )
+        {
+            std::copy( particles.begin() + span.m_begin,     particles.begin() + span.m_begin + span.m_count,           particles.begin() + alive );
+        }
+        
+        if ( span.m_begin != alive && m_params.m_writeGeometry )
+        {
+            std::copy( vertices.begin()  + span.m_begin * 4, vertices.begin()  + ( span.m_begin + span.m_count ) * 4,   vertices.begin()  + alive * 4 );
+            std::copy( colors.begin()    + span.m_begin * 4, colors.begin()    + ( span.m_begin + span.m_count ) * 4,   colors.begin()    + alive * 4 );
+        }
+        alive += span.m_count;
     }
+    
+    // shrinking never reallocates, and Particle has no default constructor to grow with
+    particles.erase( particles.begin() + alive, particles.end() );
 }
 
-void ParticleEmitter::updateParticlesFollowTheLead( float _currentTime, float _delta, std::vector< Particle* >& _particles, spatial_matrix< Particle >& _part_mtx )
+void ParticleEmitter::updateParticlesFollowTheLead( const SimParams& _params, std::vector< Particle >& _particles )
 {
+    if ( _particles.empty() )
+    {
+        return;
+    }
+    
     auto& p = _particles[ 0 ];
-    ofVec2f& particleVelocity( p->m_velocity );
-    ofVec2f& particlePosition( p->m_position );
+    ofVec2f& particleVelocity( p.m_velocity );
+    ofVec2f& particlePosition( p.m_position );
     
     // update the position and velocity of the first particle
     ofVec2f force( m_xMathFunc( particlePosition.y / 25 )  - 0.5, m_yMathFunc( particlePosition.x / 25 )  - 0.5 );
-    p->applyInstantForce( force * s_functionStrength );
+    p.applyInstantForce( force * _params.m_functionStrength );
     
     particleVelocity *= 1.0f + ( m_velocityAudioFunc( particlePosition.y ) * 5.0f );
-    p->m_flockLeader = true;
     
-    updateParticlesFlocking( _currentTime, _delta, _particles, _part_mtx );
-    
-    p->m_flockLeader = false;
+    // the flocking forces leave it out, so the others follow
+    p.m_flockLeader = isFlocking( _params );
 }
 
-void ParticleEmitter::updateParticlesFunctions( float _currentTime, float _delta, std::vector< Particle* >& _particles )
+void ParticleEmitter::updateParticlesFunctions( const SimParams& _params, std::vector< Particle >& _particles, size_t _begin, size_t _end )
 {
     // update the particles
-    for ( auto& p : _particles )
+    for ( size_t i = _begin; i < _end; ++i )
     {
-        ofVec2f& particleVelocity( p->m_velocity );
-        ofVec2f& particlePosition( p->m_position );
+        Particle& p = _particles[ i ];
+        ofVec2f& particleVelocity( p.m_velocity );
+        ofVec2f& particlePosition( p.m_position );
         
         // update the position and velocity of each particle
         ofVec2f force(
             m_xMathFunc( particlePosition.y / 25 )  - 0.5,
             m_yMathFunc( particlePosition.x / 25 )  - 0.5
         );
-        p->applyInstantForce( force  * s_functionStrength );
+        p.applyInstantForce( force  * _params.m_functionStrength );
         
         particleVelocity *= 1.0f + ( m_velocityAudioFunc( particlePosition.y ) * 5.0f );
     }
 }
 
-void ParticleEmitter::updateParticlesFlocking( float _currentTime, float _delta, std::vector< Particle* >& _particles, spatial_matrix< Particle >& _part_mtx )
+// Gather formulation: each particle sums what its neighbours do to it into
+// its own slot of _forces, reading positions and directions nobody writes
+// during this phase, and the forces are applied in the next one. Chunks can
+// run on any thread in any order with the same result, without atomics.
+void ParticleEmitter::updateParticlesFlocking( const SimParams& _params, std::vector< Particle >& _particles, spatial_matrix< Particle >& _part_mtx, std::vector< ofVec2f >& _forces, size_t _begin, size_t _end )
 {
-    // update the flocking routine
-    if ( !m_updateFlocking )
-    {
-        return;
-    }
+    const float zoneRadiusSqrd = _params.m_zoneRadiusSqrd;
+    const float lowThresh      = _params.m_lowThresh;
+    const float highThresh     = _params.m_highThresh;
+    const bool  repel          = _params.m_repelStrength   >= 0.0001f;
+    const bool  align          = _params.m_alignStrength   >= 0.0001f;
+    const bool  attract        = _params.m_attractStrength >= 0.0001f;
+    const int   maxNeighbours  = _params.m_maxNeighbours;
     
-    ofVec2f dir;
-    float updateRatio    = static_cast< float >( ( _currentTime - m_lastFlockUpdateTime ) / m_updateFlockEvery );
-    float zoneRadiusSqrd = s_zoneRadius * s_zoneRadius;
-    
-    for ( auto& p : _particles )
+    for ( size_t i = _begin; i < _end; ++i )
     {
+        Particle& p          = _particles[ i ];
+        ofVec2f   force( 0.0f, 0.0f );
+        int       neighbours = 0;
+        
+        // only this step's slice, the others keep their velocity untouched
+        if ( p.m_flockLeader || !inFlockSlice( _params, p ) )
+        {
+            _forces[ i ] = force;
+            continue;
+        }
+        
+        const float updateRatio = m_flockSliceRatios[ p.id() % _params.m_flockSlices ];
         
-        _part_mtx.apply_to_radius( [&]( spatial_matrix< Particle >& mtx, Particle& p1, Particle& p2 )
+        _part_mtx.apply_to_radius( [&]( spatial_matrix< Particle >& mtx, const Particle& p1, const Particle& p2 )
         {
-            dir = p1.m_position - p2.m_position;
+            // invisible particles are not followed by anybody
+            if ( &p1 == &p2 || p2.m_alpha == 0 )
+            {
+                return true;
+            }
+            
+            ofVec2f dir = p1.m_position - p2.m_position;
             float distSqrd = dir.lengthSquared();
             
             if ( distSqrd < zoneRadiusSqrd ) // Neighbor is in the zone
             {
-                float percent = distSqrd / ( s_zoneRadius * s_zoneRadius );
+                // bounded neighbourhood: stop the query once enough were seen
+                if ( maxNeighbours > 0 && ++neighbours > maxNeighbours )
+                {
+                    return false;
+                }
+                
+                // the zone is picked from the same bin as the force, so a bin
+                // across a threshold is one zone throughout
+                int   bin     = static_cast< int >( distSqrd / zoneRadiusSqrd * FLOCK_LUT_SIZE );
+                float percent = static_cast< float >( bin ) / FLOCK_LUT_SIZE;
+                float F       = m_flockForceLut[ bin ] * updateRatio;
                 
-                if( percent < s_lowThresh )            // Separation
+                if( percent < lowThresh )            // Separation
                 {
-                    if ( s_repelStrength < 0.0001f )
+                    if ( !repel )
                     {
-                        return;
+                        return true;
                     }
                     
-                    float F = s_lowThresh * s_repelStrength * updateRatio;
                     dir.normalize();
-                    dir *= F;
-                    
-                    if ( !p1.m_flockLeader ) p1.applyForce(  dir );
-                    if ( !p2.m_flockLeader ) p2.applyForce( -dir );
+                    force += dir * F;
                 }
-                else if( percent < s_highThresh ) // Alignment
+                else if( percent < highThresh ) // Alignment
                 {
-                    if ( s_alignStrength < 0.0001f )
+                    if ( !align )
                     {
-                        return;
+                        return true;
                     }
                     
-                    float threshDelta     = s_highThresh - s_lowThresh;
-                    float adjustedPercent = ( percent - s_lowThresh ) / threshDelta;
-                    float F               = ( 1.0f - ( cos( adjustedPercent * PI2 ) * -0.5f + 0.5f ) ) * s_alignStrength * updateRatio;
-                    
-                    if ( !p1.m_flockLeader ) p1.applyForce( p2.m_direction * F );
-                    if ( !p2.m_flockLeader ) p2.applyForce( p1.m_direction * F );
-                    
+                    force += p2.m_direction * F;
                 }
                 else                                 // Cohesion
                 {
-                    if ( s_attractStrength < 0.0001f )
+                    if ( !attract )
                     {
-                        return;
+                        return true;
                     }
                     
-                    float threshDelta     = 1.0f - s_highThresh;
-                    float adjustedPercent = ( percent - s_highThresh )/threshDelta;
-                    float F               = ( 1.0f - ( cos( adjustedPercent * PI2 ) * -0.5f + 0.5f ) ) * s_attractStrength * updateRatio;
-                    
                     dir.normalize();
-                    dir *= F;
-                    
-                    if ( !p1.m_flockLeader ) p1.applyForce( -dir );
-                    if ( !p2.m_flockLeader ) p2.applyForce(  dir );
+                    force -= dir * F;
                 }
             }
             
-        }, *p, p->m_position, s_zoneRadius );
+            return true;
+        }, p, p.m_position, _params.m_zoneRadius );
+        
+        // the scatter version met every pair from both ends and pushed both
+        // particles each time, twice the force the strengths were tuned with
+        _forces[ i ] = force * 2.0f;
     }
     
     
@@ -735,27 +1568,36 @@ void ParticleEmitter::updateParticlesFlocking( float _currentTime, float _delta,
     }*/
 }
 
-void ParticleEmitter::updateParticlesOpticalFlow( float _currentTime, float _delta, std::vector< Particle* >& _particles )
+void ParticleEmitter::updateParticlesOpticalFlow( const SimParams& _params, std::vector< Particle >& _particles, size_t _begin, size_t _end )
 {
-    ofVec2f ratio( m_opticalFlowPixels.getWidth()  / ( m_referenceSurface->getWidth()  * m_sizeFactor ),
-                   m_opticalFlowPixels.getHeight() / ( m_referenceSurface->getHeight() * m_sizeFactor ) );
+    // no video frame went through the flow yet
+    if ( !isOpticalFlowReady() )
+    {
+        return;
+    }
     
-    // update the particles
-    for ( auto& p : _particles )
+    ofVec2f ratio( m_flowField.getWidth()  / ( _params.m_referenceSurface->getWidth()  * _params.m_sizeFactor ),
+                   m_flowField.getHeight() / ( _params.m_referenceSurface->getHeight() * _params.m_sizeFactor ) );
+    
+    // the positions are gathered so the field is sampled a batch at a time
+    ofVec2f positions[ FLOW_SAMPLE_BATCH ];
+    ofVec2f forces[ FLOW_SAMPLE_BATCH ];
+    
+    for ( size_t batch = _begin; batch < _end; batch += FLOW_SAMPLE_BATCH )
     {
-        ofVec2f& particlePosition( p->m_position );
-        ofFloatColor c = m_opticalFlowPixels.getColor( particlePosition.x * ratio.x, particlePosition.y * ratio.y );
+        size_t count = std::min< size_t >( FLOW_SAMPLE_BATCH, _end - batch );
         
-        // update the position and velocity of each particle
-        //ofVec2f force( ( static_cast< float >( c.r ) / 255.0f ) * ( 1.0f - static_cast< float >( c.a ) / 255.0f ),
-        //               ( static_cast< float >( c.g ) / 255.0f ) * ( 1.0f - static_cast< float >( c.a ) / 255.0f ) );
-        float multiplier = ( ( c.a ) * 10.0f );
-        //multiplier *= multiplier;
-        //multiplier /= 10.0f;
-        ofVec2f force( ( c.r ) * multiplier,
-                       ( c.g ) * multiplier );
-        p->applyForce( force );
-        //particleVelocity = force;
+        for ( size_t i = 0; i < count; ++i )
+        {
+            positions[ i ] = _particles[ batch + i ].m_position;
+        }
+        
+        m_flowField.sample( positions, count, ratio, _params.m_currentTime, forces );
+        
+        for ( size_t i = 0; i < count; ++i )
+        {
+            _particles[ batch + i ].applyForce( forces[ i ] );
+        }
     }
 }
 
@@ -771,26 +1613,318 @@ void ParticleEmitter::continueThreads( void )
 
 void ParticleEmitter::killAll( void )
 {
-    std::unique_lock< std::mutex > cl( m_updateLock );
-    m_pause = true;
-    m_stop  = true;
-    m_conditionVar.notify_all();
-    cl.unlock();
+    // the workers are shared and stay, only this emitter's run has to end
+    waitThreadedUpdate();
+
+    m_particles.clear();
+    m_particleSpans.clear();
+    m_flockForces.clear();
+    m_particleMatrix.clear();
+    m_groupRandom.clear();
+    
+    for ( auto& frame : m_particleFrames )
+    {
+        frame.m_vertices.clear();
+        frame.m_colors.clear();
+        frame.m_counts.clear();
+    }
+    m_frameReady = false;
+}
+
+struct CheckpointFunction
+{
+    uint32_t    m_fn[ 2 ];
+    float       m_timer;
+    float       m_timeout;
+};
+
+struct CheckpointHeader
+{
+    char                m_magic[ 4 ];
+    uint32_t            m_version;
+    uint32_t            m_particleSize;
+    uint32_t            m_randomSize;
+    uint32_t            m_groups;
+    uint32_t            m_particlesPerGroup;    // the setting
+    uint32_t            m_trimmedTo;            // what a lower setting is compared against
+    uint32_t            m_flockSlices;          // slice ages, then the generators of the functions
+    int32_t             m_flockSlice;
+    int32_t             m_lodInterval;
+    int32_t             m_lodStep;
+    float               m_updateFlockTimer;
+    float               m_simulationDebt;
+    uint64_t            m_nextParticleId;
+    CheckpointFunction  m_functions[ 3 ];
+};
+
+// each group is its particle count and generator, then its particles
+struct CheckpointGroup
+{
+    uint64_t            m_count;
+    std::mt19937        m_random;
+};
+
+static_assert( std::is_trivially_copyable< Particle >::value,     "particles are checkpointed as they are in memory" );
+static_assert( std::is_trivially_copyable< std::mt19937 >::value, "generators are checkpointed as they are in memory" );
+
+static size_t checkpointSection( size_t _bytes )
+{
+    return ( _bytes + CHECKPOINT_ALIGNMENT - 1 ) / CHECKPOINT_ALIGNMENT * CHECKPOINT_ALIGNMENT;
+}
+
+static void* checkpointPut( std::vector< unsigned char >& _buffer, size_t& _offset, size_t _bytes )
+{
+    void* section = _buffer.data() + _offset;
+    _offset      += checkpointSection( _bytes );
+    return section;
+}
+
+// null when the section runs past the end, a truncated file
+static const void* checkpointGet( const unsigned char* _data, size_t _length, size_t& _offset, size_t _bytes )
+{
+    if ( _offset + _bytes > _length )
+    {
+        return nullptr;
+    }
     
-    for ( auto& thread : m_threads )
+    const void* section = _data + _offset;
+    _offset            += checkpointSection( _bytes );
+    return section;
+}
+
+static void saveFunction( CheckpointFunction& _state, std::mt19937& _random, const ParticleEmitter::FuncCtl& _function )
+{
+    _state.m_fn[ 0 ]    = static_cast< uint32_t >( _function.m_fn[ 0 ] );
+    _state.m_fn[ 1 ]    = static_cast< uint32_t >( _function.m_fn[ 1 ] );
+    _state.m_timer      = _function.m_funcTimer;
+    _state.m_timeout    = _function.m_funcTimeout;
+    _random             = _function.m_random;
+}
+
+static bool checkFunction( const CheckpointFunction& _state, size_t _functions )
+{
+    return _state.m_fn[ 0 ] < _functions && _state.m_fn[ 1 ] < _functions;
+}
+
+static void restoreFunction( const CheckpointFunction& _state, const std::mt19937& _random, ParticleEmitter::FuncCtl& _function )
+{
+    _function.m_fn[ 0 ]     = _state.m_fn[ 0 ];
+    _function.m_fn[ 1 ]     = _state.m_fn[ 1 ];
+    _function.m_funcTimer   = _state.m_timer;
+    _function.m_funcTimeout = _state.m_timeout;
+    _function.m_random      = _random;
+}
+
+// Snapshot of everything the simulation carries from one step to the next:
+// the particles of every group, the generators, the function controllers and
+// the timers. What is rebuilt every step, the matrices, spans and geometry,
+// is left out. The buffer keeps its storage from one snapshot to the next.
+// Sizes the snapshot for the particles as they are and fills in all of it but
+// the particles themselves, whose offsets are kept for copyCheckpoint
+void ParticleEmitter::layoutCheckpoint( std::vector< unsigned char >& _buffer )
+{
+    size_t bytes = checkpointSection( sizeof( CheckpointHeader ) ) +
+                   checkpointSection( m_flockSliceTimes.size() * sizeof( float ) ) +
+                   checkpointSection( 3 * sizeof( std::mt19937 ) );
+    
+    for ( auto& particles : m_particles )
     {
-        thread.join();
+        bytes += checkpointSection( sizeof( CheckpointGroup ) ) + checkpointSection( particles.size() * sizeof( Particle ) );
     }
-    m_threads.clear();
     
-    m_stop  = false;
-    m_pause = false;
+    _buffer.resize( bytes );
+    
+    size_t              offset = 0;
+    CheckpointHeader&   header = *static_cast< CheckpointHeader* >( checkpointPut( _buffer, offset, sizeof( CheckpointHeader ) ) );
+    
+    memcpy( header.m_magic, CHECKPOINT_MAGIC, 4 );
+    header.m_version            = CHECKPOINT_VERSION;
+    header.m_particleSize       = sizeof( Particle );
+    header.m_randomSize         = sizeof( std::mt19937 );
+    header.m_groups             = static_cast< uint32_t >( m_particles.size() );
+    header.m_particlesPerGroup  = static_cast< uint32_t >( m_params.m_particlesPerGroup );
+    header.m_trimmedTo          = static_cast< uint32_t >( m_particlesPerGroup );
+    header.m_flockSlices        = static_cast< uint32_t >( m_flockSliceTimes.size() );
+    header.m_flockSlice         = m_flockSlice;
+    header.m_lodInterval        = m_lodInterval;
+    header.m_lodStep            = m_lodStep;
+    header.m_updateFlockTimer   = m_updateFlockTimer;
+    header.m_simulationDebt     = m_simulationDebt;
+    header.m_nextParticleId     = Particle::nextId();
+    
+    // the clock starts over with the app, so the slices keep their age
+    float* ages = static_cast< float* >( checkpointPut( _buffer, offset, m_flockSliceTimes.size() * sizeof( float ) ) );
+    for ( size_t i = 0; i < m_flockSliceTimes.size(); ++i )
+    {
+        ages[ i ] = m_flockSliceTimes[ i ] < 0.0f ? -1.0f : m_currentTime - m_flockSliceTimes[ i ];
+    }
+    
+    std::mt19937* functionRandom = static_cast< std::mt19937* >( checkpointPut( _buffer, offset, 3 * sizeof( std::mt19937 ) ) );
+    saveFunction( header.m_functions[ 0 ], functionRandom[ 0 ], m_velocityAudioFunc );
+    saveFunction( header.m_functions[ 1 ], functionRandom[ 1 ], m_xMathFunc );
+    saveFunction( header.m_functions[ 2 ], functionRandom[ 2 ], m_yMathFunc );
+    
+    m_checkpointOffsets.resize( m_particles.size() );
     
-    for ( auto& particleGroup : m_particles )
+    for ( size_t groupIdx = 0; groupIdx < m_particles.size(); ++groupIdx )
     {
-        for ( auto particle : particleGroup ) {
-            delete particle;
+        auto&            particles = m_particles[ groupIdx ];
+        CheckpointGroup& group     = *static_cast< CheckpointGroup* >( checkpointPut( _buffer, offset, sizeof( CheckpointGroup ) ) );
+        
+        group.m_count  = particles.size();
+        group.m_random = m_groupRandom[ groupIdx ];
+        m_checkpointOffsets[ groupIdx ] = offset;
+        offset        += checkpointSection( particles.size() * sizeof( Particle ) );
+    }
+}
+
+void ParticleEmitter::copyCheckpoint( std::vector< unsigned char >& _buffer, size_t _group, size_t _begin, size_t _end )
+{
+    memcpy( _buffer.data() + m_checkpointOffsets[ _group ] + _begin * sizeof( Particle ), m_particles[ _group ].data() + _begin, ( _end - _begin ) * sizeof( Particle ) );
+}
+
+// Called by the worker ending a run, after its last step. The particles of a
+// requested snapshot are copied by the kCheckpoint tasks that follow.
+bool ParticleEmitter::beginCheckpoint( void )
+{
+    if ( m_checkpointBuffer == nullptr )
+    {
+        return false;
+    }
+    
+    // the buffer is the checkpoint's, it grows with the particles
+    ALLOCATION_SCOPE( kOther );
+    layoutCheckpoint( *m_checkpointBuffer );
+    m_phase = kCheckpoint;
+    return true;
+}
+
+// Takes the snapshot right away, on the calling thread; it supersedes any
+// requested one.
+void ParticleEmitter::writeCheckpoint( std::vector< unsigned char >& _buffer )
+{
+    // the particles are only whole between runs
+    waitThreadedUpdate();
+    
+    m_checkpointBuffer = nullptr;
+    m_checkpointTaken  = false;
+    
+    layoutCheckpoint( _buffer );
+    for ( size_t groupIdx = 0; groupIdx < m_particles.size(); ++groupIdx )
+    {
+        copyCheckpoint( _buffer, groupIdx, 0, m_particles[ groupIdx ].size() );
+    }
+}
+
+// The next run ends with the snapshot taken into _buffer by the workers, the
+// main thread only waits for the run as it does anyway. _buffer is left alone
+// until isCheckpointTaken says so.
+void ParticleEmitter::requestCheckpoint( std::vector< unsigned char >& _buffer )
+{
+    waitThreadedUpdate();
+    m_checkpointBuffer = &_buffer;
+}
+
+// True once for each requested snapshot, after the run that took it
+bool ParticleEmitter::isCheckpointTaken( void )
+{
+    waitThreadedUpdate();
+    
+    bool taken        = m_checkpointTaken;
+    m_checkpointTaken = false;
+    return taken;
+}
+
+// Replaces the simulation with a snapshot from writeCheckpoint, false and
+// untouched when it is not one of this build. The particle counts follow the
+// snapshot, within the limits of this session.
+bool ParticleEmitter::restoreCheckpoint( const unsigned char* _data, size_t _length )
+{
+    size_t                  offset = 0;
+    const CheckpointHeader* header = static_cast< const CheckpointHeader* >( checkpointGet( _data, _length, offset, sizeof( CheckpointHeader ) ) );
+    
+    if ( header == nullptr ||
+         memcmp( header->m_magic, CHECKPOINT_MAGIC, 4 ) != 0 ||
+         header->m_version      != CHECKPOINT_VERSION ||
+         header->m_particleSize != sizeof( Particle ) ||
+         header->m_randomSize   != sizeof( std::mt19937 ) ||
+         header->m_flockSlices  != m_flockSliceTimes.size() ||
+         header->m_groups       == 0 )
+    {
+        return false;
+    }
+    
+    const float*        ages           = static_cast< const float* >( checkpointGet( _data, _length, offset, header->m_flockSlices * sizeof( float ) ) );
+    const std::mt19937* functionRandom = static_cast< const std::mt19937* >( checkpointGet( _data, _length, offset, 3 * sizeof( std::mt19937 ) ) );
+    
+    // everything is checked before the current simulation goes
+    std::vector< const CheckpointGroup* > groups;
+    for ( uint32_t i = 0; i < header->m_groups; ++i )
+    {
+        const CheckpointGroup* group = static_cast< const CheckpointGroup* >( checkpointGet( _data, _length, offset, sizeof( CheckpointGroup ) ) );
+        
+        if ( group == nullptr || checkpointGet( _data, _length, offset, group->m_count * sizeof( Particle ) ) == nullptr )
+        {
+            break;
         }
+        groups.push_back( group );
     }
-    m_particles.clear();
+    
+    if ( ages == nullptr || functionRandom == nullptr || groups.size() != header->m_groups ||
+         !checkFunction( header->m_functions[ 0 ], m_audioFn.size() ) ||
+         !checkFunction( header->m_functions[ 1 ], m_mathFn.size()  ) ||
+         !checkFunction( header->m_functions[ 2 ], m_mathFn.size()  ) )
+    {
+        return false;
+    }
+    
+    killAll();
+    
+    s_particleGroups    = std::min< int >( header->m_groups,            s_particleGroups.getMax()    );
+    s_particlesPerGroup = std::min< int >( header->m_particlesPerGroup, s_particlesPerGroup.getMax() );
+    
+    m_currentTime = ofGetElapsedTimef();
+    updateParams( m_currentTime, 0.0f );
+    addGroups( m_params.m_particleGroups );
+    
+    for ( size_t groupIdx = 0; groupIdx < m_particles.size(); ++groupIdx )
+    {
+        // the particles follow their group, read in place from the mapping
+        const CheckpointGroup* group     = groups[ groupIdx ];
+        const Particle*        stored    = reinterpret_cast< const Particle* >( reinterpret_cast< const unsigned char* >( group ) + checkpointSection( sizeof( CheckpointGroup ) ) );
+        auto&                  particles = m_particles[ groupIdx ];
+        auto&                  matrix    = m_particleMatrix[ groupIdx ];
+        
+        reserveParticles( groupIdx );
+        particles.insert( particles.end(), stored, stored + std::min< size_t >( group->m_count, m_params.m_particlesPerGroup ) );
+        
+        for ( auto& particle : particles )
+        {
+            particle.m_owner = this;
+            matrix.insert( particle, particle.m_position );
+        }
+        
+        m_groupRandom[ groupIdx ] = group->m_random;
+    }
+    
+    restoreFunction( header->m_functions[ 0 ], functionRandom[ 0 ], m_velocityAudioFunc );
+    restoreFunction( header->m_functions[ 1 ], functionRandom[ 1 ], m_xMathFunc );
+    restoreFunction( header->m_functions[ 2 ], functionRandom[ 2 ], m_yMathFunc );
+    
+    for ( size_t i = 0; i < m_flockSliceTimes.size(); ++i )
+    {
+        m_flockSliceTimes[ i ] = ages[ i ] < 0.0f ? -1.0f : m_currentTime - ages[ i ];
+    }
+    
+    m_particleGroups    = m_params.m_particleGroups;
+    m_particlesPerGroup = std::min< int >( header->m_trimmedTo, m_params.m_particlesPerGroup );
+    m_flockSlice        = header->m_flockSlice % std::max< int >( m_params.m_flockSlices, 1 );
+    m_lodInterval       = header->m_lodInterval;
+    m_lodStep           = header->m_lodStep;
+    m_updateFlockTimer  = header->m_updateFlockTimer;
+    m_simulationDebt    = header->m_simulationDebt;
+    m_prewarmSteps      = 0;
+    Particle::setNextId( std::max< size_t >( Particle::nextId(), header->m_nextParticleId ) );
+    
+    return true;
 }
@@ -8,13 +8,24 @@
 #include <condition_variable>
 #include <atomic>
 #include <unordered_map>
+#include <memory>
+#include <random>
 
 #include "ofSpatialMatrix.h"
 #include "Particle.h"
+#include "AllocationTracker.h"
+#include "SimParams.h"
+#include "WorkStealingQueue.h"
+#include "FrameBarrier.h"
+#include "WorkerPool.h"
+#include "CpuOpticalFlow.h"
+#include "FlowField.h"
 #include "ofxFlowTools.h"
 #include "tools/ftToScalar.h"
 #include "ofMain.h"
 
+#define FLOCK_LUT_SIZE  1024
+
 using namespace flowTools;
 class ParticleEmitter
 {
@@ -33,6 +44,36 @@ public:
     
     typedef std::function< float ( float ) > PosFunc;
     
+    // a compacted run of live particles inside a group, produced by one chunk of the update
+    struct ParticleSpan {
+        size_t                      m_begin;
+        size_t                      m_count;
+    };
+    
+    // one unit of the threaded update, a whole group or a chunk of one
+    struct ParticleTask {
+        size_t                      m_group;
+        size_t                      m_begin;
+        size_t                      m_end;
+    };
+    
+    // geometry of one simulation step; the workers fill one while draw reads the other
+    struct ParticleFrame {
+        std::vector< std::vector< ofVec2f > >       m_vertices;     // 4 per particle, emitter local
+        std::vector< std::vector< ofFloatColor > >  m_colors;       // 4 per particle
+        std::vector< size_t >                       m_counts;       // particles per group
+    };
+    
+    enum UpdatePhase {
+        kGroupForces,       // emission and the leader, per group
+        kFlockForces,       // flocking gathered from the frozen particles, per chunk
+        kParticleChunks,    // flocking applied, per particle forces and integration, per chunk
+        kFinalizeGroups,    // compaction and matrix rebuild, per group
+        kWriteGeometry,     // interpolated quads after fixed steps, per chunk
+        kCheckpoint,        // particles copied into a requested snapshot, per chunk
+        kIdle               // between runs
+    };
+    
     struct FuncCtl {
         FuncCtl( std::vector< ParticleEmitter::PosFunc >& _fn );
         float operator()( float x );
@@ -44,6 +85,7 @@ public:
         
         float                       m_funcTimer;
         float                       m_funcTimeout;
+        std::mt19937                m_random;           // its own, so a checkpoint can carry it
         
         static ofParameter< float > s_minChangeTime;
         static ofParameter< float > s_maxChangeTime;
@@ -55,11 +97,22 @@ public:
     ParticleEmitter( ofPixels*& _surface );
     virtual ~ParticleEmitter( void );
     
+    static void setHighCapacity( bool _enabled );
+    
+    void setupOpticalFlow( void );
+    bool isOpticalFlowReady( void ) const;
     virtual void draw( void );
     void drawOpticalFlow( void );
     virtual void debugDraw( void );
     virtual void update( float _currentTime, float _delta );
-    virtual void updateVideo( bool _isNewFrame, ofVideoPlayer& _source, float _delta );
+    void         prewarm( int _steps );
+    bool         isPrewarming( void ) const;
+    size_t       effectiveParticles( void ) const;
+    void         writeCheckpoint( std::vector< unsigned char >& _buffer );
+    void         requestCheckpoint( std::vector< unsigned char >& _buffer );
+    bool         isCheckpointTaken( void );
+    bool         restoreCheckpoint( const unsigned char* _data, size_t _length );
+    virtual void updateVideo( bool _isNewFrame, ofTexture& _source, const std::shared_ptr< ofPixels >& _frame, float _delta );
     void         updateOpticalFlow( float _delta );
     
     void setInputArea( ofVec2f& _imageSize );
@@ -69,7 +122,9 @@ public:
     virtual void killAll( void );
     
     std::vector< spatial_matrix< Particle > > m_particleMatrix;
-    std::vector< std::vector< Particle* > > m_particles;
+    std::vector< std::vector< Particle > > m_particles;
+    std::vector< std::vector< ParticleSpan > > m_particleSpans;
+    std::vector< std::vector< ofVec2f > > m_flockForces;          // 1 per particle, gathered before being applied
     ofVec2f                     m_position;
     float                       m_maxLifeTime;
     float                       m_minLifeTime;
@@ -87,11 +142,24 @@ public:
     static ofParameter< float > s_attractStrength;
     static ofParameter< float > s_lowThresh;
     static ofParameter< float > s_highThresh;
+    static ofParameter< int >   s_maxNeighbours;   // 0 means no limit
+    static ofParameter< int >   s_flockSlices;     // round robin slices a flock update is spread over
     static ofParameterGroup     s_flockingParams;
+    
+    // Level of detail: faint, slow or flat colored particles are integrated
+    // less often, the interval widens while the budget is exceeded
+    static ofParameter< int >   s_lodInterval;      // least interval, 1 integrates every particle on every step until the budget widens it
+    static ofParameter< int >   s_lodBudget;        // full updates per step, 0 for no limit
+    static ofParameter< int >   s_lodAlpha;
+    static ofParameter< float > s_lodSpeed;
+    static ofParameter< float > s_lodFlatness;      // color difference around the particle
+    static ofParameterGroup     s_lodParams;
     bool                        m_updateFlocking;
     
     // image related
     ofPixels*&                  m_referenceSurface;
+    const TiledSurface*         m_tiledSurface;
+    const EmissionMap*          m_emissionMap;
     float                       m_sizeFactor;
     
     // Emitter stuff
@@ -100,13 +168,23 @@ public:
     static ofParameter< float > s_maxSpeed;
     
     static ofParameter< float > s_functionStrength;
+    static ofParameter< float > s_emissionImportance;   // 0 spawns uniformly, 1 only after the emission map
     
     static ofParameter< float > s_minParticleLife;
     static ofParameter< float > s_maxParticleLife;
     
     static ofParameter< int >   s_particlesPerGroup;
     static ofParameter< int >   s_particleGroups;
+    static ofParameter< bool >  s_bulkEmission;
+    static ofParameter< int >   s_prewarmSteps;
+    static ofParameter< bool >  s_fixedTimestep;
+    static ofParameter< int >   s_simulationRate;   // fixed steps per second
+    static ofParameter< int >   s_maxCatchUpSteps;  // fixed steps per frame at most, the rest is dropped
+    static ofParameter< int >   s_workerThreads;    // defaults to one per core but the main thread's
+    static ofParameter< bool >  s_pinWorkers;
+    static ofParameter< int >   s_reservedCores;    // first cores kept free of workers, for the main thread
     static ofParameter< bool >  s_debugDraw;
+    static ofParameter< bool >  s_cpuOpticalFlow;   // on the workers instead of the GPU, for headless nodes
     static ofParameterGroup     s_emitterParams;
     
     void waitThreadedUpdate( void );
@@ -115,35 +193,97 @@ public:
     ftOpticalFlow               m_opticalFlow;
     
 private:
-    void addParticles( int _group = -1 );
-    void startThreadedUpdate( void );
-    void threadProcessParticles( size_t _group );
-    
-    void updateParticles(               float _currentTime, float _delta, std::vector< Particle* >& _particles, spatial_matrix< Particle >& _part_mtx );
-    void updateParticleTiming(          float _currentTime, float _delta, std::vector< Particle* >& _particles );
-    void updateParticlesFollowTheLead(  float _currentTime, float _delta, std::vector< Particle* >& _particles, spatial_matrix< Particle >& _part_mtx );
-    void updateParticlesFunctions(      float _currentTime, float _delta, std::vector< Particle* >& _particles );
-    void updateParticlesFlocking(       float _currentTime, float _delta, std::vector< Particle* >& _particles, spatial_matrix< Particle >& _part_mtx );
-    void updateParticlesOpticalFlow(    float _currentTime, float _delta, std::vector< Particle* >& _particles );
-    
-    // Threading stuff
-    std::vector< std::thread >  m_threads;          // Thread pool
-    std::atomic_bool            m_stop;             // Stop
+    void addParticles( int _group = -1, int _maxParticles = 10 );
+    void addGroups( size_t _groups );
+    void emitParticles( const SimParams& _params, size_t _group, int _maxParticles );
+    void reserveParticles( int _group );
+    void scheduleSteps( float _currentTime, float _delta, bool _fixed );
+    void runSteps( void );
+    bool advancePhase( void );
+    void runNextPhase( void );
+    size_t pushTasks( UpdatePhase _phase );
+    void processTasks( size_t _worker );
+    void runTask( const ParticleTask& _task );
+    
+    void simulate( float _currentTime, float _delta );
+    bool prepareSimulation( float _currentTime, float _delta );
+    void advanceStep( float _currentTime, float _delta );
+    void updateParams( float _currentTime, float _delta );
+    void rebuildParticleMatrices( void );
+    void rebuildFlockForceLut( void );
+    void layoutCheckpoint( std::vector< unsigned char >& _buffer );
+    bool beginCheckpoint( void );
+    void copyCheckpoint( std::vector< unsigned char >& _buffer, size_t _group, size_t _begin, size_t _end );
+    
+    static bool isFlocking(             const SimParams& _params );
+    static bool inFlockSlice(           const SimParams& _params, const Particle& _particle );
+    static bool isLowDetail(            const SimParams& _params, const Particle& _particle );
+    void updateGroupForces(             const SimParams& _params, size_t _group );
+    void updateParticleChunk(           const SimParams& _params, size_t _group, size_t _begin, size_t _end );
+    void finalizeGroup(                 size_t _group );
+    size_t integrateParticles(          const SimParams& _params, size_t _group, size_t _begin, size_t _end, size_t _destination );
+    void writeGeometry(                 const SimParams& _params, size_t _group, size_t _begin, size_t _end );
+    void compactParticles(              size_t _group );
+    void updateParticlesFollowTheLead(  const SimParams& _params, std::vector< Particle >& _particles );
+    void updateParticlesFunctions(      const SimParams& _params, std::vector< Particle >& _particles, size_t _begin, size_t _end );
+    void updateParticlesFlocking(       const SimParams& _params, std::vector< Particle >& _particles, spatial_matrix< Particle >& _part_mtx, std::vector< ofVec2f >& _forces, size_t _begin, size_t _end );
+    void updateParticlesOpticalFlow(    const SimParams& _params, std::vector< Particle >& _particles, size_t _begin, size_t _end );
+    
+    // Threading stuff, the workers are shared by all emitters
     std::atomic_bool            m_pause;            // Make the threads to not do their work
-    std::atomic_size_t          m_processing;       // Number of threads processing
-    
-    std::mutex                  m_updateLock;       // Controls the thread sync
-    std::condition_variable     m_conditionVar;     // Thread control
-    
+    UpdatePhase                 m_phase;            // Phase being processed
+    int                         m_stepIndex;        // Steps of the run started so far
+    std::vector< std::unique_ptr< WorkStealingQueue< ParticleTask > > > m_taskQueues; // One per pool worker
+    WorkerPool::Job             m_job;              // Posted to the pool once per phase
+    FrameBarrier                m_pipeline;         // Started by update and joined at the next one
+
     // Time stuff
     float                       m_currentTime;
-    float                       m_delta;
     float                       m_currentDrawTime;
     float                       m_drawDelta;
     
     float                       m_updateFlockEvery;
     float                       m_updateFlockTimer;
-    float                       m_lastFlockUpdateTime;
+    int                         m_flockSlice;           // updated last
+    std::vector< float >        m_flockSliceTimes;      // when each slice was flocked, < 0 for never
+    std::vector< float >        m_flockSliceRatios;     // of the force, for the slices due this step
+    
+    // Steps of the next simulation run, set before the pipeline is released
+    int                         m_stepCount;
+    float                       m_stepTime;         // time of the first step
+    float                       m_stepDelta;
+    float                       m_simulationDebt;   // frame time not covered by fixed steps yet
+
+    // Batched particle drawing, the quad indices are shared by all groups.
+    // The frames are flipped, never copied, once the step writing one is done.
+    ParticleFrame               m_particleFrames[ 2 ];
+    ParticleFrame*              m_simFrame;         // Written by the workers
+    ParticleFrame*              m_drawFrame;        // Last finished step, read by draw
+    bool                        m_frameReady;       // m_simFrame holds a whole step
+    ofVbo                       m_particleVbo;
+    std::vector< ofIndexType >  m_particleIndices;
+    bool                        m_particleIndicesDirty;
+    
+    // Level of detail
+    int                         m_lodInterval;          // s_lodInterval, widened by the budget
+    int                         m_lodStep;
+    std::atomic_size_t          m_stepEffective;        // particles integrated in the step running
+    size_t                      m_lastStepEffective;
+    size_t                      m_runEffective;
+    size_t                      m_effectiveParticles;   // integrated by the last finished run
+    
+    // Emission, each group draws from its own generator so groups can emit in parallel
+    std::vector< std::mt19937 > m_groupRandom;
+    int                         m_prewarmSteps;
+    
+    // Snapshot requested for the end of the next run
+    std::vector< unsigned char >*   m_checkpointBuffer;     // null when none is
+    std::vector< size_t >           m_checkpointOffsets;    // of each group's particles in it
+    bool                            m_checkpointTaken;      // by the last run, not handed out yet
+    
+    // Per frame parameter snapshot read by the workers, and what is derived from it
+    SimParams                   m_params;
+    float                       m_flockForceLut[ FLOCK_LUT_SIZE + 1 ];
     
     // Counter stuff
     int                         m_particlesPerGroup;
@@ -162,12 +302,19 @@ private:
     int                         m_flowHeight;
     
     
-    ofFloatPixels               m_opticalFlowPixels;
+    ofFloatPixels               m_opticalFlowPixels;    // read back from the GPU
+    FlowField                   m_flowField;            // sampled by the workers
     
     ftDisplayScalar             m_scalarDisplay;
     ftVelocityField             m_velocityField;
     
     ftFbo                       m_ftBo;
+    
+    CpuOpticalFlow              m_cpuFlow;
+    float                       m_cpuFlowDelta;     // since the last frame it started on
+    size_t                      m_cpuFlowFrames;    // new video frames since then
+    bool                        m_cpuFlowFresh;     // done, not pushed to the field yet
+    bool                        m_gpuFlowFresh;     // read back, not pushed to the field yet
 };
 
 #endif //__PARTICLE_EMITTER_H__
@@ -0,0 +1,77 @@
+#if !defined __SIM_PARAMS_H__
+#define __SIM_PARAMS_H__
+
+#include "ofMain.h"
+
+class TiledSurface;
+class EmissionMap;
+
+// Plain copy of everything tweakable the simulation reads, taken once per
+// frame by ParticleEmitter::update on the main thread. Worker threads only
+// see this snapshot, so edits from the GUI land between frames, never in the
+// middle of one, and the hot loops read plain floats instead of going
+// through ofParameter.
+struct SimParams
+{
+    // frame
+    float   m_currentTime;
+    float   m_delta;
+    int     m_updateType;
+    float   m_sizeFactor;
+    ofVec2f m_position;             // of the emitter, moved by the output area
+    const ofPixels* m_referenceSurface;
+    const TiledSurface* m_tiledSurface;     // full resolution of the reference surface, if it has one
+    const EmissionMap*  m_emissionMap;      // where to spawn on it, null for uniform
+    bool    m_writeGeometry;        // integration writes the quads, off for fixed steps
+    float   m_interpolation;        // where the drawn frame sits between the last two steps
+
+    // flocking
+    bool    m_updateFlocking;       // a slice is due this step
+    int     m_flockSlices;
+    int     m_flockSlice;           // first one due
+    int     m_flockSliceCount;      // due from there on
+    float   m_zoneRadius;
+    float   m_zoneRadiusSqrd;
+    float   m_repelStrength;
+    float   m_alignStrength;
+    float   m_attractStrength;
+    float   m_lowThresh;
+    float   m_highThresh;
+    int     m_maxNeighbours;        // 0 visits every neighbour in the zone
+    
+    // level of detail
+    int     m_lodMinInterval;
+    int     m_lodInterval;          // low detail particles are integrated every this many steps
+    int     m_lodStep;
+    int     m_lodAlpha;
+    float   m_lodSpeedSqrd;
+    float   m_lodFlatness;
+    int     m_lodBudget;            // full updates per step, 0 for no limit
+
+    // particle
+    float   m_maxRadius;
+    float   m_particleSizeRatio;
+    float   m_particleSpeedRatio;
+    float   m_friction;
+    float   m_dampness;
+    float   m_colorRedirection;
+    
+    // emitter
+    float   m_minSpeed;
+    float   m_midSpeed;
+    float   m_maxSpeed;
+    float   m_functionStrength;
+    float   m_minParticleLife;
+    float   m_maxParticleLife;
+    float   m_emissionImportance;   // share of the particles spawned after the emission map
+    int     m_particlesPerGroup;
+    int     m_particleGroups;
+    int     m_emitPerGroup;         // emitted by each group's worker, 0 when the main thread trickles
+    
+    // audio
+    float   m_soundLow;
+    float   m_soundMid;
+    float   m_soundHigh;
+};
+
+#endif // __SIM_PARAMS_H__
@@ -0,0 +1,137 @@
+#include "SimulationCheckpoint.h"
+
+#include <cstdio>
+
+#if !defined( _WIN32 )
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+SimulationCheckpoint::SimulationCheckpoint( void ) :
+    m_pending( false ),
+    m_stop( false )
+{
+}
+
+SimulationCheckpoint::~SimulationCheckpoint( void )
+{
+    // the pending snapshot, if any, is written before stopping
+    if ( m_thread.joinable() )
+    {
+        {
+            std::lock_guard< std::mutex > lock( m_lock );
+            m_stop = true;
+            m_writeVar.notify_all();
+        }
+        
+        m_thread.join();
+    }
+}
+
+void SimulationCheckpoint::setFile( const std::string& _file )
+{
+    std::lock_guard< std::mutex > lock( m_lock );
+    m_file = _file;
+}
+
+std::vector< unsigned char >* SimulationCheckpoint::acquire( void )
+{
+    std::lock_guard< std::mutex > lock( m_lock );
+    
+    return m_pending || m_file.empty() ? nullptr : &m_buffer;
+}
+
+void SimulationCheckpoint::write( void )
+{
+    std::lock_guard< std::mutex > lock( m_lock );
+    
+    if ( !m_thread.joinable() )
+    {
+        m_thread = std::thread( &SimulationCheckpoint::threadWrite, this );
+    }
+    
+    m_pending = true;
+    m_writeVar.notify_all();
+}
+
+void SimulationCheckpoint::flush( void )
+{
+    std::unique_lock< std::mutex > lock( m_lock );
+    
+    m_writeVar.wait( lock, [ this ](){ return !m_pending; } );
+}
+
+std::shared_ptr< const unsigned char > SimulationCheckpoint::load( size_t& _length ) const
+{
+#if !defined( _WIN32 )
+    int file = open( m_file.c_str(), O_RDONLY );
+    
+    if ( file < 0 )
+    {
+        return nullptr;
+    }
+    
+    struct stat info;
+    size_t      length = fstat( file, &info ) == 0 ? static_cast< size_t >( info.st_size ) : 0;
+    
+    void* mapped = length > 0 ? mmap( nullptr, length, PROT_READ, MAP_PRIVATE, file, 0 ) : MAP_FAILED;
+    close( file );
+    
+    if ( mapped == MAP_FAILED )
+    {
+        return nullptr;
+    }
+    
+    _length = length;
+    return std::shared_ptr< const unsigned char >( static_cast< const unsigned char* >( mapped ), [ length ]( const unsigned char* _data )
+    {
+        munmap( const_cast< unsigned char* >( _data ), length );
+    } );
+#else
+    return nullptr;
+#endif
+}
+
+void SimulationCheckpoint::threadWrite( void )
+{
+    std::unique_lock< std::mutex > lock( m_lock );
+    
+    while ( true )
+    {
+        m_writeVar.wait( lock, [ this ](){ return m_pending || m_stop; } );
+        
+        if ( !m_pending )
+        {
+            return;
+        }
+        
+        // the main thread leaves the buffer alone while it is pending
+        std::string name = m_file;
+        lock.unlock();
+        
+        std::string temporary = name + ".tmp";
+        FILE*       file      = fopen( temporary.c_str(), "wb" );
+        
+        if ( file == nullptr )
+        {
+            ofLogWarning( "SimulationCheckpoint" ) << "could not write " << temporary;
+        }
+        else
+        {
+            bool written = fwrite( m_buffer.data(), 1, m_buffer.size(), file ) == m_buffer.size();
+            
+            written = fclose( file ) == 0 && written;
+            
+            if ( !written || std::rename( temporary.c_str(), name.c_str() ) != 0 )
+            {
+                std::remove( temporary.c_str() );
+            }
+        }
+        
+        lock.lock();
+        m_pending = false;
+        m_writeVar.notify_all();
+    }
+}
@@ -0,0 +1,56 @@
+//
+//  SimulationCheckpoint.h
+//  ofxFlockDraw
+//
+
+#if !defined __SIMULATION_CHECKPOINT_H__
+#define __SIMULATION_CHECKPOINT_H__
+
+#include "ofMain.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Carries the emitter snapshots to and from disk, the format itself is the
+// emitter's (see ParticleEmitter::writeCheckpoint). A snapshot is taken by
+// the emitter into the buffer kept here and written out on a thread of its
+// own, aside and renamed like the surface cache, so a crash mid write
+// leaves the previous one. The last one is mapped back at startup.
+class SimulationCheckpoint
+{
+public:
+    SimulationCheckpoint( void );
+    ~SimulationCheckpoint( void );
+    
+    void    setFile( const std::string& _file );
+    
+    // the buffer to take the next snapshot into, null while the last one is
+    // still being written
+    std::vector< unsigned char >*   acquire( void );
+    
+    // hands the buffer filled after acquire() to the writing thread
+    void    write( void );
+    
+    // waits until the pending snapshot, if any, is on disk
+    void    flush( void );
+    
+    // the last snapshot written, mapped; null when there is none
+    std::shared_ptr< const unsigned char > load( size_t& _length ) const;
+
+private:
+    void    threadWrite( void );
+    
+    std::string                     m_file;
+    std::vector< unsigned char >    m_buffer;
+    std::thread                     m_thread;
+    std::mutex                      m_lock;
+    std::condition_variable         m_writeVar;     // a snapshot is pending or stopping, or was written
+    bool                            m_pending;
+    bool                            m_stop;
+};
+
+#endif // __SIMULATION_CHECKPOINT_H__
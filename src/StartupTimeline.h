@@ -0,0 +1,48 @@
+//
+//  StartupTimeline.h
+//  ofxFlockDraw
+//
+
+#if !defined __STARTUP_TIMELINE_H__
+#define __STARTUP_TIMELINE_H__
+
+#include "ofMain.h"
+
+#include <string>
+
+// Logs the startup on the "Startup" channel, in milliseconds since launch:
+// how long each subsystem took to set up and when it was done, and when
+// the first frame was out. The subsystems set up on first use show up
+// whenever that happens, so a session that never needs them never logs
+// them either.
+class StartupTimeline
+{
+public:
+    // times its own lifetime
+    class Stage
+    {
+    public:
+        Stage( const std::string& _name ) :
+            m_name( _name ),
+            m_begin( ofGetElapsedTimeMillis() )
+        {
+        }
+
+        ~Stage( void )
+        {
+            uint64_t now = ofGetElapsedTimeMillis();
+            ofLogNotice( "Startup" ) << m_name << ": " << now - m_begin << " ms, done at " << now << " ms";
+        }
+
+    private:
+        std::string             m_name;
+        uint64_t                m_begin;
+    };
+
+    static void mark( const std::string& _name )
+    {
+        ofLogNotice( "Startup" ) << _name << " at " << ofGetElapsedTimeMillis() << " ms";
+    }
+};
+
+#endif // __STARTUP_TIMELINE_H__
@@ -0,0 +1,276 @@
+#include "SurfaceCache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <sstream>
+
+#if !defined( _WIN32 )
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#endif
+
+#define SURFACE_CACHE_MAGIC     "FDSC"
+#define SURFACE_CACHE_VERSION   1
+#define SURFACE_CACHE_ALIGNMENT 4096
+#define SURFACE_CACHE_MAX_BYTES ( static_cast< uint64_t >( 4 ) << 30 )     // on disk, tiles included
+
+SurfaceCache::SurfaceCache( void )
+{
+}
+
+void SurfaceCache::setup( const std::string& _directory )
+{
+    m_directory = _directory;
+    
+    if ( !m_directory.empty() && !ofDirectory::doesDirectoryExist( m_directory, false ) )
+    {
+        ofDirectory::createDirectory( m_directory, false, true );
+    }
+}
+
+std::shared_ptr< ofPixels > SurfaceCache::load( const std::string& _path, size_t _width, size_t _height )
+{
+#if !defined( _WIN32 )
+    std::string entryKey = key( _path, _width, _height );
+    
+    if ( entryKey.empty() )
+    {
+        return nullptr;
+    }
+    
+    int file = open( fileName( entryKey, ".surface" ).c_str(), O_RDONLY );
+    
+    if ( file < 0 )
+    {
+        return nullptr;
+    }
+    
+    struct stat info;
+    size_t      length = fstat( file, &info ) == 0 ? static_cast< size_t >( info.st_size ) : 0;
+    
+    // private and writable, so a stray write to the surface never reaches the file
+    void* mapped = length >= sizeof( Header ) ? mmap( nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0 ) : MAP_FAILED;
+    
+    // the modification time tells trim() when it was last used, the same for
+    // the tiles of the source
+    futimens( file, nullptr );
+    close( file );
+    utimensat( AT_FDCWD, tilesFileName( _path ).c_str(), nullptr, 0 );
+    
+    if ( mapped == MAP_FAILED )
+    {
+        return nullptr;
+    }
+    
+    // a hash collision, a half written file or a surface not fitted the way
+    // fit() does it now is a miss
+    const Header& header = *static_cast< const Header* >( mapped );
+    const char*   stored = static_cast< const char* >( mapped ) + sizeof( Header );
+    size_t        bytes  = static_cast< size_t >( header.m_width ) * header.m_height * header.m_channels;
+    size_t        width  = _width;
+    size_t        height = _height;
+    
+    if ( !fittedSize( header.m_sourceWidth, header.m_sourceHeight, width, height ) )
+    {
+        width  = header.m_sourceWidth;
+        height = header.m_sourceHeight;
+    }
+    
+    if ( memcmp( header.m_magic, SURFACE_CACHE_MAGIC, 4 ) != 0 ||
+         header.m_version != SURFACE_CACHE_VERSION ||
+         sizeof( Header ) + header.m_keyLength > length ||
+         entryKey.compare( 0, std::string::npos, stored, header.m_keyLength ) != 0 ||
+         header.m_width != width || header.m_height != height ||
+         header.m_dataOffset + bytes > length )
+    {
+        munmap( mapped, length );
+        return nullptr;
+    }
+    
+    // the pixels point into the mapping, which goes with them
+    unsigned char* data = static_cast< unsigned char* >( mapped ) + header.m_dataOffset;
+    
+    std::shared_ptr< ofPixels > pixels( new ofPixels(), [ mapped, length ]( ofPixels* _pixels )
+    {
+        delete _pixels;
+        munmap( mapped, length );
+    } );
+    pixels->setFromExternalPixels( data, header.m_width, header.m_height, header.m_channels );
+    
+    return pixels;
+#else
+    return nullptr;
+#endif
+}
+
+void SurfaceCache::store( const std::string& _path, size_t _width, size_t _height, const ofPixels& _pixels, size_t _sourceWidth, size_t _sourceHeight )
+{
+    std::string entryKey = key( _path, _width, _height );
+    
+    if ( entryKey.empty() )
+    {
+        return;
+    }
+    
+    Header header;
+    memcpy( header.m_magic, SURFACE_CACHE_MAGIC, 4 );
+    header.m_version        = SURFACE_CACHE_VERSION;
+    header.m_width          = static_cast< uint32_t >( _pixels.getWidth() );
+    header.m_height         = static_cast< uint32_t >( _pixels.getHeight() );
+    header.m_channels       = static_cast< uint32_t >( _pixels.getNumChannels() );
+    header.m_sourceWidth    = static_cast< uint32_t >( _sourceWidth );
+    header.m_sourceHeight   = static_cast< uint32_t >( _sourceHeight );
+    header.m_keyLength      = static_cast< uint32_t >( entryKey.size() );
+    header.m_dataOffset     = ( sizeof( Header ) + entryKey.size() + SURFACE_CACHE_ALIGNMENT - 1 ) / SURFACE_CACHE_ALIGNMENT * SURFACE_CACHE_ALIGNMENT;
+    
+    // written aside and renamed, so a reader never maps a partial entry
+    std::string name      = fileName( entryKey, ".surface" );
+    std::string temporary = name + ".tmp";
+    FILE*       file      = fopen( temporary.c_str(), "wb" );
+    
+    if ( file == nullptr )
+    {
+        ofLogWarning( "SurfaceCache" ) << "could not write " << temporary;
+        return;
+    }
+    
+    std::vector< char > padding( header.m_dataOffset - sizeof( Header ) - entryKey.size(), 0 );
+    size_t              bytes = _pixels.getTotalBytes();
+    
+    bool written = fwrite( &header, sizeof( Header ), 1, file ) == 1 &&
+                   fwrite( entryKey.data(), 1, entryKey.size(), file ) == entryKey.size() &&
+                   fwrite( padding.data(), 1, padding.size(), file ) == padding.size() &&
+                   fwrite( _pixels.getData(), 1, bytes, file ) == bytes;
+    
+    written = fclose( file ) == 0 && written;
+    
+    if ( !written || std::rename( temporary.c_str(), name.c_str() ) != 0 )
+    {
+        std::remove( temporary.c_str() );
+        return;
+    }
+    
+    trim( name, tilesFileName( _path ) );
+}
+
+void SurfaceCache::fit( ofPixels& _pixels, size_t _width, size_t _height )
+{
+    // openFrameworks has no bilinear resize, bicubic it is
+    if ( _pixels.isAllocated() && fittedSize( _pixels.getWidth(), _pixels.getHeight(), _width, _height ) )
+    {
+        _pixels.resize( _width, _height, OF_INTERPOLATE_BICUBIC );
+    }
+}
+
+bool SurfaceCache::fittedSize( size_t _sourceWidth, size_t _sourceHeight, size_t& _width, size_t& _height )
+{
+    if ( _width == 0 || _height == 0 || _sourceWidth == 0 || _sourceHeight == 0 )
+    {
+        return false;
+    }
+    
+    float scale = std::min( static_cast< float >( _width ) / _sourceWidth, static_cast< float >( _height ) / _sourceHeight );
+    
+    if ( scale >= 1.0f )
+    {
+        return false;
+    }
+    
+    _width  = std::max< size_t >( static_cast< size_t >( _sourceWidth  * scale ), 1 );
+    _height = std::max< size_t >( static_cast< size_t >( _sourceHeight * scale ), 1 );
+    return true;
+}
+
+std::string SurfaceCache::tilesFileName( const std::string& _path ) const
+{
+    std::string entryKey = key( _path, 0, 0 );
+    return entryKey.empty() ? entryKey : fileName( entryKey, ".tiles" );
+}
+
+std::string SurfaceCache::key( const std::string& _path, size_t _width, size_t _height ) const
+{
+#if !defined( _WIN32 )
+    struct stat info;
+    
+    if ( m_directory.empty() || stat( _path.c_str(), &info ) != 0 )
+    {
+        return std::string();
+    }
+    
+    std::ostringstream stream;
+    stream << _path << '|' << static_cast< int64_t >( info.st_mtime ) << '|' << info.st_size << '|' << _width << 'x' << _height;
+    return stream.str();
+#else
+    return std::string();
+#endif
+}
+
+std::string SurfaceCache::fileName( const std::string& _key, const char* _extension ) const
+{
+    std::ostringstream stream;
+    stream << m_directory << '/' << std::hex << std::hash< std::string >()( _key ) << _extension;
+    return stream.str();
+}
+
+// Drops the least recently used files until the directory fits in
+// SURFACE_CACHE_MAX_BYTES again; the entry just written and its tiles stay,
+// whatever their size. A tile file dropped while open stays readable until
+// closed. Only the loader thread writes here, so a temporary is a crash's
+// leftover.
+void SurfaceCache::trim( const std::string& _surface, const std::string& _tiles )
+{
+#if !defined( _WIN32 )
+    struct CacheFile
+    {
+        std::string m_name;
+        time_t      m_used;
+        uint64_t    m_bytes;
+    };
+    
+    DIR* directory = opendir( m_directory.c_str() );
+    
+    if ( directory == nullptr )
+    {
+        return;
+    }
+    
+    std::vector< CacheFile >    files;
+    uint64_t                    total = 0;
+    
+    while ( dirent* item = readdir( directory ) )
+    {
+        std::string name = m_directory + '/' + item->d_name;
+        struct stat info;
+        
+        if ( item->d_name[ 0 ] == '.' || stat( name.c_str(), &info ) != 0 || !S_ISREG( info.st_mode ) )
+        {
+            continue;
+        }
+        
+        if ( name.size() > 4 && name.compare( name.size() - 4, 4, ".tmp" ) == 0 )
+        {
+            std::remove( name.c_str() );
+            continue;
+        }
+        
+        files.push_back( { name, info.st_mtime, static_cast< uint64_t >( info.st_size ) } );
+        total += info.st_size;
+    }
+    closedir( directory );
+    
+    std::sort( files.begin(), files.end(), []( const CacheFile& _a, const CacheFile& _b ){ return _a.m_used < _b.m_used; } );
+    
+    for ( size_t i = 0; i < files.size() && total > SURFACE_CACHE_MAX_BYTES; ++i )
+    {
+        if ( files[ i ].m_name != _surface && files[ i ].m_name != _tiles && std::remove( files[ i ].m_name.c_str() ) == 0 )
+        {
+            total -= files[ i ].m_bytes;
+        }
+    }
+#endif
+}
@@ -0,0 +1,67 @@
+//
+//  SurfaceCache.h
+//  ofxFlockDraw
+//
+
+#if !defined __SURFACE_CACHE_H__
+#define __SURFACE_CACHE_H__
+
+#include "ofMain.h"
+
+#include <string>
+#include <memory>
+#include <cstdint>
+
+// On disk cache of reference surfaces already fitted to the window, so a
+// revisited image costs an mmap and the page faults of what is sampled
+// instead of a full decode. Entries are keyed by path, modification time
+// and target size; one file each, a small header followed by the raw
+// pixels at a page aligned offset, mapped straight into an ofPixels.
+// The least recently used files go once the directory outgrows its cap.
+// Only used from the loader thread, besides setup.
+class SurfaceCache
+{
+public:
+    SurfaceCache( void );
+    
+    // an empty directory disables the cache
+    void    setup( const std::string& _directory );
+    
+    // the mapped surface, or null on a miss
+    std::shared_ptr< ofPixels > load( const std::string& _path, size_t _width, size_t _height );
+    void    store( const std::string& _path, size_t _width, size_t _height, const ofPixels& _pixels, size_t _sourceWidth, size_t _sourceHeight );
+    
+    // where the full resolution tiles of _path go, see TiledSurface; empty
+    // when the cache is off
+    std::string tilesFileName( const std::string& _path ) const;
+    
+    // shrinks the surface to fit in _width x _height, keeping its aspect
+    static void fit( ofPixels& _pixels, size_t _width, size_t _height );
+    
+    // the size fit() shrinks a _sourceWidth x _sourceHeight surface to,
+    // false when it is left as it is
+    static bool fittedSize( size_t _sourceWidth, size_t _sourceHeight, size_t& _width, size_t& _height );
+
+private:
+    struct Header
+    {
+        char        m_magic[ 4 ];
+        uint32_t    m_version;
+        uint32_t    m_width;
+        uint32_t    m_height;
+        uint32_t    m_channels;
+        uint32_t    m_sourceWidth;          // of the decoded image
+        uint32_t    m_sourceHeight;
+        uint32_t    m_keyLength;            // the key follows the header
+        uint64_t    m_dataOffset;
+    };
+    
+    // empty when the source file is gone
+    std::string key( const std::string& _path, size_t _width, size_t _height ) const;
+    std::string fileName( const std::string& _key, const char* _extension ) const;
+    void        trim( const std::string& _surface, const std::string& _tiles );
+    
+    std::string                 m_directory;
+};
+
+#endif // __SURFACE_CACHE_H__
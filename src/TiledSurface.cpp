@@ -0,0 +1,518 @@
+#include "TiledSurface.h"
+#include "SurfaceCache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#if !defined( _WIN32 )
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define TILED_SURFACE_MAGIC     "FDTS"
+#define TILED_SURFACE_VERSION   1
+#define TILED_SURFACE_ALIGNMENT 4096
+#define TILE_SIZE               256
+#define TILE_BUDGET_BYTES       ( 256 << 20 )
+#define TILE_HOTSPOT_SHARE      4       // a hotspot gets at least this share of the busiest tile's samples
+#define TILE_HIT_STRIDE         16      // samples per counted hit, per thread, which keeps the workers off each other's cache lines
+
+// samples taken by this thread, across surfaces
+static thread_local uint32_t t_tileSamples = 0;
+
+TiledSurface::TiledSurface( void ) :
+    m_file( -1 ),
+    m_width( 0 ),
+    m_height( 0 ),
+    m_channels( 0 ),
+    m_tileSize( 0 ),
+    m_tileBytes( 0 ),
+    m_tilesX( 0 ),
+    m_tilesY( 0 ),
+    m_dataOffset( 0 ),
+    m_scaleX( 1.0f ),
+    m_scaleY( 1.0f ),
+    m_capacity( 0 ),
+    m_reading( 0 ),
+    m_stop( false )
+{
+}
+
+TiledSurface::~TiledSurface( void )
+{
+    close();
+}
+
+bool TiledSurface::write( const std::string& _file, const ofPixels& _pixels )
+{
+    Header header;
+    memcpy( header.m_magic, TILED_SURFACE_MAGIC, 4 );
+    header.m_version    = TILED_SURFACE_VERSION;
+    header.m_width      = static_cast< uint32_t >( _pixels.getWidth() );
+    header.m_height     = static_cast< uint32_t >( _pixels.getHeight() );
+    header.m_channels   = static_cast< uint32_t >( _pixels.getNumChannels() );
+    header.m_tileSize   = TILE_SIZE;
+    header.m_dataOffset = TILED_SURFACE_ALIGNMENT;
+    
+    std::string temporary = _file + ".tmp";
+    FILE*       file      = fopen( temporary.c_str(), "wb" );
+    
+    if ( file == nullptr )
+    {
+        ofLogWarning( "TiledSurface" ) << "could not write " << temporary;
+        return false;
+    }
+    
+    // the tiles on the right and bottom edges are padded to full size, so
+    // every tile sits at index * tile bytes
+    size_t                          rowBytes = TILE_SIZE * header.m_channels;
+    std::vector< char >             padding( header.m_dataOffset - sizeof( Header ), 0 );
+    std::vector< unsigned char >    tile( rowBytes * TILE_SIZE );
+    
+    bool written = fwrite( &header, sizeof( Header ), 1, file ) == 1 &&
+                   fwrite( padding.data(), 1, padding.size(), file ) == padding.size();
+    
+    for ( size_t tileY = 0; written && tileY < header.m_height; tileY += TILE_SIZE )
+    {
+        for ( size_t tileX = 0; written && tileX < header.m_width; tileX += TILE_SIZE )
+        {
+            size_t columns = std::min< size_t >( TILE_SIZE, header.m_width  - tileX );
+            size_t rows    = std::min< size_t >( TILE_SIZE, header.m_height - tileY );
+            
+            std::fill( tile.begin(), tile.end(), 0 );
+            for ( size_t row = 0; row < rows; ++row )
+            {
+                const unsigned char* source = _pixels.getData() + ( ( tileY + row ) * header.m_width + tileX ) * header.m_channels;
+                memcpy( tile.data() + row * rowBytes, source, columns * header.m_channels );
+            }
+            
+            written = fwrite( tile.data(), 1, tile.size(), file ) == tile.size();
+        }
+    }
+    
+    written = fclose( file ) == 0 && written;
+    
+    if ( !written || std::rename( temporary.c_str(), _file.c_str() ) != 0 )
+    {
+        std::remove( temporary.c_str() );
+        return false;
+    }
+    
+    return true;
+}
+
+// the header of an open tile file, false unless it is one and complete
+bool TiledSurface::readHeader( int _file, Header& _header )
+{
+#if !defined( _WIN32 )
+    struct stat info;
+    
+    if ( pread( _file, &_header, sizeof( Header ), 0 ) != static_cast< ssize_t >( sizeof( Header ) ) ||
+         fstat( _file, &info ) != 0 ||
+         memcmp( _header.m_magic, TILED_SURFACE_MAGIC, 4 ) != 0 ||
+         _header.m_version != TILED_SURFACE_VERSION ||
+         _header.m_width == 0 || _header.m_height == 0 || _header.m_channels == 0 || _header.m_tileSize == 0 )
+    {
+        return false;
+    }
+    
+    uint64_t tiles = static_cast< uint64_t >( ( _header.m_width  + _header.m_tileSize - 1 ) / _header.m_tileSize ) *
+                     ( ( _header.m_height + _header.m_tileSize - 1 ) / _header.m_tileSize );
+    
+    return _header.m_dataOffset + tiles * _header.m_tileSize * _header.m_tileSize * _header.m_channels <= static_cast< uint64_t >( info.st_size );
+#else
+    return false;
+#endif
+}
+
+bool TiledSurface::readOverview( ofPixels& _pixels, const std::string& _file, size_t _width, size_t _height, size_t& _sourceWidth, size_t& _sourceHeight )
+{
+#if !defined( _WIN32 )
+    int    file = ::open( _file.c_str(), O_RDONLY );
+    Header header;
+    
+    if ( file < 0 )
+    {
+        return false;
+    }
+    
+    if ( !readHeader( file, header ) )
+    {
+        ::close( file );
+        return false;
+    }
+    
+    _sourceWidth  = header.m_width;
+    _sourceHeight = header.m_height;
+    
+    size_t width    = _width;
+    size_t height   = _height;
+    size_t channels = header.m_channels;
+    size_t tileSize = header.m_tileSize;
+    size_t tilesX   = ( header.m_width + tileSize - 1 ) / tileSize;
+    
+    if ( !SurfaceCache::fittedSize( _sourceWidth, _sourceHeight, width, height ) )
+    {
+        width  = _sourceWidth;
+        height = _sourceHeight;
+    }
+    
+    // every source pixel is summed into the overview pixel it falls in
+    std::vector< size_t >           toColumn( _sourceWidth );
+    std::vector< uint32_t >         sums( width * height * channels, 0 );
+    std::vector< uint32_t >         counts( width * height, 0 );
+    std::vector< unsigned char >    tile( tileSize * tileSize * channels );
+    bool                            read = true;
+    
+    for ( size_t x = 0; x < _sourceWidth; ++x )
+    {
+        toColumn[ x ] = x * width / _sourceWidth;
+    }
+    
+    for ( size_t tileY = 0; read && tileY * tileSize < _sourceHeight; ++tileY )
+    {
+        for ( size_t tileX = 0; read && tileX * tileSize < _sourceWidth; ++tileX )
+        {
+            read = pread( file, tile.data(), tile.size(), header.m_dataOffset + ( tileY * tilesX + tileX ) * tile.size() ) == static_cast< ssize_t >( tile.size() );
+            
+            size_t rows    = std::min( tileSize, _sourceHeight - tileY * tileSize );
+            size_t columns = std::min( tileSize, _sourceWidth  - tileX * tileSize );
+            
+            for ( size_t row = 0; read && row < rows; ++row )
+            {
+                size_t               y      = ( tileY * tileSize + row ) * height / _sourceHeight;
+                const unsigned char* source = tile.data() + row * tileSize * channels;
+                
+                for ( size_t column = 0; column < columns; ++column, source += channels )
+                {
+                    size_t    target = y * width + toColumn[ tileX * tileSize + column ];
+                    uint32_t* sum    = sums.data() + target * channels;
+                    
+                    for ( size_t c = 0; c < channels; ++c )
+                    {
+                        sum[ c ] += source[ c ];
+                    }
+                    ++counts[ target ];
+                }
+            }
+        }
+    }
+    ::close( file );
+    
+    if ( !read )
+    {
+        ofLogWarning( "TiledSurface" ) << "could not read " << _file;
+        return false;
+    }
+    
+    _pixels.allocate( width, height, channels );
+    
+    unsigned char* data = _pixels.getData();
+    for ( size_t i = 0; i < counts.size(); ++i )
+    {
+        for ( size_t c = 0; c < channels; ++c )
+        {
+            data[ i * channels + c ] = static_cast< unsigned char >( sums[ i * channels + c ] / std::max< uint32_t >( counts[ i ], 1 ) );
+        }
+    }
+    
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool TiledSurface::open( const std::string& _file, std::shared_ptr< ofPixels > _overview )
+{
+#if !defined( _WIN32 )
+    if ( !_overview || !_overview->isAllocated() )
+    {
+        return false;
+    }
+    
+    m_file = ::open( _file.c_str(), O_RDONLY );
+    
+    if ( m_file < 0 )
+    {
+        return false;
+    }
+    
+    Header header;
+    
+    if ( !readHeader( m_file, header ) )
+    {
+        ::close( m_file );
+        m_file = -1;
+        return false;
+    }
+    
+    m_width      = header.m_width;
+    m_height     = header.m_height;
+    m_channels   = header.m_channels;
+    m_tileSize   = header.m_tileSize;
+    m_tileBytes  = m_tileSize * m_tileSize * m_channels;
+    m_tilesX     = ( m_width  + m_tileSize - 1 ) / m_tileSize;
+    m_tilesY     = ( m_height + m_tileSize - 1 ) / m_tileSize;
+    m_dataOffset = header.m_dataOffset;
+    
+    m_overview = _overview;
+    m_scaleX   = static_cast< float >( m_width )  / m_overview->getWidth();
+    m_scaleY   = static_cast< float >( m_height ) / m_overview->getHeight();
+    
+    size_t tiles = m_tilesX * m_tilesY;
+    m_tiles.reset( new std::atomic< const unsigned char* >[ tiles ] );
+    m_hits.reset( new std::atomic< uint32_t >[ tiles ] );
+    for ( size_t i = 0; i < tiles; ++i )
+    {
+        m_tiles[ i ].store( nullptr );
+        m_hits[ i ].store( 0 );
+    }
+    
+    m_buffers.resize( tiles );
+    m_states.assign( tiles, kAbsent );
+    m_lastUse.assign( tiles, 0 );
+    m_frameHits.assign( tiles, 0 );
+    m_capacity = std::max< size_t >( TILE_BUDGET_BYTES / m_tileBytes, 1 );
+    
+    m_thread = std::thread( &TiledSurface::threadRead, this );
+    return true;
+#else
+    return false;
+#endif
+}
+
+void TiledSurface::close( void )
+{
+    if ( m_thread.joinable() )
+    {
+        {
+            std::lock_guard< std::mutex > lock( m_lock );
+            m_stop = true;
+            m_queueVar.notify_all();
+        }
+        
+        m_thread.join();
+    }
+
+#if !defined( _WIN32 )
+    if ( m_file >= 0 )
+    {
+        ::close( m_file );
+        m_file = -1;
+    }
+#endif
+}
+
+size_t TiledSurface::getWidth( void ) const
+{
+    return m_width;
+}
+
+size_t TiledSurface::getHeight( void ) const
+{
+    return m_height;
+}
+
+size_t TiledSurface::residentBytes( void ) const
+{
+    return m_resident.size() * m_tileBytes;
+}
+
+ofColor TiledSurface::sample( float _u, float _v ) const
+{
+    size_t x    = std::min< size_t >( static_cast< size_t >( std::max( _u * m_scaleX, 0.0f ) ), m_width  - 1 );
+    size_t y    = std::min< size_t >( static_cast< size_t >( std::max( _v * m_scaleY, 0.0f ) ), m_height - 1 );
+    size_t tile = ( y / m_tileSize ) * m_tilesX + x / m_tileSize;
+    
+    // the hotspots only need the proportions, so a thread counts one sample
+    // in TILE_HIT_STRIDE of its own; a tile sampled more rarely than that
+    // still comes up every few frames
+    if ( ++t_tileSamples % TILE_HIT_STRIDE == 0 )
+    {
+        m_hits[ tile ].fetch_add( 1, std::memory_order_relaxed );
+    }
+    
+    const unsigned char* data = m_tiles[ tile ].load( std::memory_order_acquire );
+    const unsigned char* px;
+    size_t               channels;
+    
+    if ( data )
+    {
+        channels = m_channels;
+        px       = data + ( ( y % m_tileSize ) * m_tileSize + x % m_tileSize ) * channels;
+    }
+    else
+    {
+        size_t width  = m_overview->getWidth();
+        size_t height = m_overview->getHeight();
+        size_t u      = std::min< size_t >( static_cast< size_t >( std::max( _u, 0.0f ) ), width  - 1 );
+        size_t v      = std::min< size_t >( static_cast< size_t >( std::max( _v, 0.0f ) ), height - 1 );
+        
+        channels = m_overview->getNumChannels();
+        px       = m_overview->getData() + ( v * width + u ) * channels;
+    }
+    
+    return channels >= 3 ? ofColor( px[ 0 ], px[ 1 ], px[ 2 ] ) : ofColor( px[ 0 ], px[ 0 ], px[ 0 ] );
+}
+
+void TiledSurface::update( uint64_t _frame )
+{
+    // the run that could still see these was joined during the last frame
+    m_retired.erase( std::remove_if( m_retired.begin(), m_retired.end(),
+        [ & ]( const RetiredTile& _retired ){ return _retired.first < _frame; } ), m_retired.end() );
+    
+    {
+        std::lock_guard< std::mutex > lock( m_lock );
+        m_delivered.swap( m_loaded );
+        
+        // the queue is rebuilt from what was sampled since the last frame
+        for ( size_t tile : m_queue )
+        {
+            m_states[ tile ] = kAbsent;
+        }
+        m_reading -= m_queue.size();
+        m_queue.clear();
+    }
+    
+    for ( auto& tile : m_delivered )
+    {
+        --m_reading;
+        
+        if ( !tile.second )
+        {
+            ofLogWarning( "TiledSurface" ) << "could not read tile " << tile.first;
+            m_states[ tile.first ] = kAbsent;
+            continue;
+        }
+        
+        m_tiles[ tile.first ].store( tile.second.get(), std::memory_order_release );
+        m_buffers[ tile.first ] = std::move( tile.second );
+        m_states[ tile.first ]  = kResident;
+        m_lastUse[ tile.first ] = _frame;
+        m_resident.push_back( tile.first );
+    }
+    m_delivered.clear();
+    
+    // sampled tiles first, the busiest ahead, then the neighbours of the
+    // hotspots; a wanted tile is marked queued right away, so it is only
+    // listed once
+    std::vector< uint32_t >& hits    = m_frameHits;
+    uint32_t                 busiest = 0;
+    m_wanted.clear();
+    
+    for ( size_t tile = 0; tile < hits.size(); ++tile )
+    {
+        hits[ tile ] = m_hits[ tile ].exchange( 0, std::memory_order_relaxed );
+        
+        if ( hits[ tile ] > 0 )
+        {
+            m_lastUse[ tile ] = _frame;
+            busiest           = std::max( busiest, hits[ tile ] );
+            
+            if ( m_states[ tile ] == kAbsent )
+            {
+                m_states[ tile ] = kQueued;
+                m_wanted.push_back( tile );
+            }
+        }
+    }
+    
+    std::sort( m_wanted.begin(), m_wanted.end(), [ & ]( size_t _a, size_t _b ){ return hits[ _a ] > hits[ _b ]; } );
+    
+    for ( size_t tile = 0; tile < hits.size(); ++tile )
+    {
+        if ( hits[ tile ] == 0 || hits[ tile ] * TILE_HOTSPOT_SHARE < busiest )
+        {
+            continue;
+        }
+        
+        size_t tileX = tile % m_tilesX;
+        size_t tileY = tile / m_tilesX;
+        
+        for ( size_t y = tileY > 0 ? tileY - 1 : 0; y <= std::min( tileY + 1, m_tilesY - 1 ); ++y )
+        {
+            for ( size_t x = tileX > 0 ? tileX - 1 : 0; x <= std::min( tileX + 1, m_tilesX - 1 ); ++x )
+            {
+                size_t neighbour = y * m_tilesX + x;
+                
+                if ( m_states[ neighbour ] == kAbsent )
+                {
+                    m_states[ neighbour ] = kQueued;
+                    m_wanted.push_back( neighbour );
+                }
+            }
+        }
+    }
+    
+    // make room by dropping the tiles sampled longest ago, never one sampled
+    // since the last frame
+    size_t needed = m_resident.size() + m_reading + m_wanted.size();
+    
+    if ( needed > m_capacity )
+    {
+        std::sort( m_resident.begin(), m_resident.end(), [ & ]( size_t _a, size_t _b ){ return m_lastUse[ _a ] < m_lastUse[ _b ]; } );
+        
+        size_t evicted = 0;
+        while ( evicted < m_resident.size() && needed > m_capacity && m_lastUse[ m_resident[ evicted ] ] < _frame )
+        {
+            size_t tile = m_resident[ evicted++ ];
+            
+            m_tiles[ tile ].store( nullptr, std::memory_order_release );
+            m_retired.push_back( RetiredTile( _frame, std::move( m_buffers[ tile ] ) ) );
+            m_states[ tile ] = kAbsent;
+            --needed;
+        }
+        m_resident.erase( m_resident.begin(), m_resident.begin() + evicted );
+    }
+    
+    // what does not fit waits for a later frame
+    size_t room = m_capacity - std::min( m_capacity, m_resident.size() + m_reading );
+    
+    for ( size_t i = room; i < m_wanted.size(); ++i )
+    {
+        m_states[ m_wanted[ i ] ] = kAbsent;
+    }
+    m_wanted.resize( std::min( m_wanted.size(), room ) );
+    
+    if ( !m_wanted.empty() )
+    {
+        std::lock_guard< std::mutex > lock( m_lock );
+        
+        m_queue.insert( m_queue.end(), m_wanted.begin(), m_wanted.end() );
+        m_reading += m_wanted.size();
+        m_queueVar.notify_one();
+    }
+}
+
+void TiledSurface::threadRead( void )
+{
+    std::unique_lock< std::mutex > lock( m_lock );
+    
+    while ( !m_stop )
+    {
+        if ( m_queue.empty() )
+        {
+            m_queueVar.wait( lock );
+            continue;
+        }
+        
+        size_t tile = m_queue.front();
+        m_queue.pop_front();
+        lock.unlock();
+        
+        // handed over to update() with the next frame, null when the read failed
+        std::unique_ptr< unsigned char[] > buffer( new unsigned char[ m_tileBytes ] );
+
+#if !defined( _WIN32 )
+        if ( pread( m_file, buffer.get(), m_tileBytes, m_dataOffset + tile * m_tileBytes ) != static_cast< ssize_t >( m_tileBytes ) )
+#endif
+        {
+            buffer.reset();
+        }
+        
+        lock.lock();
+        m_loaded.push_back( LoadedTile( tile, std::move( buffer ) ) );
+    }
+}
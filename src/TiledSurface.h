@@ -0,0 +1,128 @@
+//
+//  TiledSurface.h
+//  ofxFlockDraw
+//
+
+#if !defined __TILED_SURFACE_H__
+#define __TILED_SURFACE_H__
+
+#include "ofMain.h"
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+// Full resolution companion of a reference surface too large to keep in
+// memory. The image is stored once as fixed size tiles in a raw file and
+// only the tiles the particles sample are read back, within a memory
+// budget, least recently sampled ones going first. The tiles around the
+// busiest ones are read ahead. A tile that is not in yet is sampled from
+// the window sized surface instead, so the workers never wait on the disk.
+//
+// The tile file is a header followed by the tiles in rows, each padded to
+// full size, so other tools can write one; handed in instead of an image,
+// its overview is read a tile at a time and the whole image is never in
+// memory.
+//
+// sample() is safe from the workers; everything else is main thread only.
+// A tile dropped by update() is freed one frame later, once the run that
+// may still sample it was joined, the same as a replaced surface.
+class TiledSurface
+{
+public:
+    TiledSurface( void );
+    ~TiledSurface( void );
+    
+    // writes _pixels as a tile file, aside and renamed like the surface cache
+    static bool write( const std::string& _file, const ofPixels& _pixels );
+    
+    // the whole tile file averaged down to what SurfaceCache::fit() makes of
+    // it for _width x _height, one tile in memory at a time
+    static bool readOverview( ofPixels& _pixels, const std::string& _file, size_t _width, size_t _height, size_t& _sourceWidth, size_t& _sourceHeight );
+    
+    // _overview is what the particles move over and the fallback for the
+    // tiles not read yet
+    bool    open( const std::string& _file, std::shared_ptr< ofPixels > _overview );
+    
+    size_t  getWidth( void ) const;
+    size_t  getHeight( void ) const;
+    size_t  residentBytes( void ) const;
+    
+    // _u and _v in pixels of the overview
+    ofColor sample( float _u, float _v ) const;
+    
+    // drops, requests and reads ahead tiles after what was sampled since the
+    // last call, once per frame
+    void    update( uint64_t _frame );
+
+private:
+    enum TileState : uint8_t
+    {
+        kAbsent,
+        kQueued,            // or being read
+        kResident
+    };
+    
+    struct Header
+    {
+        char        m_magic[ 4 ];
+        uint32_t    m_version;
+        uint32_t    m_width;
+        uint32_t    m_height;
+        uint32_t    m_channels;
+        uint32_t    m_tileSize;
+        uint64_t    m_dataOffset;
+    };
+    
+    typedef std::pair< size_t, std::unique_ptr< unsigned char[] > >     LoadedTile;
+    typedef std::pair< uint64_t, std::unique_ptr< unsigned char[] > >   RetiredTile;
+    
+    static bool readHeader( int _file, Header& _header );
+    
+    void    close( void );
+    void    threadRead( void );
+    
+    int                         m_file;
+    std::shared_ptr< ofPixels > m_overview;
+    size_t                      m_width;
+    size_t                      m_height;
+    size_t                      m_channels;
+    size_t                      m_tileSize;
+    size_t                      m_tileBytes;
+    size_t                      m_tilesX;
+    size_t                      m_tilesY;
+    uint64_t                    m_dataOffset;
+    float                       m_scaleX;           // full resolution pixels per overview pixel
+    float                       m_scaleY;
+    
+    // read by the workers, written by update()
+    std::unique_ptr< std::atomic< const unsigned char* >[] >   m_tiles;
+    std::unique_ptr< std::atomic< uint32_t >[] >               m_hits;     // one in TILE_HIT_STRIDE samples since the last update
+    
+    // main thread
+    std::vector< std::unique_ptr< unsigned char[] > >   m_buffers;
+    std::vector< TileState >    m_states;
+    std::vector< uint64_t >     m_lastUse;
+    std::vector< size_t >       m_resident;
+    std::vector< RetiredTile >  m_retired;
+    std::vector< LoadedTile >   m_delivered;
+    std::vector< uint32_t >     m_frameHits;
+    std::vector< size_t >       m_wanted;
+    size_t                      m_capacity;         // tiles within the budget
+    size_t                      m_reading;          // queued, being read or delivered
+    
+    // shared with the read thread
+    std::deque< size_t >        m_queue;            // most sampled first
+    std::vector< LoadedTile >   m_loaded;
+    std::thread                 m_thread;
+    std::mutex                  m_lock;
+    std::condition_variable     m_queueVar;         // a tile was queued or stopping
+    bool                        m_stop;
+};
+
+#endif // __TILED_SURFACE_H__
@@ -0,0 +1,237 @@
+#include "VideoFrameRing.h"
+#include "SurfaceCache.h"
+#include "AllocationTracker.h"
+
+#include <algorithm>
+#include <chrono>
+
+#define VIDEO_RING_FRAMES   4   // the surface, the one retired with it, the newest and the one decoding
+#define VIDEO_POLL_MS       2   // between two looks at the player
+
+VideoFrameRing::VideoFrameRing( void ) :
+    m_width( 0 ),
+    m_height( 0 ),
+    m_frameWidth( 0 ),
+    m_frameHeight( 0 ),
+    m_lastFrame( -1 ),
+    m_position( 0.0f ),
+    m_seekTo( -1.0f ),
+    m_dropped( 0 ),
+    m_late( 0 ),
+    m_stop( false )
+{
+}
+
+VideoFrameRing::~VideoFrameRing( void )
+{
+    close();
+}
+
+void VideoFrameRing::setTarget( size_t _width, size_t _height )
+{
+    std::lock_guard< std::mutex > lock( m_lock );
+    
+    m_width  = _width;
+    m_height = _height;
+}
+
+bool VideoFrameRing::open( const std::string& _path )
+{
+    close();
+    
+    std::unique_ptr< ofVideoPlayer > player( new ofVideoPlayer() );
+    player->setUseTexture( false );
+    player->setPixelFormat( OF_PIXELS_RGBA );
+    
+    if ( !player->load( _path ) )
+    {
+        return false;
+    }
+    
+    player->setLoopState( OF_LOOP_NORMAL );
+    player->play();
+    
+    m_frameWidth  = m_width;
+    m_frameHeight = m_height;
+    if ( !SurfaceCache::fittedSize( player->getWidth(), player->getHeight(), m_frameWidth, m_frameHeight ) )
+    {
+        m_frameWidth  = player->getWidth();
+        m_frameHeight = player->getHeight();
+    }
+    
+    // the frames handed out for the last video may still be sampled, the
+    // ring lets go of them and takes new slots
+    m_slots.clear();
+    for ( size_t i = 0; i < VIDEO_RING_FRAMES; ++i )
+    {
+        m_slots.push_back( std::make_shared< ofPixels >() );
+    }
+    
+    m_player    = std::move( player );
+    m_lastFrame = -1;
+    m_position  = 0.0f;
+    m_seekTo    = -1.0f;
+    m_dropped   = 0;
+    m_late      = 0;
+    m_stop      = false;
+    m_thread    = std::thread( &VideoFrameRing::threadDecode, this );
+    
+    return true;
+}
+
+void VideoFrameRing::close( void )
+{
+    if ( m_thread.joinable() )
+    {
+        {
+            std::lock_guard< std::mutex > lock( m_lock );
+            m_stop = true;
+            m_stopVar.notify_all();
+        }
+        
+        m_thread.join();
+    }
+    
+    if ( m_player )
+    {
+        m_player->close();
+        m_player.reset();
+    }
+    
+    m_latest.reset();
+}
+
+bool VideoFrameRing::isLoaded( void ) const
+{
+    return m_player != nullptr;
+}
+
+float VideoFrameRing::getWidth( void ) const
+{
+    return static_cast< float >( m_frameWidth );
+}
+
+float VideoFrameRing::getHeight( void ) const
+{
+    return static_cast< float >( m_frameHeight );
+}
+
+float VideoFrameRing::getPosition( void ) const
+{
+    return m_position;
+}
+
+void VideoFrameRing::setPosition( float _position )
+{
+    m_seekTo = std::max( _position, 0.0f );
+}
+
+bool VideoFrameRing::take( std::shared_ptr< ofPixels >& _frame )
+{
+    std::lock_guard< std::mutex > lock( m_lock );
+    
+    if ( !m_latest )
+    {
+        return false;
+    }
+    
+    _frame = std::move( m_latest );
+    return true;
+}
+
+size_t VideoFrameRing::droppedFrames( void ) const
+{
+    return m_dropped;
+}
+
+size_t VideoFrameRing::lateFrames( void ) const
+{
+    return m_late;
+}
+
+// m_lock held; a slot held by nobody else can't be taken meanwhile, take()
+// only hands out m_latest
+std::shared_ptr< ofPixels > VideoFrameRing::freeSlot( void )
+{
+    for ( auto& slot : m_slots )
+    {
+        if ( slot.use_count() == 1 )
+        {
+            return slot;
+        }
+    }
+    
+    return nullptr;
+}
+
+void VideoFrameRing::threadDecode( void )
+{
+    ALLOCATION_SCOPE( kVideo );
+    
+    std::unique_lock< std::mutex > lock( m_lock );
+    
+    while ( !m_stop )
+    {
+        size_t width  = m_width;
+        size_t height = m_height;
+        lock.unlock();
+        
+        float seekTo = m_seekTo.exchange( -1.0f );
+        if ( seekTo >= 0.0f )
+        {
+            m_player->setPosition( seekTo );
+            m_lastFrame = -1;
+        }
+        
+        m_player->update();
+        m_position = m_player->getPosition();
+        
+        if ( m_player->isFrameNew() )
+        {
+            // a jump of more than one frame was decoded by the player and
+            // replaced before this thread saw it; a loop starts over
+            int frame = m_player->getCurrentFrame();
+            if ( m_lastFrame >= 0 && frame > m_lastFrame + 1 )
+            {
+                m_late += frame - m_lastFrame - 1;
+            }
+            m_lastFrame = frame;
+            
+            lock.lock();
+            std::shared_ptr< ofPixels > slot = freeSlot();
+            lock.unlock();
+            
+            if ( !slot )
+            {
+                ++m_dropped;
+            }
+            else
+            {
+                // shrunk straight into the slot, which only allocates the first
+                // time or after a resize
+                const ofPixels& source = m_player->getPixels();
+                
+                if ( SurfaceCache::fittedSize( source.getWidth(), source.getHeight(), width, height ) )
+                {
+                    slot->allocate( width, height, source.getPixelFormat() );
+                    source.resizeTo( *slot, OF_INTERPOLATE_NEAREST_NEIGHBOR );
+                }
+                else
+                {
+                    slot->setFromPixels( source.getData(), source.getWidth(), source.getHeight(), source.getNumChannels() );
+                }
+                
+                lock.lock();
+                if ( m_latest )
+                {
+                    ++m_dropped;
+                }
+                m_latest = slot;
+                lock.unlock();
+            }
+        }
+        
+        lock.lock();
+        m_stopVar.wait_for( lock, std::chrono::milliseconds( VIDEO_POLL_MS ), [ this ](){ return m_stop; } );
+    }
+}
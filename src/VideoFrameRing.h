@@ -0,0 +1,76 @@
+//
+//  VideoFrameRing.h
+//  ofxFlockDraw
+//
+
+#if !defined __VIDEO_FRAME_RING_H__
+#define __VIDEO_FRAME_RING_H__
+
+#include "ofMain.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+// Plays a video on a thread of its own and copies every new frame, shrunk
+// to the target size, into one of a few preallocated slots. take() hands
+// the newest slot over as is, so a frame never changes while the particles
+// sample it and the main thread never waits for a decode. A slot is reused
+// once nobody but the ring holds it. The player is created without a
+// texture, so it never touches GL off the main thread.
+class VideoFrameRing
+{
+public:
+    VideoFrameRing( void );
+    ~VideoFrameRing( void );
+    
+    // size the frames are fitted to, 0 to keep them as decoded
+    void    setTarget( size_t _width, size_t _height );
+    
+    // closes the current video, false when the file is no video
+    bool    open( const std::string& _path );
+    void    close( void );
+    bool    isLoaded( void ) const;
+    
+    // size of the frames handed out, as of open()
+    float   getWidth( void ) const;
+    float   getHeight( void ) const;
+    
+    float   getPosition( void ) const;
+    void    setPosition( float _position );     // applied by the decode thread
+    
+    // the newest frame decoded since the last call, false when there is none
+    bool    take( std::shared_ptr< ofPixels >& _frame );
+    
+    // decoded frames that were never taken, and frames the player moved past
+    // before the decode thread got to them
+    size_t  droppedFrames( void ) const;
+    size_t  lateFrames( void ) const;
+
+private:
+    void threadDecode( void );
+    std::shared_ptr< ofPixels > freeSlot( void );
+    
+    std::unique_ptr< ofVideoPlayer >            m_player;
+    std::vector< std::shared_ptr< ofPixels > >  m_slots;
+    std::shared_ptr< ofPixels >                 m_latest;       // decoded, not taken yet
+    size_t                      m_width;
+    size_t                      m_height;
+    size_t                      m_frameWidth;
+    size_t                      m_frameHeight;
+    int                         m_lastFrame;                    // decode thread only
+    std::atomic< float >        m_position;
+    std::atomic< float >        m_seekTo;                       // negative when there is no seek
+    std::atomic< size_t >       m_dropped;
+    std::atomic< size_t >       m_late;
+    std::thread                 m_thread;
+    mutable std::mutex          m_lock;
+    std::condition_variable     m_stopVar;
+    bool                        m_stop;
+};
+
+#endif // __VIDEO_FRAME_RING_H__
@@ -0,0 +1,84 @@
+//
+//  WorkStealingQueue.h
+//  ofxFlockDraw
+//
+
+#if !defined __WORK_STEALING_QUEUE_H__
+#define __WORK_STEALING_QUEUE_H__
+
+#include <vector>
+#include <mutex>
+
+// Task deque owned by one worker. The owner pops from the back, so it keeps
+// working on the tasks it was handed last (and whose data it touched last),
+// while idle workers steal from the front. Tasks are pushed before a phase
+// starts and the storage is cleared by whoever takes the last one, never
+// released, so a steady frame loop does not allocate. Tasks are coarse (a
+// chunk of particles), which keeps a plain lock per deque well below the
+// cost of the work.
+template < typename T >
+class WorkStealingQueue
+{
+public:
+    WorkStealingQueue( void ) : m_front( 0 ) {}
+
+    void reserve( size_t _capacity )
+    {
+        std::lock_guard< std::mutex > lock( m_lock );
+        m_tasks.reserve( _capacity );
+    }
+
+    void push( const T& _task )
+    {
+        std::lock_guard< std::mutex > lock( m_lock );
+        m_tasks.push_back( _task );
+    }
+
+    bool pop( T& _task )
+    {
+        std::lock_guard< std::mutex > lock( m_lock );
+
+        if ( m_front == m_tasks.size() )
+        {
+            reset();
+            return false;
+        }
+
+        _task = m_tasks.back();
+        m_tasks.pop_back();
+        return true;
+    }
+
+    bool steal( T& _task )
+    {
+        std::lock_guard< std::mutex > lock( m_lock );
+
+        if ( m_front == m_tasks.size() )
+        {
+            return false;
+        }
+
+        _task = m_tasks[ m_front++ ];
+
+        // the owner may never come back to a queue stolen empty, so the
+        // thief clears it
+        if ( m_front == m_tasks.size() )
+        {
+            reset();
+        }
+        return true;
+    }
+
+private:
+    void reset( void )
+    {
+        m_tasks.clear();
+        m_front = 0;
+    }
+
+    std::mutex                  m_lock;
+    std::vector< T >            m_tasks;
+    size_t                      m_front;    // next task to be stolen
+};
+
+#endif // __WORK_STEALING_QUEUE_H__
@@ -0,0 +1,242 @@
+#include "WorkerPool.h"
+#include "FrameBarrier.h"
+#include "AllocationTracker.h"
+#include "ofMain.h"
+
+#include <algorithm>
+
+#if defined( __linux__ )
+#include <pthread.h>
+#include <sched.h>
+#elif defined( __APPLE__ )
+#include <pthread.h>
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+#endif
+
+#define POOL_SPIN_COUNT 4000
+#define POOL_MAX_JOBS   16
+
+// Best effort: pins a worker to a core of its own, or only keeps it off the
+// first _reservedCores cores, which setMainAffinity gives to the main thread.
+// macOS has no hard affinity, distinct affinity tags only ask the scheduler
+// to keep the workers apart.
+static void setWorkerAffinity( std::thread& _thread, size_t _worker, bool _pin, size_t _reservedCores )
+{
+    size_t cores = std::max< size_t >( std::thread::hardware_concurrency(), 1 );
+    
+    if ( ( !_pin && _reservedCores == 0 ) || _reservedCores >= cores )
+    {
+        return;
+    }
+
+#if defined( __linux__ )
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    
+    if ( _pin )
+    {
+        CPU_SET( _reservedCores + _worker % ( cores - _reservedCores ), &set );
+    }
+    else
+    {
+        for ( size_t core = _reservedCores; core < cores; ++core )
+        {
+            CPU_SET( core, &set );
+        }
+    }
+    
+    if ( pthread_setaffinity_np( _thread.native_handle(), sizeof( set ), &set ) != 0 )
+    {
+        ofLogWarning( "WorkerPool" ) << "could not set the affinity of worker " << _worker;
+    }
+#elif defined( __APPLE__ )
+    if ( _pin )
+    {
+        thread_affinity_policy_data_t policy = { static_cast< integer_t >( _worker + 1 ) };
+        thread_policy_set( pthread_mach_thread_np( _thread.native_handle() ), THREAD_AFFINITY_POLICY, reinterpret_cast< thread_policy_t >( &policy ), THREAD_AFFINITY_POLICY_COUNT );
+    }
+#endif
+}
+
+// Moves the calling thread, the main one, to the first _reservedCores cores,
+// or back to all of them with none reserved. Linux only; threads started from
+// it afterwards inherit the set, which is how the audio stream's callback
+// thread gets there, that one is opened after the first frame. Threads that
+// were already running keep theirs.
+static void setMainAffinity( size_t _reservedCores )
+{
+#if defined( __linux__ )
+    size_t    cores = std::max< size_t >( std::thread::hardware_concurrency(), 1 );
+    size_t    used  = _reservedCores > 0 && _reservedCores < cores ? _reservedCores : cores;
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    
+    for ( size_t core = 0; core < used; ++core )
+    {
+        CPU_SET( core, &set );
+    }
+    
+    if ( pthread_setaffinity_np( pthread_self(), sizeof( set ), &set ) != 0 )
+    {
+        ofLogWarning( "WorkerPool" ) << "could not set the affinity of the main thread";
+    }
+#endif
+}
+
+WorkerPool& WorkerPool::instance( void )
+{
+    static WorkerPool s_pool;
+    return s_pool;
+}
+
+WorkerPool::WorkerPool( void ) :
+    m_threadCount( std::max< int >( std::thread::hardware_concurrency(), 2 ) - 1 ),
+    m_pin( false ),
+    m_reservedCores( 0 ),
+    m_spinCount( 0 ),
+    m_listedJobs( 0 ),
+    m_nextJob( 0 ),
+    m_busy( 0 ),
+    m_parked( 0 ),
+    m_stop( false )
+{
+    m_jobs.reserve( POOL_MAX_JOBS );
+    startThreads();
+}
+
+WorkerPool::~WorkerPool( void )
+{
+    stopThreads();
+}
+
+void WorkerPool::configure( size_t _threads, bool _pin, size_t _reservedCores )
+{
+    _threads = std::max< size_t >( _threads, 1 );
+    
+    if ( _threads == m_threadCount && _pin == m_pin && _reservedCores == m_reservedCores )
+    {
+        return;
+    }
+    
+    stopThreads();
+    
+    if ( _reservedCores != m_reservedCores )
+    {
+        setMainAffinity( _reservedCores );
+    }
+    
+    m_threadCount   = _threads;
+    m_pin           = _pin;
+    m_reservedCores = _reservedCores;
+    
+    startThreads();
+    AllocationTracker::restartWarmup();
+}
+
+size_t WorkerPool::size( void ) const
+{
+    return m_threadCount;
+}
+
+void WorkerPool::post( Job& _job )
+{
+    std::lock_guard< std::mutex > lock( m_lock );
+    
+    _job.m_listed = true;
+    m_jobs.push_back( &_job );
+    m_listedJobs = m_jobs.size();
+    
+    if ( m_parked > 0 )
+    {
+        m_workVar.notify_all();
+    }
+}
+
+void WorkerPool::startThreads( void )
+{
+    // spinning only pays when every worker has a core of its own next to the main thread
+    m_spinCount = m_threadCount < std::thread::hardware_concurrency() ? POOL_SPIN_COUNT : 0;
+    
+    for ( size_t i = 0; i < m_threadCount; ++i )
+    {
+        m_threads.push_back( std::thread( &WorkerPool::threadWork, this, i ) );
+        setWorkerAffinity( m_threads.back(), i, m_pin, m_reservedCores );
+    }
+}
+
+void WorkerPool::stopThreads( void )
+{
+    // the jobs in flight finish first, and their m_done may still post more
+    {
+        std::unique_lock< std::mutex > lock( m_lock );
+        m_idleVar.wait( lock, [ this ](){ return m_jobs.empty() && m_busy == 0; } );
+        m_stop = true;
+        m_workVar.notify_all();
+    }
+    
+    for ( auto& thread : m_threads )
+    {
+        thread.join();
+    }
+    m_threads.clear();
+    
+    m_stop = false;
+}
+
+void WorkerPool::threadWork( size_t _worker )
+{
+    ALLOCATION_SCOPE( kParticles );
+    
+    std::unique_lock< std::mutex > lock( m_lock );
+    
+    while ( !m_stop )
+    {
+        if ( m_jobs.empty() )
+        {
+            // the next phase is usually posted within microseconds, so spin a
+            // little before parking
+            lock.unlock();
+            for ( size_t i = 0; i < m_spinCount && m_listedJobs == 0; ++i )
+            {
+                FRAME_BARRIER_RELAX();
+            }
+            lock.lock();
+            
+            ++m_parked;
+            m_workVar.wait( lock, [ this ](){ return m_stop || !m_jobs.empty(); } );
+            --m_parked;
+            continue;
+        }
+        
+        // round robin over the posted jobs, so a busy emitter cannot starve the others
+        Job& job = *m_jobs[ m_nextJob++ % m_jobs.size() ];
+        ++job.m_workers;
+        ++m_busy;
+        
+        lock.unlock();
+        job.m_work( _worker );
+        lock.lock();
+        
+        // it returned with nothing left to take, so nobody joins from now on
+        if ( job.m_listed )
+        {
+            m_jobs.erase( std::find( m_jobs.begin(), m_jobs.end(), &job ) );
+            m_listedJobs = m_jobs.size();
+            job.m_listed = false;
+        }
+        
+        // the last one out finishes the job
+        if ( --job.m_workers == 0 )
+        {
+            lock.unlock();
+            job.m_done();
+            lock.lock();
+        }
+        
+        if ( --m_busy == 0 && m_jobs.empty() )
+        {
+            m_idleVar.notify_all();
+        }
+    }
+}
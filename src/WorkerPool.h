@@ -0,0 +1,74 @@
+//
+//  WorkerPool.h
+//  ofxFlockDraw
+//
+
+#if !defined __WORKER_POOL_H__
+#define __WORKER_POOL_H__
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+// Process wide set of worker threads shared by every emitter, sized to the
+// machine instead of to the number of emitters. A client posts a Job; every
+// worker that picks it up calls m_work, which drains the client's own task
+// queues and returns once there is nothing left to take. The last worker out
+// calls m_done, which may post the client's next job right away. Workers pick
+// among the posted jobs round robin, so several emitters share the workers
+// fairly and fill each other's gaps at the end of a phase.
+class WorkerPool
+{
+public:
+    struct Job
+    {
+        Job( void ) : m_workers( 0 ), m_listed( false ) {}
+        
+        std::function< void ( size_t ) >    m_work;     // called with the worker index
+        std::function< void ( void ) >      m_done;
+        
+        // guarded by the pool
+        size_t                      m_workers;          // workers inside m_work
+        bool                        m_listed;           // still open to new workers
+    };
+    
+    static WorkerPool& instance( void );
+    
+    // restarts the workers when the settings changed, waiting for the jobs in
+    // flight first; only called from the main thread, which is moved to the
+    // reserved cores
+    void   configure( size_t _threads, bool _pin, size_t _reservedCores );
+    size_t size( void ) const;
+    
+    // the job must not be posted again before its m_done was called
+    void   post( Job& _job );
+
+private:
+    WorkerPool( void );
+    ~WorkerPool( void );
+    
+    void startThreads( void );
+    void stopThreads( void );
+    void threadWork( size_t _worker );
+    
+    std::vector< std::thread >  m_threads;
+    size_t                      m_threadCount;      // settings the threads were started with
+    bool                        m_pin;
+    size_t                      m_reservedCores;
+    size_t                      m_spinCount;        // 0 when the workers outnumber the cores
+    
+    std::mutex                  m_lock;
+    std::condition_variable     m_workVar;          // jobs posted or stopping
+    std::condition_variable     m_idleVar;          // no job left in flight
+    std::vector< Job* >         m_jobs;             // open to new workers
+    std::atomic_size_t          m_listedJobs;       // m_jobs.size(), for spinning without the lock
+    size_t                      m_nextJob;          // round robin
+    size_t                      m_busy;             // workers in a job's m_work or m_done
+    size_t                      m_parked;
+    bool                        m_stop;
+};
+
+#endif // __WORKER_POOL_H__
@@ -1,7 +1,27 @@
 #include "ofMain.h"
 #include "ofApp.h"
+#include "Benchmark.h"
+#include "ofAppNoWindow.h"
 #include <list>
 #include <string>
+#include <algorithm>
+#include <cstdlib>
+#include <iterator>
+
+// no window or GL context
+static int runHeadless( std::shared_ptr< ofBaseApp > _app )
+{
+    ofWindowSettings headlessSettings;
+    headlessSettings.width  = 1920;
+    headlessSettings.height = 1080;
+    
+    ofInit();
+    auto window = std::make_shared< ofAppNoWindow >();
+    ofGetMainLoop()->addWindow( window );
+    window->setup( headlessSettings );
+    ofRunApp( window, _app );
+    return ofRunMainLoop();
+}
 
 //========================================================================
 int main( int argc, char** argv ){
@@ -11,6 +31,32 @@ int main( int argc, char** argv ){
         theArgs.push_back( std::string( argv[ i ] ) );
     }
     
+    // --threads N sizes the simulation workers, for the app and the benchmark alike
+    auto threadsArg = std::find( theArgs.begin(), theArgs.end(), "--threads" );
+    if ( threadsArg != theArgs.end() && std::next( threadsArg ) != theArgs.end() )
+    {
+        ParticleEmitter::s_workerThreads = std::max( std::atoi( std::next( threadsArg )->c_str() ), 1 );
+        theArgs.erase( threadsArg, std::next( threadsArg, 2 ) );
+    }
+
+    // latency of the worker handoff alone, no openFrameworks app at all
+    if ( std::find( theArgs.begin(), theArgs.end(), "--pool-benchmark" ) != theArgs.end() )
+    {
+        return Benchmark::runPoolBenchmark();
+    }
+
+    // headless simulation throughput run
+    if ( std::find( theArgs.begin(), theArgs.end(), "--benchmark" ) != theArgs.end() )
+    {
+        return runHeadless( std::make_shared< Benchmark >( Benchmark::kThroughput ) );
+    }
+    
+    // headless steady state allocation check, exits non-zero on a regression
+    if ( std::find( theArgs.begin(), theArgs.end(), "--allocation-check" ) != theArgs.end() )
+    {
+        return runHeadless( std::make_shared< Benchmark >( Benchmark::kAllocations ) );
+    }
+    
 	ofGLFWWindowSettings windowSettings;
 #ifdef USE_PROGRAMMABLE_GL
     windowSettings.setGLVersion( 4, 1 );
@@ -8,6 +8,10 @@
 #define GUI_CONFIG_FILE_EXT  "xml"
 #define FRAMERATE            60.0f
 
+// playlist images are decoded this far ahead of being shown, within limits
+#define IMAGE_PREFETCH_SECONDS  2.0f
+#define IMAGE_PREFETCH_MAX      3
+
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -18,53 +22,84 @@ std::vector< std::string >  ofApp::s_particleBehaviors = { "Function", "Flocking
 
 #define threshold(n,t) ( std::max< float >( n - t, 0.0f ) / n )
 
+// copies into the destination's existing storage, so it only allocates when the size grows
+template < typename S >
+static void copyValues( std::vector< float >& _destination, const S& _source )
+{
+    _destination.assign( _source.begin(), _source.end() );
+}
+
 ofApp::ofApp( std::list< std::string >& _args ) :
-    m_particleEmitter( m_surface )
+    m_surface( nullptr ),
+    m_particleEmitter( m_surface ),
+    m_imageLoader( IMAGE_PREFETCH_MAX + 1 ),
+    m_firstFrameDrawn( false ),
+    m_checkpointTimer( 0.0f ),
+    m_noRestore( false ),
+    m_restored( false ),
+    m_noAudio( false ),
+    m_cpuFlow( false ),
+    m_audioReady( false ),
+    m_listening( false ),
+    m_postReady( false )
 {
     _args.pop_front();
+    
+    // options start with --, everything else is an image or video to show
+    for ( auto& arg : _args )
+    {
+        if ( arg == "--high-capacity" )
+        {
+            ParticleEmitter::setHighCapacity( true );
+        }
+        else if ( arg == "--no-audio" )
+        {
+            m_noAudio = true;
+        }
+        else if ( arg == "--cpu-flow" )
+        {
+            m_cpuFlow = true;
+        }
+        else if ( arg == "--no-restore" )
+        {
+            m_noRestore = true;
+        }
+        else if ( arg.compare( 0, 2, "--" ) != 0 )
+        {
+            m_files.push_back( arg );
+        }
+    }
 }
 
 //--------------------------------------------------------------
 void ofApp::setup()
 {
+    StartupTimeline::Stage stage( "Setup" );
+    
     // Initialize OFX
     ofRestoreWorkingDirectoryToDefault();// little trick to make debugging easier
     ofSetLogLevel( OF_LOG_NOTICE );
     ofSetBackgroundAuto( false );
     ofSetVerticalSync( true );
  
-    ParticleEmitter::init();
-    
-    // Initialize GLSL
-    m_post.init( ofGetWidth(), ofGetHeight() );
-    m_bloomPass    = m_post.createPass< BloomPass >();
-    m_noiseWrap    = m_post.createPass< NoiseWarpPass >();
-    m_rgbShift     = m_post.createPass< RGBShiftPass >();
-    m_zoomBlurPass = m_post.createPass< ZoomBlurPass >();
-    
-    m_noiseWrap->setSpeed( 0.5f );
-    m_noiseWrap->setAmplitude( 0.0f );
-    
-    // Initialize fft processor
-    m_fft.setup();
-    m_fft.setVolumeRange( 50 );
-    m_fft.setNormalize( true );
-    
-    m_audioAnalyzer.setup(
-        m_fft.fft.stream.getSampleRate(),
-        16384,
-        m_fft.fft.stream.getNumInputChannels() );
+    {
+        StartupTimeline::Stage stage( "Particle emitter" );
+        ParticleEmitter::init();
+    }
     
+    // optical flow, post processing and audio are set up on first use
     
     ofBackground( 0, 0, 0 );
     ofSetFrameRate( 60 );
     ofPoint displaySz   = ofGetWindowSize();
     
-    m_video.setPixelFormat( OF_PIXELS_RGBA );
-    
-    
     m_frameBufferObject.allocate( displaySz.x, displaySz.y, GL_RGBA32F_ARB );
     
+    // the reference surfaces are only sampled at window resolution
+    m_imageLoader.setCacheDirectory( ofToDataPath( "surface-cache", true ) );
+    m_imageLoader.setTarget( displaySz.x, displaySz.y );
+    m_video.setTarget( displaySz.x, displaySz.y );
+    
     // config vars
     m_cycleImageEvery = 0.0;
     
@@ -115,6 +150,7 @@ void ofApp::setup()
     m_mainPanel->addGroup( Particle::s_particleParameters );
     m_mainPanel->addGroup( ParticleEmitter::FuncCtl::s_functionParams );
     m_mainPanel->addGroup( ParticleEmitter::s_flockingParams );
+    m_mainPanel->addGroup( ParticleEmitter::s_lodParams );
     
     
     ofxGuiGroup* uiGroup = m_mainPanel->addGroup( "Function Mode" );
@@ -134,10 +170,10 @@ void ofApp::setup()
     updateFunctionType();
     
     uiGroup = m_mainPanel->addGroup( "FX" );
-    uiGroup->add< ofxGuiToggle >( "RGB Shift",  m_rgbShift->getEnabled()        )->addListener( this, &ofApp::onToggleRGBShiftPass   );
-    uiGroup->add< ofxGuiToggle >( "Noise Wrap", m_noiseWrap->getEnabled()       )->addListener( this, &ofApp::onToggleNoiseWarpPass  );
-    uiGroup->add< ofxGuiToggle >( "Bloom Pass", m_bloomPass->getEnabled()       )->addListener( this, &ofApp::onToggleBloomPass      );
-    uiGroup->add< ofxGuiToggle >( "Zoom Blur",  m_zoomBlurPass->getEnabled()    )->addListener( this, &ofApp::onToggleZoomBlurPass   );
+    uiGroup->add< ofxGuiToggle >( m_rgbShiftEnabled     )->addListener( this, &ofApp::onToggleRGBShiftPass   );
+    uiGroup->add< ofxGuiToggle >( m_noiseWarpEnabled    )->addListener( this, &ofApp::onToggleNoiseWarpPass  );
+    uiGroup->add< ofxGuiToggle >( m_bloomEnabled        )->addListener( this, &ofApp::onToggleBloomPass      );
+    uiGroup->add< ofxGuiToggle >( m_zoomBlurEnabled     )->addListener( this, &ofApp::onToggleZoomBlurPass   );
     
     uiGroup->add( m_strobe );
     uiGroup->add( m_renderOpticalFlow );
@@ -148,8 +184,12 @@ void ofApp::setup()
     //m_mainPanel->addSpacer( 0, 10 );
     
     m_mainPanel->add< ofxGuiLabel  >( "Audio Settings/vis" );
+    m_mainPanel->add( m_audioInput );
     m_mainPanel->add( m_smoothing );
     
+    m_mainPanel->addSpacer( 0, 10 );
+    m_mainPanel->add( m_checkpointEvery );
+    
     m_mainPanel->addSpacer( 0, 10 );
     
     m_openImageButton = m_mainPanel->add< ofxGuiButton >( "Open Image" );
@@ -161,6 +201,9 @@ void ofApp::setup()
     m_mainPanel->addSpacer( 0, 10 );
     
     m_mainPanel->addFpsPlotter();
+    m_mainPanel->add( m_effectiveParticles );
+    m_mainPanel->add( m_droppedVideoFrames );
+    m_mainPanel->add( m_lateVideoFrames );
     
     // some info
     m_mainPanel->addSpacer( 0, 10 );
@@ -175,6 +218,32 @@ void ofApp::setup()
     
      m_mainPanel->loadFromFile( "settings.xml" );
     
+    // the command line wins over the saved settings
+    if ( m_noAudio )
+    {
+        m_audioInput = false;
+    }
+    if ( m_cpuFlow )
+    {
+        ParticleEmitter::s_cpuOpticalFlow = true;
+    }
+    
+    // picks up where the last session left, over the saved particle counts
+    m_checkpoint.setFile( ofToDataPath( "emitter.checkpoint", true ) );
+    if ( !m_noRestore )
+    {
+        StartupTimeline::Stage stage( "Checkpoint" );
+        
+        size_t                                  length = 0;
+        std::shared_ptr< const unsigned char >  data   = m_checkpoint.load( length );
+        
+        m_restored = data && m_particleEmitter.restoreCheckpoint( data.get(), length );
+        if ( data && !m_restored )
+        {
+            ofLogWarning( "ofApp" ) << "the checkpoint was written by another build, starting over";
+        }
+    }
+    
     
     // remove invalid paths
     for ( auto itr = m_files.begin(); itr != m_files.end(); ++itr ) {
@@ -205,6 +274,8 @@ void ofApp::setup()
         m_cycleCounter  = -1.0;
     }
     
+    setupFrameGraph();
+    
     // mark the time to test counters
     m_lastTime = ofGetElapsedTimef();
 }
@@ -212,23 +283,198 @@ void ofApp::setup()
 //--------------------------------------------------------------
 void ofApp::update()
 {
-    float delta   = 0.0;
+    AllocationTracker::beginFrame();
+    
     m_currentTime = ofGetElapsedTimef();
-    delta         = m_currentTime - m_lastTime;
+    m_delta       = m_currentTime - m_lastTime;
+    
+    // the input stream is opened from the main thread, the audio stages only
+    // run once it is; not before the first frame is out, which would wait
+    // on the device otherwise
+    if ( m_audioInput && !m_audioReady && m_firstFrameDrawn )
+    {
+        setupAudio();
+    }
+    m_listening = m_audioInput && m_audioReady;
+    
+    m_frameGraph.run();
+    
+    m_lastTime = m_currentTime;
+    
+    AllocationTracker::endFrame();
+}
+
+// The stages of update, in the order they used to run one after the other.
+// The audio ones only touch the sound buffers, so they run on the workers
+// next to the video, image and flow ones, which need the GL context; the
+// plotters they feed are handed the results back on the main thread.
+void ofApp::setupFrameGraph( void )
+{
+    m_frameGraph.addNode( "Image",           FrameGraph::kMainThread,  0,                                     kSurface | kVideoFrame,       [ this ](){ updateImage(); } );
+    m_frameGraph.addNode( "Video",           FrameGraph::kMainThread,  0,                                     kVideoFrame,                  [ this ](){ updateVideo(); } );
+    m_frameGraph.addNode( "FFT",             FrameGraph::kAnyThread,   0,                                     kSoundBuffer | kSoundLevels,  [ this ](){ updateSoundLevels(); } );
+    m_frameGraph.addNode( "Audio Analysis",  FrameGraph::kAnyThread,   kSoundBuffer,                          kAudioFeatures,               [ this ](){ updateAudioAnalysis(); } );
+    m_frameGraph.addNode( "Audio Plots",     FrameGraph::kMainThread,  kAudioFeatures,                        0,                            [ this ](){ updateAudioPlots(); } );
+    m_frameGraph.addNode( "Post Processing", FrameGraph::kMainThread,  kSoundLevels | kAudioFeatures,         0,                            [ this ](){ updatePostProcessing(); } );
+    m_frameGraph.addNode( "Flow",            FrameGraph::kMainThread,  kVideoFrame,                           kSurface | kFlowField,        [ this ](){ updateFlow(); } );
+    m_frameGraph.addNode( "Particles",       FrameGraph::kMainThread,  kSoundLevels | kSurface | kFlowField,  0,                            [ this ](){ updateParticles(); } );
+}
+
+// Checkpoint >>>
+// taken by the workers at the end of the next run; skipped while the last one
+// is still being written, the next frame tries again
+void ofApp::requestCheckpoint( void )
+{
+    std::vector< unsigned char >* buffer = m_checkpoint.acquire();
+    
+    if ( buffer != nullptr )
+    {
+        m_particleEmitter.requestCheckpoint( *buffer );
+        m_checkpointTimer = 0.0f;
+    }
+}
+
+// the last one, taken right away and on disk when this returns
+void ofApp::writeCheckpoint( void )
+{
+    m_checkpoint.flush();
+    
+    std::vector< unsigned char >* buffer = m_checkpoint.acquire();
+    
+    if ( buffer != nullptr )
+    {
+        m_particleEmitter.writeCheckpoint( *buffer );
+        m_checkpoint.write();
+        m_checkpoint.flush();
+    }
+}
+// Checkpoint <<<
+
+// Image update >>>
+void ofApp::updateImage( void )
+{
+    // the emitter joined the last run sampling them in the previous frame
+    m_retiredSurfaces.erase( std::remove_if( m_retiredSurfaces.begin(), m_retiredSurfaces.end(),
+        [ & ]( const RetiredSurface& _retired ){ return _retired.first < ofGetFrameNum(); } ), m_retiredSurfaces.end() );
     
     if ( !m_imageToSet.empty() )
     {
         changeImage();
     }
+    
+    // the tiles sampled during the last frame are read in for the next ones
+    if ( m_reference.m_tiles )
+    {
+        m_reference.m_tiles->update( ofGetFrameNum() );
+    }
+    
+    // decode the next images of the playlist before their turn, as many as
+    // are shown within IMAGE_PREFETCH_SECONDS
+    if ( m_cycleCounter != -1.0 && m_files.size() > 1 )
+    {
+        size_t ahead = static_cast< size_t >( std::ceil( IMAGE_PREFETCH_SECONDS / std::max( m_cycleImageEvery, 0.001f ) ) );
+        ahead        = std::min< size_t >( std::min< size_t >( ahead, IMAGE_PREFETCH_MAX ), m_files.size() - 1 );
+        
+        auto file = m_files.begin();
+        for ( size_t i = 0; i < std::max< size_t >( ahead, 1 ); ++i, ++file )
+        {
+            m_imageLoader.request( *file );
+        }
+    }
+    
+    if ( m_cycleCounter != -1.0 )
+    {
+        m_cycleCounter += m_delta;
+        
+        if ( m_cycleCounter >= m_cycleImageEvery && m_files.size() > 1 )
+        {
+            m_cycleCounter -= m_cycleImageEvery;
+            
+            std::string aPath = m_files.front();
+            m_files.pop_front( );
+            m_files.push_back( aPath );
+            
+            setImage( aPath );
+        }
+    }
+}
+// Image update <<<
+
+// Video Update >>>
+void ofApp::updateVideo( void )
+{
+    ALLOCATION_SCOPE( kVideo );
+    
+    // the ring decodes on its own thread, this only picks up the newest frame;
+    // the step running since the last frame keeps the one it samples
+    if ( m_video.isLoaded() && m_video.take( m_videoFrame ) )
+    {
+        m_videoTexture.loadData( *m_videoFrame );
+    }
+    
+    m_droppedVideoFrames = static_cast< int >( m_video.droppedFrames() );
+    m_lateVideoFrames    = static_cast< int >( m_video.lateFrames() );
+}
+// Video Update <<<
+
+// Audio update >>>
+void ofApp::setupAudio( void )
+{
+    StartupTimeline::Stage stage( "Audio" );
+    
+    // Initialize fft processor
+    m_fft.setup();
+    m_fft.setVolumeRange( 50 );
+    m_fft.setNormalize( true );
+    
+    m_audioAnalyzer.setup(
+        m_fft.fft.stream.getSampleRate(),
+        16384,
+        m_fft.fft.stream.getNumInputChannels() );
+    
+    m_audioReady = true;
+}
 
-    // Video Update >>>
-    m_video.update();
-    // Video Update <<<
+void ofApp::updateSoundLevels( void )
+{
+    ALLOCATION_SCOPE( kAudio );
+    if ( !m_listening )
+    {
+        m_particleEmitter.m_soundLow = m_particleEmitter.m_soundMid = m_particleEmitter.m_soundHigh = 0.0f;
+        return;
+    }
     
-    // Audio update >>>
-    m_fft.update();
+    {
+        // what the libraries do inside is not ours to keep off the heap
+        ALLOCATION_SCOPE( kAudioLibraries );
+        m_fft.update();
+    }
     m_soundBuffer.copyFrom( m_fft.fft.getAudio(), m_fft.fft.stream.getNumInputChannels(), m_fft.fft.stream.getSampleRate() );
-    m_audioAnalyzer.analyze( m_soundBuffer );
+    
+    const auto& spectrum     = m_fft.getSpectrum();
+    size_t spectrumSize      = spectrum.size();
+    size_t thirdSpectrumSize = spectrumSize / 3;
+    
+    float* valPointers[ 3 ]  = { &m_particleEmitter.m_soundLow, &m_particleEmitter.m_soundMid, &m_particleEmitter.m_soundHigh };
+    *valPointers[ 0 ] = *valPointers[ 1 ] = *valPointers[ 2 ] = 0;
+    for ( size_t i = 0; i < spectrumSize; i++ )
+    {
+        *valPointers[ std::min< size_t >( i / thirdSpectrumSize, 2 ) ] += spectrum[ i ] / thirdSpectrumSize;
+    }
+}
+
+void ofApp::updateAudioAnalysis( void )
+{
+    ALLOCATION_SCOPE( kAudio );
+    if ( !m_listening )
+    {
+        return;
+    }
+    
+    {
+        ALLOCATION_SCOPE( kAudioLibraries );
+        m_audioAnalyzer.analyze( m_soundBuffer );
+    }
     
     m_rms               = m_audioAnalyzer.getValue( RMS,                    0, m_smoothing );
     m_power             = m_audioAnalyzer.getValue( POWER,                  0, m_smoothing );
@@ -257,35 +503,82 @@ void ofApp::update()
     
     m_dissonance        = m_audioAnalyzer.getValue( DISSONANCE,             0, m_smoothing );
     
-    m_spectrum          = m_audioAnalyzer.getValues( SPECTRUM,              0, m_smoothing );
-    m_melBands          = m_audioAnalyzer.getValues( MEL_BANDS,             0, m_smoothing );
-    m_mfcc              = m_audioAnalyzer.getValues( MFCC,                  0, m_smoothing );
-    m_hpcp              = m_audioAnalyzer.getValues( HPCP,                  0, m_smoothing );
+    // assign into the existing buffers instead of copying whole vectors each frame
+    copyValues( m_spectrum,     m_audioAnalyzer.getValues( SPECTRUM,        0, m_smoothing ) );
+    copyValues( m_melBands,     m_audioAnalyzer.getValues( MEL_BANDS,       0, m_smoothing ) );
+    copyValues( m_mfcc,         m_audioAnalyzer.getValues( MFCC,            0, m_smoothing ) );
+    copyValues( m_hpcp,         m_audioAnalyzer.getValues( HPCP,            0, m_smoothing ) );
     
-    m_tristimulus       = m_audioAnalyzer.getValues( TRISTIMULUS,           0, m_smoothing );
+    copyValues( m_tristimulus,  m_audioAnalyzer.getValues( TRISTIMULUS,     0, m_smoothing ) );
     
     m_isOnset           = m_audioAnalyzer.getOnsetValue( 0 );
+}
+
+// the plotters are GUI widgets, drawn on the main thread
+void ofApp::updateAudioPlots( void )
+{
+    if ( !m_listening )
+    {
+        return;
+    }
     
     m_spectrumPlotter->setBuffer( m_spectrum );
     m_melBandsPlotter->setBuffer( m_melBands );
     m_mfccPlotter->setBuffer( m_mfcc );
     m_hpcpPlotter->setBuffer( m_hpcp );
     m_tristimulusPlotter->setBuffer( m_tristimulus );
+}
+// Audio update <<<
+
+// Post processing update >>>
+bool ofApp::isPostProcessingEnabled( void ) const
+{
+    return m_rgbShiftEnabled || m_noiseWarpEnabled || m_bloomEnabled || m_zoomBlurEnabled;
+}
+
+// the passes render in the order they were created, so they are all set up
+// together the first time one of them is on
+void ofApp::setupPostProcessing( void )
+{
+    StartupTimeline::Stage stage( "Post processing" );
     
+    // Initialize GLSL
+    m_post.init( ofGetWidth(), ofGetHeight() );
+    m_bloomPass    = m_post.createPass< BloomPass >();
+    m_noiseWrap    = m_post.createPass< NoiseWarpPass >();
+    m_rgbShift     = m_post.createPass< RGBShiftPass >();
+    m_zoomBlurPass = m_post.createPass< ZoomBlurPass >();
     
-    auto spectrum            = m_fft.getSpectrum();
-    size_t spectrumSize      = spectrum.size();
-    size_t thirdSpectrumSize = spectrumSize / 3;
+    m_noiseWrap->setSpeed( 0.5f );
+    m_noiseWrap->setAmplitude( 0.0f );
     
-    float* valPointers[ 3 ]  = { &m_particleEmitter.m_soundLow, &m_particleEmitter.m_soundMid, &m_particleEmitter.m_soundHigh };
-    *valPointers[ 0 ] = *valPointers[ 1 ] = *valPointers[ 2 ] = 0;
-    for ( size_t i = 0; i < spectrumSize; i++ )
+    m_rgbShift->setEnabled( m_rgbShiftEnabled );
+    m_noiseWrap->setEnabled( m_noiseWarpEnabled );
+    m_bloomPass->setEnabled( m_bloomEnabled );
+    m_zoomBlurPass->setEnabled( m_zoomBlurEnabled );
+    
+    m_postReady = true;
+}
+
+void ofApp::updatePostProcessing( void )
+{
+    ALLOCATION_SCOPE( kPostProcessing );
+    if ( !isPostProcessingEnabled() )
     {
-        *valPointers[ std::min< size_t >( i / thirdSpectrumSize, 2 ) ] += spectrum[ i ] / thirdSpectrumSize;
+        return;
+    }
+    
+    // the shaders are built once the first frame is out, that one goes out
+    // without the passes
+    if ( !m_postReady )
+    {
+        if ( !m_firstFrameDrawn )
+        {
+            return;
+        }
+        setupPostProcessing();
     }
-    // Audio update <<<
     
-    // Post processing update >>>
     float rgbShift = m_particleEmitter.m_soundHigh;
     rgbShift *= rgbShift * 2;
     rgbShift /= 20.0f;
@@ -298,47 +591,54 @@ void ofApp::update()
         m_noiseWrap->setAmplitude( threshold( m_particleEmitter.m_soundLow, 0.3f ) / 50 );
     }
     
-    m_zoomBlurPass->setCenterX( m_tristimulus[ 1 ] );
-    m_zoomBlurPass->setCenterY( m_tristimulus[ 2 ] );
-    m_zoomBlurPass->setDensity( m_tristimulus[ 0 ] / 25.0f );
-    // Post processing update <<<
+    // empty until the audio was analyzed once
+    if ( m_tristimulus.size() >= 3 )
+    {
+        m_zoomBlurPass->setCenterX( m_tristimulus[ 1 ] );
+        m_zoomBlurPass->setCenterY( m_tristimulus[ 2 ] );
+        m_zoomBlurPass->setDensity( m_tristimulus[ 0 ] / 25.0f );
+    }
+}
+// Post processing update <<<
 
-    // Image update >>>
-    if ( m_cycleCounter != -1.0 )
+// Flow update >>>
+void ofApp::updateFlow( void )
+{
+    if ( m_video.isLoaded() )
     {
-        m_cycleCounter += delta;
+        bool isNewFrame = m_videoFrame != nullptr;
         
-        if ( m_cycleCounter >= m_cycleImageEvery && m_files.size() > 1 )
+        if ( isNewFrame )
         {
-            m_cycleCounter -= m_cycleImageEvery;
-            
-            std::string aPath = m_files.front();
-            m_files.pop_front( );
-            m_files.push_back( aPath );
-            
-            setImage( aPath );
+            swapSurface( { std::move( m_videoFrame ), nullptr, nullptr } );
         }
+        
+        m_particleEmitter.updateVideo( isNewFrame, m_videoTexture, m_reference.m_pixels, m_delta );
     }
-    // Image update <<<
+}
+// Flow update <<<
+
+// Particle update >>>
+void ofApp::updateParticles( void )
+{
+    Particle::s_particleSizeRatio = std::min< float >( std::max< float >( m_particleEmitter.m_soundLow * 3.0f, 0.30f ), 5.5f ) * 0.1f;
     
-    // Flow update >>>
-    if ( m_video.isLoaded() )
+    // handed over between runs, the last one is joined anyway
+    if ( m_particleEmitter.isCheckpointTaken() )
     {
-        m_surface = &m_video.getPixels();
-        m_particleEmitter.updateVideo( m_video.isFrameNew(), m_video, delta );
+        m_checkpoint.write();
     }
-    // Flow update <<<
     
+    m_checkpointTimer += m_delta;
+    if ( m_checkpointEvery > 0 && m_checkpointTimer >= m_checkpointEvery && !m_particleEmitter.isPrewarming() )
+    {
+        requestCheckpoint();
+    }
     
-    // Particle update >>>
-    
-    Particle::s_particleSizeRatio = std::min< float >( std::max< float >( m_particleEmitter.m_soundLow * 3.0f, 0.30f ), 5.5f ) * 0.1f;
-    m_particleEmitter.update( m_currentTime, delta );
-    // Particle update <<<
-
-    
-    m_lastTime = m_currentTime;
+    m_particleEmitter.update( m_currentTime, m_delta );
+    m_effectiveParticles = static_cast< int >( m_particleEmitter.effectiveParticles() );
 }
+// Particle update <<<
 
 //--------------------------------------------------------------
 void ofApp::draw()
@@ -356,7 +656,10 @@ void ofApp::draw()
             ofDrawRectangle( 0, 0, displaySz.x, displaySz.y );
         
             ofSetColor( 0, 0, 0, 255 );
-            m_particleEmitter.draw();
+            if ( !m_particleEmitter.isPrewarming() )
+            {
+                m_particleEmitter.draw();
+            }
         }
         ofDisableBlendMode();
     }
@@ -364,18 +667,22 @@ void ofApp::draw()
     
     // save what happened to the framebuffer
     ofSetColor( 255, 255, 255 );
-    m_post.begin();
+    bool postProcessing = m_postReady && isPostProcessingEnabled();
+    if ( postProcessing )
+    {
+        m_post.begin();
+    }
     {
         ofSetColor( 255, 255, 255 );
         m_frameBufferObject.draw( 0, 0 );
         
-        if ( m_overlay )
+        if ( m_overlay && m_surface != nullptr )
         {
             {
                 ofSetColor( 255, 255, 255, 255 * m_opacity );
-                if ( m_video.isLoaded() )
+                if ( m_video.isLoaded() && m_videoTexture.isAllocated() )
                 {
-                    m_video.draw(
+                    m_videoTexture.draw(
                                  m_particleEmitter.m_position.x,
                                  m_particleEmitter.m_position.y,
                                  m_particleEmitter.m_referenceSurface->getWidth()  * m_particleEmitter.m_sizeFactor,
@@ -412,14 +719,17 @@ void ofApp::draw()
         
         ofSetColor( 255, 255, 255 );
     }
-    m_post.end();
+    if ( postProcessing )
+    {
+        m_post.end();
+    }
     
     if ( ParticleEmitter::s_debugDraw )
     {
         m_particleEmitter.debugDraw();
     }
     
-    if ( 0 && s_debugFFt )
+    if ( 0 && s_debugFFt && m_audioReady )
     {
         m_fft.drawHistoryGraph( ofPoint( 824,   0 ), LOW  );
         m_fft.drawHistoryGraph( ofPoint( 824, 200 ), MID  );
@@ -436,7 +746,7 @@ void ofApp::draw()
         ofDrawBitmapStringHighlight( "HIGH: " + ofToString( m_particleEmitter.m_soundHigh ), 400, 340 );
     }
     
-    if ( m_renderOpticalFlow )
+    if ( m_renderOpticalFlow && m_surface != nullptr )
     {
         m_particleEmitter.drawOpticalFlow();
     }
@@ -445,6 +755,12 @@ void ofApp::draw()
     
     // draw the UI
     //m_gui->draw();
+    
+    if ( !m_firstFrameDrawn )
+    {
+        m_firstFrameDrawn = true;
+        StartupTimeline::mark( "First frame" );
+    }
 }
 
 //--------------------------------------------------------------
@@ -518,6 +834,12 @@ void ofApp::keyPressed(int key){
         }
         break;
         
+        case 't':
+        {
+            m_frameGraph.logTimings();
+        }
+        break;
+        
         case OF_KEY_LEFT:
         {
             m_video.setPosition( std::max< float >( 0.0f, m_video.getPosition() - 0.01 ) );
@@ -554,6 +876,12 @@ void ofApp::keyPressed(int key){
 
 void ofApp::exit( ofEventArgs & args )
 {
+    // a last one, on disk before the app goes
+    if ( m_checkpointEvery > 0 && !m_particleEmitter.isPrewarming() )
+    {
+        writeCheckpoint();
+    }
+    
     m_particleEmitter.killAll();
 }
 
@@ -594,7 +922,8 @@ void ofApp::mouseExited(int x, int y){
 
 //--------------------------------------------------------------
 void ofApp::windowResized(int w, int h){
-
+    m_imageLoader.setTarget( w, h );
+    m_video.setTarget( w, h );
 }
 
 //--------------------------------------------------------------
@@ -674,25 +1003,37 @@ void ofApp::updateFunctionType( void )
 
 void ofApp::onToggleRGBShiftPass( bool& b )
 {
-    m_rgbShift->setEnabled( b );
+    if ( m_rgbShift )
+    {
+        m_rgbShift->setEnabled( b );
+    }
     return false;
 }
 
 void ofApp::onToggleNoiseWarpPass( bool& b )
 {
-    m_noiseWrap->setEnabled( b );
+    if ( m_noiseWrap )
+    {
+        m_noiseWrap->setEnabled( b );
+    }
     return false;
 }
 
 void ofApp::onToggleBloomPass( bool& b )
 {
-    m_bloomPass->setEnabled( b );
+    if ( m_bloomPass )
+    {
+        m_bloomPass->setEnabled( b );
+    }
     return false;
 }
 
 void ofApp::onToggleZoomBlurPass( bool& b )
 {
-    m_zoomBlurPass->setEnabled( b );
+    if ( m_zoomBlurPass )
+    {
+        m_zoomBlurPass->setEnabled( b );
+    }
     return false;
 }
 
@@ -790,41 +1131,64 @@ void ofApp::updateOutputArea( ofVec2f _imageSize )
 void ofApp::setImage( std::string _path )
 {
     m_imageToSet = _path;
+    m_imageLoader.request( _path );
+}
+
+// The old surface stays alive until the run in flight, which snapshotted it
+// with the emitter's parameters, was joined; the next run picks the new one
+// up, so the workers are neither paused nor waited for.
+void ofApp::swapSurface( const ReferenceSurface& _surface )
+{
+    if ( m_reference.m_pixels )
+    {
+        m_retiredSurfaces.push_back( RetiredSurface( ofGetFrameNum(), m_reference ) );
+    }
+    
+    m_reference = _surface;
+    m_surface   = m_reference.m_pixels.get();
+    m_particleEmitter.m_referenceSurface = m_surface;
+    m_particleEmitter.m_tiledSurface     = m_reference.m_tiles.get();
+    m_particleEmitter.m_emissionMap      = m_reference.m_emission.get();
 }
 
 void ofApp::changeImage( void )
 {
-    m_particleEmitter.pauseThreads();
-    m_particleEmitter.waitThreadedUpdate();
+    // images are decoded in the background and the current one stays until
+    // the new one is ready
+    ReferenceSurface    surface;
+    ImageLoader::Status status = m_imageLoader.take( m_imageToSet, surface );
     
-    if ( m_video.isLoaded() )
+    if ( status == ImageLoader::kPending )
     {
-        m_video.close();
+        return;
     }
     
-    // load the image, resize and set the texture
+    AllocationTracker::restartWarmup();
+    
+    // the frames handed out stay alive after the video is closed
+    m_video.close();
+    m_videoFrame.reset();
+    
     ofVec2f   aSize;
-    if ( m_texture.load( m_imageToSet ) )
+    if ( status == ImageLoader::kReady )
     {
-        aSize.x         = m_texture.getWidth();
-        aSize.y         = m_texture.getHeight();
-        m_surface       = &m_texture.getPixels();
-        m_particleEmitter.m_referenceSurface = m_surface;
+        aSize.x         = surface.m_pixels->getWidth();
+        aSize.y         = surface.m_pixels->getHeight();
+        swapSurface( surface );
     }
-    else if ( m_video.load( m_imageToSet ) )
+    else if ( m_video.open( m_imageToSet ) )
     {
+        // the current surface stays until the first frame is decoded
         aSize.x         = m_video.getWidth();
         aSize.y         = m_video.getHeight();
-        m_surface       = &m_video.getPixels();
-        m_particleEmitter.m_referenceSurface = m_surface;
-        m_video.setLoopState( OF_LOOP_NORMAL );
-        m_video.play();
     }
     else
     {
+        ofLogWarning( "ofApp" ) << "could not load " << m_imageToSet;
+        m_imageToSet.clear();
         return;
     }
-    
+
     
     // update  the image name
     m_currentImageLabel->setName( m_imageToSet );
@@ -833,6 +1197,14 @@ void ofApp::changeImage( void )
     //ofVec2f newSize( aSize.x * m_particleEmitter.m_sizeFactor, aSize.y * m_particleEmitter.m_sizeFactor );
     updateOutputArea( aSize );
     
+    // let the particles settle on the new image before showing them, but
+    // restored ones are shown as they were
+    if ( !m_restored )
+    {
+        m_particleEmitter.prewarm( ParticleEmitter::s_prewarmSteps );
+    }
+    m_restored = false;
+    
     // resets the cycle counter;
     m_cycleCounter = 0.0;
     
@@ -840,8 +1212,6 @@ void ofApp::changeImage( void )
     ofFile file( m_imageToSet );
     m_currentImageLabel->setName( file.getFileName() );
     
-    m_particleEmitter.continueThreads();
-    
     m_imageToSet.clear();
 }
 
@@ -7,6 +7,12 @@
 #include "ofxPostProcessing.h"
 
 #include "ParticleEmitter.h"
+#include "AllocationTracker.h"
+#include "FrameGraph.h"
+#include "ImageLoader.h"
+#include "VideoFrameRing.h"
+#include "StartupTimeline.h"
+#include "SimulationCheckpoint.h"
 
 #include <string>
 #include <list>
@@ -64,8 +70,8 @@ public:
     // properties
     ofPixels*                   m_surface;
     ofImage                     m_image;
-    ofVideoPlayer               m_video;
-    ofImage                     m_texture;
+    VideoFrameRing              m_video;
+    ofTexture                   m_videoTexture;
     ofRectangle                 m_outputArea;
     ParticleEmitter             m_particleEmitter;
     ofFbo                       m_frameBufferObject;
@@ -85,16 +91,67 @@ public:
     ofxGuiValuePlotter*         m_tristimulusPlotter;
     
     ofParameter< bool >         m_renderOpticalFlow{ "Optical Flow", false, false, true };
+    ofParameter< int >          m_effectiveParticles{ "Effective Particles", 0, 0, 4000000 };
+    ofParameter< int >          m_droppedVideoFrames{ "Dropped Video Frames", 0, 0, 100000 };
+    ofParameter< int >          m_lateVideoFrames{ "Late Video Frames", 0, 0, 100000 };
     std::vector< ofxGuiToggle* > m_functionButtons;
     ofxGui                      m_gui;
     
 private:
+    // what the update stages share, for the frame graph to order them
+    enum FrameResource
+    {
+        kSurface        = 1 << 0,   // m_surface and the emitter's reference surface
+        kVideoFrame     = 1 << 1,
+        kSoundBuffer    = 1 << 2,
+        kSoundLevels    = 1 << 3,   // the emitter's low, mid and high bands
+        kAudioFeatures  = 1 << 4,   // analyzer values and plotters
+        kFlowField      = 1 << 5
+    };
+    
+    void setupFrameGraph( void );
+    void updateImage( void );
+    void updateVideo( void );
+    void setupAudio( void );
+    void updateSoundLevels( void );
+    void updateAudioAnalysis( void );
+    void updateAudioPlots( void );
+    bool isPostProcessingEnabled( void ) const;
+    void setupPostProcessing( void );
+    void updatePostProcessing( void );
+    void updateFlow( void );
+    void updateParticles( void );
+    
+    void requestCheckpoint( void );
+    void writeCheckpoint( void );
     void changeImage( void );
+    void swapSurface( const ReferenceSurface& _surface );
     std::string                 m_imageToSet;
     
+    // decoded off the main thread, the replaced surfaces are kept alive
+    // until the frame after they were swapped out
+    typedef std::pair< uint64_t, ReferenceSurface > RetiredSurface;
+    ImageLoader                 m_imageLoader;
+    ReferenceSurface            m_reference;        // m_surface points into it
+    std::vector< RetiredSurface > m_retiredSurfaces;
+    
+    // the newest video frame, taken from the ring by the video stage and made
+    // the surface by the flow stage
+    std::shared_ptr< ofPixels > m_videoFrame;
+    
+    FrameGraph                  m_frameGraph;
+    bool                        m_firstFrameDrawn;  // the subsystems set up on first use wait for it
+    
+    // the emitter is snapshotted every so often and picked up at startup
+    SimulationCheckpoint        m_checkpoint;
+    ofParameter< int >          m_checkpointEvery{ "Checkpoint Every", 60, 0, 3600 };  // seconds, 0 for never
+    float                       m_checkpointTimer;
+    bool                        m_noRestore;        // --no-restore
+    bool                        m_restored;         // the first image skips the prewarm
     
     float                       m_lastTime;
     float                       m_currentTime;
+    float                       m_delta;
     float                       m_cycleCounter;
     
     float*                      m_lowPointer;
@@ -105,12 +162,18 @@ private:
     std::pair< int, int >       m_midFftRange;
     std::pair< int, int >       m_highFftRange;
     
+    // set up on the first frame with the audio input on
     ProcessFFT                  m_fft;
     ofxAudioAnalyzer            m_audioAnalyzer;
+    bool                        m_noAudio;          // --no-audio
+    bool                        m_cpuFlow;          // --cpu-flow, the optical flow on the workers
+    bool                        m_audioReady;
+    bool                        m_listening;        // for the audio stages of this frame
     
     // AUDIO STUFF >>
     ofSoundBuffer               m_soundBuffer;
     
+    ofParameter< bool >         m_audioInput{ "Audio Input", true, false, true };
     ofParameter< float >        m_smoothing{ "Smoothing", 0.1f, 0.0f, 1.0f };
     ofParameter< float >        m_rms{ "RMS", 0.0f, 0.0f, 1.0f };
     ofParameter< float >        m_power{ "Power", 0.0f, 0.0f, 1.0f };;
@@ -154,6 +217,12 @@ private:
     static std::vector< std::string >  s_particleBehaviors;
     
     // POST PROCESSING STUFF >>
+    // the passes are created the first frame one of them is on
+    ofParameter< bool >                 m_rgbShiftEnabled{ "RGB Shift", true, false, true };
+    ofParameter< bool >                 m_noiseWarpEnabled{ "Noise Wrap", true, false, true };
+    ofParameter< bool >                 m_bloomEnabled{ "Bloom Pass", true, false, true };
+    ofParameter< bool >                 m_zoomBlurEnabled{ "Zoom Blur", true, false, true };
+    bool                                m_postReady;
     ofxPostProcessing                   m_post;
     std::shared_ptr< RGBShiftPass >     m_rgbShift;
     std::shared_ptr< NoiseWarpPass >    m_noiseWrap;
@@ -9,18 +9,26 @@
 #define ofSpatialMatrix_h
 
 #include <vector>
+#include <algorithm>
 #include "ofPoint.h"
 
 // initial cell size must be get area / 4
+//
+// Cells are singly linked lists threaded through one entry array, so the
+// matrix can be cleared and refilled every frame without giving memory back
+// or regrowing per-cell vectors. Visitors are taken as templates to avoid
+// the std::function wrapping (and its possible allocation) per query. A
+// radius visitor returns false to end its query early.
 template < typename T >
 class spatial_matrix {
     typedef T                                   type_t;
     typedef spatial_matrix< type_t >            self_t;
-    typedef std::vector< type_t* >              cell_t;
-    typedef std::vector< cell_t >               matrix_t;
     
-    typedef std::function< void ( self_t& matrix, type_t& a, type_t& b ) > radius_visitor_function_t;
-    typedef std::function< void ( self_t& matrix, type_t& a ) >            visitor_function;
+    struct entry_t {
+        type_t* element;
+        int     next;
+    };
+    
 public:
     explicit spatial_matrix( float cell_radius, float field_width, float field_height )
     {
@@ -31,30 +39,37 @@ public:
     
     void resize( float cell_radius, float field_width, float field_height )
     {
-        clear();
         _c_r = cell_radius;
         _f_w = field_width;
         _f_h = field_height;
         _w   = static_cast< size_t >( _f_w / _c_r ) + 1;
         _h   = static_cast< size_t >( _f_h / _c_r ) + 1;
         
-        _cells.resize( _w * _h + 1);
+        _heads.resize( _w * _h + 1 );
+        clear();
+    }
+    
+    // makes room for the given number of elements up front
+    void reserve( size_t elements )
+    {
+        _entries.reserve( elements );
     }
     
     void clear( void )
     {
-        for ( auto& cell : _cells )
-        {
-            cell.clear();
-        }
+        std::fill( _heads.begin(), _heads.end(), -1 );
+        _entries.clear();
     }
     
     void insert( T& element, const ofPoint& position )
     {
-        _get_cell( position ).push_back( &element );
+        int& head = _heads[ _get_index( position ) ];
+        _entries.push_back( { &element, head } );
+        head = static_cast< int >( _entries.size() - 1 );
     }
     
-    void apply_to_radius( radius_visitor_function_t f, T& source_object, const ofPoint& position, float radius )
+    template < typename F >
+    void apply_to_radius( F&& f, T& source_object, const ofPoint& position, float radius )
     {
         size_t d = static_cast< size_t >( ( radius     + radius ) / _c_r ) + 1;
         int _x   = static_cast< size_t >( ( position.x - radius ) / _c_r );
@@ -70,56 +85,35 @@ public:
             {
                 int i = x + y * _w;
                 
-                cell_t& c = _cells[ i ];
-                for ( auto& e : c )
+                for ( int e = _heads[ i ]; e != -1; e = _entries[ e ].next )
                 {
-                    f( *this, source_object, *e );
+                    if ( !f( *this, source_object, *_entries[ e ].element ) )
+                    {
+                        return;
+                    }
                 }
             }
         }
     }
     
-    void apply_to_all( visitor_function f )
+    template < typename F >
+    void apply_to_all( F&& f )
     {
-        _apply_to_all( _cells, f );
-    }
-    
-    void clear_apply( visitor_function f )
-    {
-        matrix_t tmp_cells = _cells;
-        clear();
-        _apply_to_all( tmp_cells, f );
+        for ( auto& e : _entries )
+        {
+            f( *this, *e.element );
+        }
     }
     
-    void resize_clear_apply( float cell_radius, visitor_function f )
-    {
-        resize( cell_radius, _f_w, _f_h );
-        clear_apply( f );
-    }
 private:
     int       _get_index( const ofPoint& position )
     {
         return static_cast< size_t >( position.x / _c_r ) + ( static_cast< size_t >( position.y / _c_r ) * _w );
     }
     
-    cell_t& _get_cell( const ofPoint& position )
-    {
-        return _cells[ _get_index( position ) ];
-    }
-    
-    void _apply_to_all( matrix_t& m, visitor_function f )
-    {
-        for ( auto& c : m )
-        {
-            for ( auto& e : c )
-            {
-                f( *this, *e );
-            }
-        }
-    }
-    
 private:
-    matrix_t _cells;
+    std::vector< int >      _heads;   // first entry of each cell, -1 when empty
+    std::vector< entry_t >  _entries; // all inserted elements
     float _c_r; // cell width/height
     float _f_w; // field width
     float _f_h; // field height